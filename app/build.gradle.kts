@@ -23,7 +23,7 @@ android {
 
         // NDK configuration
         ndk {
-            abiFilters += listOf("arm64-v8a", "armeabi-v7a")
+            abiFilters += listOf("arm64-v8a", "armeabi-v7a", "x86_64")
         }
 
         externalNativeBuild {
@@ -33,6 +33,13 @@ android {
                     "-DANDROID_STL=c++_shared",
                     "-DANDROID_PLATFORM=android-29"
                 )
+                // -Pandrogpt.lto=true / -Pandrogpt.pgo=true; profiles come from src/main/cpp/tools/pgo.sh
+                if (project.findProperty("androgpt.lto") == "true") {
+                    arguments += "-DANDROGPT_LTO=ON"
+                }
+                if (project.findProperty("androgpt.pgo") == "true") {
+                    arguments += "-DANDROGPT_PGO=USE"
+                }
             }
         }
     }
@@ -71,6 +78,11 @@ android {
         resources {
             excludes += "/META-INF/{AL2.0,LGPL2.1}"
         }
+        // CPU backend variants are found by scanning the native library directory,
+        // so the libraries have to be extracted rather than loaded from the APK
+        jniLibs {
+            useLegacyPackaging = true
+        }
     }
 
     externalNativeBuild {
@@ -34,3 +34,10 @@
 -keep class dagger.hilt.** { *; }
 -keep class javax.inject.** { *; }
 -keep class * extends dagger.hilt.android.lifecycle.HiltViewModel
+
+# Keep callback interfaces invoked from JNI by method name
+-keep interface com.androgpt.yaser.data.inference.LlamaEngine$* { *; }
+
+# Keep fields of classes serialized with Gson by reflection
+-keep class com.androgpt.yaser.domain.model.GgufMetadata { *; }
+-keep class com.androgpt.yaser.data.inference.GgufIndex$Entry { *; }
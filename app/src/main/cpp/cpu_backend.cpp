@@ -0,0 +1,121 @@
+#include "cpu_backend.h"
+
+#include "ggml-backend.h"
+
+#include <dirent.h>
+#include <dlfcn.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+static const char* const VARIANT_PREFIX = "libggml-cpu-";
+static const char* const VARIANT_SUFFIX = ".so";
+
+static std::mutex g_cpu_backend_mutex;
+static bool g_cpu_backend_tried = false;
+static CpuBackendInfo g_cpu_backend;
+
+static bool variantName(const char* file, std::string& name) {
+    const size_t len = strlen(file);
+    const size_t prefix = strlen(VARIANT_PREFIX);
+    const size_t suffix = strlen(VARIANT_SUFFIX);
+    if (len <= prefix + suffix || strncmp(file, VARIANT_PREFIX, prefix) != 0 ||
+        strcmp(file + len - suffix, VARIANT_SUFFIX) != 0) {
+        return false;
+    }
+    name.assign(file + prefix, len - prefix - suffix);
+    return true;
+}
+
+/**
+ * Same check ggml's own loader makes: the variant's score function runs cpu-feats
+ * detection and returns 0 when a feature it was compiled for is missing. The library
+ * is only probed here, never initialized. A build without a score function is a
+ * generic one and ranks lowest.
+ */
+static int scoreVariant(const std::string& path) {
+    void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+        return 0;
+    }
+    using score_fn_t = int (*)();
+    auto score_fn = reinterpret_cast<score_fn_t>(dlsym(handle, "ggml_backend_score"));
+    const int score = score_fn ? score_fn() : 1;
+    dlclose(handle);
+    return score;
+}
+
+bool loadCpuBackend(const std::string& dir, const std::string& forced, CpuBackendInfo& info) {
+    std::lock_guard<std::mutex> lock(g_cpu_backend_mutex);
+    if (g_cpu_backend_tried) {
+        info = g_cpu_backend;
+        return !info.variant.empty();
+    }
+    g_cpu_backend_tried = true;
+
+    std::vector<CpuVariant> candidates;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            CpuVariant variant;
+            if (variantName(entry->d_name, variant.name)) {
+                variant.path = dir + "/" + entry->d_name;
+                variant.score = scoreVariant(variant.path);
+                candidates.push_back(std::move(variant));
+            }
+        }
+        closedir(d);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const CpuVariant& a, const CpuVariant& b) {
+        return a.score != b.score ? a.score > b.score : a.name < b.name;
+    });
+
+    const CpuVariant* chosen = nullptr;
+    for (const CpuVariant& variant : candidates) {
+        if (variant.score > 0 && (forced.empty() || variant.name == forced)) {
+            chosen = &variant;
+            break;
+        }
+    }
+    // An unsupported or unknown forced variant falls back to the best one
+    if (chosen == nullptr && !candidates.empty() && candidates.front().score > 0) {
+        chosen = &candidates.front();
+    }
+
+    g_cpu_backend.candidates = candidates;
+    if (chosen != nullptr && ggml_backend_load(chosen->path.c_str()) != nullptr) {
+        g_cpu_backend.variant = chosen->name;
+        g_cpu_backend.path = chosen->path;
+        g_cpu_backend.score = chosen->score;
+    }
+    info = g_cpu_backend;
+    return !info.variant.empty();
+}
+
+CpuBackendInfo cpuBackendInfo() {
+    std::lock_guard<std::mutex> lock(g_cpu_backend_mutex);
+    return g_cpu_backend;
+}
+
+std::string cpuBackendFeatures() {
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+    auto get_features = reg ? reinterpret_cast<ggml_backend_get_features_t>(
+            ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features")) : nullptr;
+    if (get_features == nullptr) {
+        return "";
+    }
+
+    std::string features;
+    for (const ggml_backend_feature* f = get_features(reg); f && f->name; ++f) {
+        if (!features.empty()) {
+            features += ' ';
+        }
+        features += f->name;
+        if (strcmp(f->value, "1") != 0) {
+            features += '=';
+            features += f->value;
+        }
+    }
+    return features;
+}
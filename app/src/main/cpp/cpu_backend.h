@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/**
+ * One build of ggml's CPU backend, shipped as libggml-cpu-<name>.so next to the app's
+ * native libraries. Each is compiled for a different instruction set (e.g. baseline
+ * NEON, +dotprod, +dotprod+i8mm; SSE4.2, AVX2, AVX-512 on x86_64).
+ */
+struct CpuVariant {
+    std::string name;
+    std::string path;
+    int score = 0;  // ggml_backend_score(): 0 if this CPU lacks a feature the build needs
+};
+
+struct CpuBackendInfo {
+    std::string variant;                 // loaded variant; empty when none could be loaded
+    std::string path;
+    int score = 0;
+    std::vector<CpuVariant> candidates;  // every variant probed, best score first
+};
+
+/**
+ * Scores every CPU backend variant in `dir` with its cpu-feats detection and registers
+ * the best one with ggml. A non-empty `forced` loads that variant instead, as long as
+ * the CPU supports it. Must run before any model is loaded; later calls return the
+ * result of the first.
+ */
+bool loadCpuBackend(const std::string& dir, const std::string& forced, CpuBackendInfo& info);
+
+/** Result of loadCpuBackend(), empty before it ran. */
+CpuBackendInfo cpuBackendInfo();
+
+/** Features the loaded CPU backend was built with and found, e.g. "NEON DOTPROD REPACK". */
+std::string cpuBackendFeatures();
@@ -0,0 +1,54 @@
+#include "cpu_topology.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+static bool readLong(const std::string& path, long& value) {
+    FILE* file = std::fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    const bool ok = std::fscanf(file, "%ld", &value) == 1;
+    std::fclose(file);
+    return ok;
+}
+
+std::vector<CpuCore> cpusByCapacity() {
+    std::vector<CpuCore> cpus;
+    const long n_conf = sysconf(_SC_NPROCESSORS_CONF);
+
+    for (int id = 0; id < n_conf; ++id) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+
+        // cpu0 usually has no "online" file and cannot be taken offline
+        long online = 1;
+        if (readLong(dir + "/online", online) && online == 0) {
+            continue;
+        }
+
+        long capacity = 0;
+        if (!readLong(dir + "/cpu_capacity", capacity)) {
+            readLong(dir + "/cpufreq/cpuinfo_max_freq", capacity);
+        }
+        cpus.push_back({id, capacity});
+    }
+
+    std::stable_sort(cpus.begin(), cpus.end(), [](const CpuCore& a, const CpuCore& b) {
+        return a.capacity > b.capacity;
+    });
+    return cpus;
+}
+
+std::vector<int> fastestCpus(int n) {
+    std::vector<int> ids;
+    for (const CpuCore& cpu : cpusByCapacity()) {
+        if (static_cast<int>(ids.size()) >= n) {
+            break;
+        }
+        ids.push_back(cpu.id);
+    }
+    return ids;
+}
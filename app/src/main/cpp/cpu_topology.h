@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+
+/**
+ * CPU topology as exposed by sysfs, used to keep inference threads off the
+ * efficiency cores of heterogeneous (big.LITTLE) SoCs.
+ */
+struct CpuCore {
+    int id;
+    long capacity;  // cpu_capacity, or cpuinfo_max_freq in kHz when unavailable; 0 if unknown
+};
+
+/** Online CPUs, fastest first; ties keep ascending id order. */
+std::vector<CpuCore> cpusByCapacity();
+
+/** Ids of the `n` fastest online CPUs (fewer if the device has fewer). */
+std::vector<int> fastestCpus(int n);
@@ -0,0 +1,863 @@
+#include "engine.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+#define LOG_TAG "Engine"
+#include "engine_log.h"
+
+std::mutex g_mutex;
+ModelHandle g_model;
+llama_context* g_ctx = nullptr;
+std::atomic<bool> g_should_stop{false};
+std::atomic<bool> g_background_running{false};
+std::atomic<bool> g_background_cancel{false};
+std::atomic<int> g_foreground_waiting{0};
+
+KvSession g_session;
+KvSession g_stash;
+std::string g_lora_key;
+int64_t g_window_start = -1;
+PrefixCacheStats g_prefix_stats;
+std::map<int64_t, std::string> g_history_memories;
+GenerationRequest g_last_request;
+
+// About 4 MiB of token ids, several long conversations
+static constexpr size_t TOKEN_CACHE_MAX_TOKENS = 1u << 20;
+TokenCache g_token_cache(TOKEN_CACHE_MAX_TOKENS);
+
+ModelHandle makeModelHandle(llama_model* model) {
+    return ModelHandle(model, llama_model_free);
+}
+
+bool backgroundPreempted() {
+    return g_background_running.load() && (g_foreground_waiting.load() > 0 || g_background_cancel.load());
+}
+
+bool abortBackgroundWork(void* /* data */) {
+    return backgroundPreempted();
+}
+
+void preemptBackgroundWork() {
+    if (g_background_running.load()) {
+        LOGI("Cancelling background work");
+        g_background_cancel.store(true);
+    }
+}
+
+ForegroundLock::ForegroundLock() {
+    g_foreground_waiting.fetch_add(1);
+    lock_ = std::unique_lock<std::mutex>(g_mutex);
+    g_foreground_waiting.fetch_sub(1);
+}
+
+BackgroundTask::BackgroundTask() : lock_(g_mutex) {
+    g_background_running.store(true);
+    if (yielded()) {
+        LOGI("Background work yields to a waiting request");
+    }
+}
+
+BackgroundTask::~BackgroundTask() {
+    // A cancel only applies to the task it was sent to
+    g_background_running.store(false);
+    g_background_cancel.store(false);
+}
+
+void dropStash() {
+    if (!g_stash.tokens.empty()) {
+        llama_memory_seq_rm(llama_get_memory(g_ctx), SEQ_STASH, -1, -1);
+    }
+    g_stash.clear();
+}
+
+int decodeMain(llama_batch& batch) {
+    int ret = llama_decode(g_ctx, batch);
+    if (ret == 1 && !g_stash.tokens.empty()) {
+        LOGW("KV cache full, dropping stashed branch");
+        dropStash();
+        ret = llama_decode(g_ctx, batch);
+    }
+    return ret;
+}
+
+void resetSession() {
+    if (g_ctx) {
+        llama_memory_clear(llama_get_memory(g_ctx), false);
+    }
+    g_session.clear();
+    g_stash.clear();
+    g_window_start = -1;
+    g_last_request.segments.clear();
+}
+
+/**
+ * vocabHash() of the serving model, computed once per model. A weak handle tells a
+ * new model apart from a freed one that happened to live at the same address.
+ */
+static uint64_t servingVocabHash() {
+    static std::weak_ptr<llama_model> hashed_model;
+    static uint64_t hash = 0;
+    if (hashed_model.lock() != g_model) {
+        hash = vocabHash(llama_model_get_vocab(g_model.get()));
+        hashed_model = g_model;
+    }
+    return hash;
+}
+
+AssembledPrompt assemblePrompt(const std::vector<PromptSegment>& segments, int budget) {
+    const llama_vocab* vocab = llama_model_get_vocab(g_model.get());
+    const uint64_t vocab_hash = servingVocabHash();
+    const uint64_t misses = g_token_cache.stats().misses;
+    const size_t n_segments = segments.size();
+    const size_t limit = static_cast<size_t>(std::max(budget, 0));
+
+    // Cached tokens are only valid until the next lookup, so every segment is copied
+    std::vector<std::vector<llama_token>> parts(n_segments);
+    size_t memory_at = n_segments;
+    for (size_t i = 0; i < n_segments; ++i) {
+        const PromptSegment& segment = segments[i];
+        parts[i] = g_token_cache.tokenize(vocab, vocab_hash, segment.text, segment.message_id, segment.role, i == 0);
+        if (!segment.pinned && g_history_memories.count(segment.message_id) > 0) {
+            memory_at = i;
+        }
+    }
+
+    // The newest memory stands in for its message and all history before it
+    AssembledPrompt prompt;
+    std::vector<bool> keep(n_segments, true);
+    std::vector<bool> history(n_segments, false);
+    size_t n_used = 0;
+    for (size_t i = 0; i < n_segments; ++i) {
+        if (segments[i].pinned) {
+            n_used += parts[i].size();
+        } else if (memory_at < n_segments && i <= memory_at) {
+            keep[i] = i == memory_at;
+            prompt.n_summarized++;
+        } else {
+            history[i] = true;
+        }
+    }
+    const std::string* memory = nullptr;
+    if (memory_at < n_segments) {
+        memory = &g_history_memories[segments[memory_at].message_id];
+        parts[memory_at] = g_token_cache.tokenize(vocab, vocab_hash, *memory, -1, -1, memory_at == 0);
+        n_used += parts[memory_at].size();
+    }
+
+    // History from where the last prompt's window started, or all of it for a new one
+    size_t anchor = n_segments;
+    size_t n_window = 0;
+    for (size_t i = 0; i < n_segments; ++i) {
+        if (g_window_start >= 0 && anchor == n_segments && history[i] &&
+            segments[i].message_id == g_window_start) {
+            anchor = i;
+            n_window = 0;
+        }
+        n_window += history[i] ? parts[i].size() : 0;
+    }
+    size_t first_history = anchor < n_segments ? anchor : 0;
+    size_t history_limit = limit;
+    if (n_used + n_window > limit) {
+        first_history = 0;
+        history_limit = n_used + (limit - std::min(n_used, limit)) / 2;
+        LOGI("History window of %zu tokens does not fit, sliding it", n_window);
+    }
+
+    for (size_t i = n_segments; i-- > 0;) {
+        if (!history[i]) {
+            continue;
+        }
+        if (prompt.n_dropped == 0 && i >= first_history && n_used + parts[i].size() <= history_limit) {
+            n_used += parts[i].size();
+            prompt.window_start = segments[i].message_id;
+        } else {
+            keep[i] = false;
+            prompt.n_dropped++;
+        }
+    }
+
+    // The BOS token moves to whichever segment now comes first
+    size_t first = 0;
+    while (first < n_segments && !keep[first]) {
+        first++;
+    }
+    if (first > 0 && first < n_segments) {
+        const PromptSegment& segment = segments[first];
+        n_used -= parts[first].size();
+        parts[first] = first == memory_at
+                ? g_token_cache.tokenize(vocab, vocab_hash, *memory, -1, -1, true)
+                : g_token_cache.tokenize(vocab, vocab_hash, segment.text, segment.message_id, segment.role, true);
+        n_used += parts[first].size();
+    }
+
+    prompt.tokens.reserve(n_used);
+    for (size_t i = 0; i < n_segments; ++i) {
+        if (keep[i]) {
+            prompt.tokens.insert(prompt.tokens.end(), parts[i].begin(), parts[i].end());
+        }
+        prompt.segment_ends.push_back(keep[i] ? static_cast<int32_t>(prompt.tokens.size()) : -1);
+    }
+
+    LOGI("Tokenized %llu of %zu prompt segments, the rest came from the token cache",
+         static_cast<unsigned long long>(g_token_cache.stats().misses - misses), n_segments);
+    if (prompt.n_dropped > 0) {
+        LOGI("Left out %zu oldest history segments to fit %zu prompt tokens", prompt.n_dropped, history_limit);
+    }
+    if (n_used > limit) {
+        LOGW("Pinned prompt segments take %zu tokens, over the budget of %zu", n_used, limit);
+    }
+    return prompt;
+}
+
+int promptBudget(int max_tokens, int reserve_tokens) {
+    const int n_ctx = static_cast<int>(llama_n_ctx(g_ctx));
+    return n_ctx - std::min(std::max(max_tokens, 0), n_ctx / 2) - std::max(reserve_tokens, 0);
+}
+
+size_t commonPrefixLength(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    const size_t limit = std::min(a.size(), b.size());
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+size_t reuseCachedPrefix(const std::vector<llama_token>& tokens) {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+
+    // Hidden states differ under another adapter set, so such a cache matches nothing
+    size_t n_cached = g_session.lora_key == g_lora_key ? commonPrefixLength(g_session.tokens, tokens) : 0;
+    const size_t n_stash = g_stash.lora_key == g_lora_key ? commonPrefixLength(g_stash.tokens, tokens) : 0;
+    if (n_stash > n_cached) {
+        LOGI("Restoring stashed branch (%zu cached tokens vs %zu)", n_stash, n_cached);
+        llama_memory_seq_rm(mem, SEQ_MAIN, -1, -1);
+        llama_memory_seq_cp(mem, SEQ_STASH, SEQ_MAIN, -1, -1);
+        llama_memory_seq_rm(mem, SEQ_STASH, -1, -1);
+        g_session = std::move(g_stash);
+        g_stash.clear();
+        n_cached = n_stash;
+    }
+
+    // The last prompt token is always decoded again so its logits are available
+    if (!tokens.empty() && n_cached >= tokens.size()) {
+        n_cached = tokens.size() - 1;
+    }
+
+    if (!llama_memory_seq_rm(mem, SEQ_MAIN, static_cast<llama_pos>(n_cached), -1)) {
+        // Partial removal is not supported (e.g. recurrent models), start over
+        llama_memory_seq_rm(mem, SEQ_MAIN, -1, -1);
+        n_cached = 0;
+    }
+    g_session.tokens.resize(n_cached);
+    g_session.lora_key = g_lora_key;
+    return n_cached;
+}
+
+bool decodePrompt(llama_batch& batch, const std::vector<llama_token>& tokens, size_t start) {
+    const size_t n_batch = llama_n_batch(g_ctx);
+    for (size_t i = start; i < tokens.size(); i += n_batch) {
+        const size_t n = std::min(n_batch, tokens.size() - i);
+        common_batch_clear(batch);
+        for (size_t j = 0; j < n; ++j) {
+            const size_t pos = i + j;
+            common_batch_add(batch, tokens[pos], static_cast<llama_pos>(pos), {SEQ_MAIN}, pos == tokens.size() - 1);
+        }
+        const int ret = decodeMain(batch);
+        if (ret != 0) {
+            LOGE("Failed to decode prompt chunk at %zu (%zu tokens), error code: %d", i, n, ret);
+            llama_memory_seq_rm(llama_get_memory(g_ctx), SEQ_MAIN, static_cast<llama_pos>(i), -1);
+            return false;
+        }
+        g_session.tokens.insert(g_session.tokens.end(), tokens.begin() + i, tokens.begin() + i + n);
+    }
+    return true;
+}
+
+bool shiftContext() {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    if (!llama_memory_can_shift(mem)) {
+        return false;
+    }
+
+    const int n_past = static_cast<int>(g_session.tokens.size());
+    int n_keep = g_session.segment_ends.empty() ? 1 : std::max(g_session.segment_ends[0], 1);
+    const int n_discard = (n_past - n_keep) / 2;
+    if (n_discard <= 0) {
+        return false;
+    }
+
+    // Stashed cells share positions with the main sequence, shifting would corrupt them
+    dropStash();
+
+    llama_memory_seq_rm(mem, SEQ_MAIN, n_keep, n_keep + n_discard);
+    llama_memory_seq_add(mem, SEQ_MAIN, n_keep + n_discard, n_past, -n_discard);
+    g_session.tokens.erase(g_session.tokens.begin() + n_keep,
+                           g_session.tokens.begin() + n_keep + n_discard);
+
+    for (int32_t& end : g_session.segment_ends) {
+        if (end <= n_keep) {
+            continue;
+        }
+        end = end <= n_keep + n_discard ? -1 : end - n_discard;
+    }
+
+    LOGI("Context shift: kept %d, discarded %d of %d tokens", n_keep, n_discard, n_past);
+    return true;
+}
+
+static bool hasStopSequence(const std::string& text) {
+    // Phi-3 chat markers
+    return text.find("<|end|>") != std::string::npos ||
+           text.find("<|user|>") != std::string::npos ||
+           text.find("<|assistant|>") != std::string::npos ||
+           text.find("<|system|>") != std::string::npos;
+}
+
+llama_sampler* createSampler(float temperature, float top_p, int top_k) {
+    auto sparams = llama_sampler_chain_default_params();
+    sparams.no_perf = false;
+    llama_sampler* smpl = llama_sampler_chain_init(sparams);
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(top_k));
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(top_p, 1));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return smpl;
+}
+
+// Candidate array reused across sampling steps (vocab sized). Guarded by g_mutex.
+static std::vector<llama_token_data> g_candidates;
+
+/**
+ * Sample the next token like llama_sampler_sample and return it, filling `out` with
+ * its log-probability and the top alternatives under the raw distribution. The
+ * log-sum-exp is accumulated online while the candidate array is built, and the top
+ * alternatives are read from the array once the first sampler (top-k) has partially
+ * sorted it, so no extra pass or softmax over the vocabulary is needed.
+ */
+llama_token sampleWithLogprobs(llama_sampler* smpl, TokenLogprobs& out) {
+    const float* logits = llama_get_logits_ith(g_ctx, -1);
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(g_model.get()));
+
+    g_candidates.resize(n_vocab);
+    float max_logit = -INFINITY;
+    double sum = 0.0;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        const float logit = logits[id];
+        g_candidates[id] = llama_token_data{id, logit, 0.0f};
+        if (logit > max_logit) {
+            sum = sum * std::exp(static_cast<double>(max_logit - logit)) + 1.0;
+            max_logit = logit;
+        } else {
+            sum += std::exp(logit - max_logit);
+        }
+    }
+    const float log_z = max_logit + static_cast<float>(std::log(sum));
+
+    llama_token_data_array cur_p = {g_candidates.data(), g_candidates.size(), -1, false};
+    out.top.clear();
+
+    const int n_samplers = llama_sampler_chain_n(smpl);
+    for (int i = 0; i < n_samplers; ++i) {
+        llama_sampler_apply(llama_sampler_chain_get(smpl, i), &cur_p);
+        if (i > 0 || out.top_n <= 0) {
+            continue;
+        }
+
+        // Later samplers rescale logits in place, so read the top entries now
+        const size_t n_top = std::min(static_cast<size_t>(out.top_n), cur_p.size);
+        if (!cur_p.sorted) {
+            std::partial_sort(cur_p.data, cur_p.data + n_top, cur_p.data + cur_p.size,
+                    [](const llama_token_data& a, const llama_token_data& b) {
+                        return a.logit > b.logit;
+                    });
+        }
+        for (size_t k = 0; k < n_top; ++k) {
+            const llama_token id = cur_p.data[k].id;
+            out.top.emplace_back(id, logits[id] - log_z);
+        }
+    }
+
+    if (cur_p.selected < 0 || cur_p.selected >= static_cast<int64_t>(cur_p.size)) {
+        LOGE("Sampler chain did not select a token");
+        return LLAMA_TOKEN_NULL;
+    }
+
+    const llama_token token = cur_p.data[cur_p.selected].id;
+    llama_sampler_accept(smpl, token);
+
+    out.token = token;
+    out.logprob = logits[token] - log_z;
+    return token;
+}
+
+size_t writeLogprobRecord(const TokenLogprobs& lp, uint8_t* dst, size_t capacity) {
+    const size_t header_bytes = 2 * sizeof(int32_t) + sizeof(float);
+    if (capacity < header_bytes) {
+        return 0;
+    }
+
+    size_t offset = header_bytes;
+    int32_t n_written = 0;
+    for (const auto& alt : lp.top) {
+        const std::string piece = common_token_to_piece(g_ctx, alt.first);
+        const uint16_t piece_len = static_cast<uint16_t>(std::min<size_t>(piece.size(), UINT16_MAX));
+        const size_t entry_bytes = sizeof(int32_t) + sizeof(float) + sizeof(uint16_t) + piece_len;
+        if (offset + entry_bytes > capacity) {
+            break;
+        }
+        const int32_t id = alt.first;
+        std::memcpy(dst + offset, &id, sizeof(int32_t));
+        std::memcpy(dst + offset + sizeof(int32_t), &alt.second, sizeof(float));
+        std::memcpy(dst + offset + sizeof(int32_t) + sizeof(float), &piece_len, sizeof(uint16_t));
+        std::memcpy(dst + offset + sizeof(int32_t) + sizeof(float) + sizeof(uint16_t), piece.data(), piece_len);
+        offset += entry_bytes;
+        n_written++;
+    }
+
+    const int32_t token = lp.token;
+    std::memcpy(dst, &token, sizeof(int32_t));
+    std::memcpy(dst + sizeof(int32_t), &lp.logprob, sizeof(float));
+    std::memcpy(dst + sizeof(int32_t) + sizeof(float), &n_written, sizeof(int32_t));
+    return offset;
+}
+
+int runGeneration(
+        const std::vector<llama_token>& tokens,
+        const std::vector<int32_t>& segment_ends,
+        int maxTokens,
+        llama_sampler* smpl,
+        TokenLogprobs* logprobs,
+        const PieceCallback& onPiece,
+        GenerationStats* stats) {
+
+    if (tokens.empty()) {
+        LOGE("Empty prompt");
+        return -1;
+    }
+
+    const int n_ctx = llama_n_ctx(g_ctx);
+    const llama_vocab* vocab = llama_model_get_vocab(g_model.get());
+    llama_batch batch = llama_batch_init(llama_n_batch(g_ctx), 0, 1);
+
+    const int64_t t_start_us = ggml_time_us();
+    const size_t n_cached = reuseCachedPrefix(tokens);
+    g_prefix_stats.prompts++;
+    g_prefix_stats.prompt_tokens += tokens.size();
+    g_prefix_stats.reused_tokens += n_cached;
+    LOGI("Prompt: %zu tokens, %zu reused from KV cache (%llu%% over %llu prompts)", tokens.size(), n_cached,
+         static_cast<unsigned long long>(g_prefix_stats.reused_tokens * 100 / g_prefix_stats.prompt_tokens),
+         static_cast<unsigned long long>(g_prefix_stats.prompts));
+
+    if (!decodePrompt(batch, tokens, n_cached)) {
+        LOGE("Context size: %d, prompt tokens: %zu", n_ctx, tokens.size());
+        g_session.segment_ends.clear();
+        llama_batch_free(batch);
+        return -1;
+    }
+    g_session.segment_ends = segment_ends;
+    const int64_t t_prefill_end_us = ggml_time_us();
+
+    int n_decode = 0;
+    std::string accumulated_text;
+
+    while (n_decode < maxTokens && !g_should_stop.load()) {
+        const llama_token new_token_id = logprobs != nullptr
+                ? sampleWithLogprobs(smpl, *logprobs)
+                : llama_sampler_sample(smpl, g_ctx, -1);
+        if (new_token_id == LLAMA_TOKEN_NULL) {
+            break;
+        }
+
+        if (llama_vocab_is_eog(vocab, new_token_id)) {
+            break;
+        }
+
+        const std::string piece = common_token_to_piece(g_ctx, new_token_id);
+        accumulated_text += piece;
+
+        if (hasStopSequence(accumulated_text)) {
+            LOGI("Stop sequence detected, ending generation");
+            break;
+        }
+
+        if (!onPiece(piece)) {
+            break;
+        }
+
+        if (static_cast<int>(g_session.tokens.size()) >= n_ctx && !shiftContext()) {
+            LOGW("Context full and cannot be shifted, ending generation");
+            break;
+        }
+
+        const llama_pos pos = static_cast<llama_pos>(g_session.tokens.size());
+        common_batch_clear(batch);
+        common_batch_add(batch, new_token_id, pos, {SEQ_MAIN}, true);
+
+        n_decode++;
+
+        if (decodeMain(batch) != 0) {
+            LOGE("Failed to decode at position %d", pos);
+            break;
+        }
+        g_session.tokens.push_back(new_token_id);
+    }
+
+    llama_batch_free(batch);
+    if (stats != nullptr) {
+        stats->n_prompt = tokens.size();
+        stats->n_reused = n_cached;
+        stats->n_generated = n_decode;
+        stats->t_prefill_us = t_prefill_end_us - t_start_us;
+        stats->t_decode_us = ggml_time_us() - t_prefill_end_us;
+    }
+    return n_decode;
+}
+
+int generate(const GenerationRequest& request, TokenLogprobs* logprobs,
+             const PieceCallback& onPiece, GenerationStats* stats) {
+    g_should_stop.store(false);
+
+    const AssembledPrompt prompt = assemblePrompt(request.segments, promptBudget(request.max_tokens, 0));
+
+    llama_sampler* smpl = createSampler(request.temperature, request.top_p, request.top_k);
+    const int n_decode = runGeneration(prompt.tokens, prompt.segment_ends, request.max_tokens, smpl, logprobs,
+                                       onPiece, stats);
+    llama_sampler_free(smpl);
+    if (n_decode >= 0) {
+        g_window_start = prompt.window_start;
+        g_last_request = request;
+    }
+    return n_decode;
+}
+
+// Share of the prompt budget a conversation fills before compactHistory() summarizes it
+static constexpr double COMPACT_THRESHOLD = 0.75;
+// Longest summary, in tokens
+static constexpr int COMPACT_MAX_TOKENS = 160;
+// Kept history segments below which there is nothing worth summarizing
+static constexpr size_t COMPACT_MIN_SEGMENTS = 4;
+// Memories kept across conversations; the lowest ids were written longest ago
+static constexpr size_t MAX_HISTORY_MEMORIES = 64;
+
+/**
+ * Greedy continuation of `tokens` on SEQ_SCORE, sharing the prefix the main sequence
+ * holds. Stops at an end-of-generation token, a chat marker or `max_tokens`.
+ * Returns false if a decode failed or background work was preempted.
+ */
+static bool generateScratch(const std::vector<llama_token>& tokens, int max_tokens, std::string& out) {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    const llama_vocab* vocab = llama_model_get_vocab(g_model.get());
+    const size_t n_batch = llama_n_batch(g_ctx);
+
+    const size_t n_shared = g_session.lora_key == g_lora_key
+            ? std::min(commonPrefixLength(g_session.tokens, tokens), tokens.size() - 1)
+            : 0;
+    clearScoreSequences();
+    if (n_shared > 0) {
+        llama_memory_seq_cp(mem, SEQ_MAIN, SEQ_SCORE, 0, static_cast<llama_pos>(n_shared));
+    }
+
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(n_batch), 0, 1);
+    llama_sampler* smpl = createSampler(1.0f, 1.0f, 1);
+    bool ok = true;
+    for (size_t i = n_shared; ok && i < tokens.size(); i += n_batch) {
+        const size_t n = std::min(n_batch, tokens.size() - i);
+        common_batch_clear(batch);
+        for (size_t j = 0; j < n; ++j) {
+            const size_t pos = i + j;
+            common_batch_add(batch, tokens[pos], static_cast<llama_pos>(pos), {SEQ_SCORE}, pos == tokens.size() - 1);
+        }
+        ok = decodeMain(batch) == 0;
+    }
+
+    llama_pos pos = static_cast<llama_pos>(tokens.size());
+    for (int n = 0; ok && n < max_tokens && !backgroundPreempted(); ++n) {
+        const llama_token token = llama_sampler_sample(smpl, g_ctx, -1);
+        if (token == LLAMA_TOKEN_NULL || llama_vocab_is_eog(vocab, token)) {
+            break;
+        }
+        out += common_token_to_piece(g_ctx, token);
+        if (hasStopSequence(out)) {
+            out.erase(out.rfind("<|"));
+            break;
+        }
+        common_batch_clear(batch);
+        common_batch_add(batch, token, pos++, {SEQ_SCORE}, true);
+        ok = decodeMain(batch) == 0;
+    }
+
+    llama_sampler_free(smpl);
+    llama_batch_free(batch);
+    clearScoreSequences();
+    return ok && !backgroundPreempted();
+}
+
+int compactHistory(const CompactionRequest& request) {
+    const std::vector<PromptSegment>& segments = g_last_request.segments;
+    const int budget = promptBudget(g_last_request.max_tokens, 0);
+    if (segments.empty() || static_cast<double>(g_session.tokens.size()) <= budget * COMPACT_THRESHOLD) {
+        return 0;
+    }
+
+    // Unpinned segments run summarized, left out, then kept
+    const AssembledPrompt prompt = assemblePrompt(segments, budget);
+    std::vector<size_t> kept;
+    size_t n_history = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        if (!segments[i].pinned && n_history++ >= prompt.n_summarized + prompt.n_dropped) {
+            kept.push_back(i);
+        }
+    }
+    if (kept.size() < COMPACT_MIN_SEGMENTS) {
+        return 0;
+    }
+
+    // About the older half of the kept history, extended to the end of a turn
+    int32_t start = 0;
+    for (size_t i = 0; i < kept[0]; ++i) {
+        start = std::max(start, prompt.segment_ends[i]);
+    }
+    const int32_t middle = start + (prompt.segment_ends[kept.back()] - start) / 2;
+    size_t cut = 0;
+    while (cut + 2 < kept.size() && prompt.segment_ends[kept[cut]] < middle) {
+        cut++;
+    }
+    while (cut + 2 < kept.size() && segments[kept[cut]].role != ROLE_ASSISTANT) {
+        cut++;
+    }
+    const int64_t newest_id = segments[kept[cut]].message_id;
+    if (newest_id < 0) {
+        return 0;
+    }
+
+    // The conversation up to the cut, then the request for its summary
+    const size_t n_prefix = static_cast<size_t>(prompt.segment_ends[kept[cut]]);
+    const std::vector<llama_token> instruction =
+            common_tokenize(llama_model_get_vocab(g_model.get()), request.instruction, false);
+    std::vector<llama_token> tokens(prompt.tokens.begin(), prompt.tokens.begin() + n_prefix);
+    tokens.insert(tokens.end(), instruction.begin(), instruction.end());
+    const size_t n_ctx = llama_n_ctx(g_ctx);
+    if (tokens.size() + COMPACT_MAX_TOKENS > n_ctx) {
+        return 0;
+    }
+
+    // The main sequence past the cut is prefilled again by the splice below, so it
+    // gives up its cells when the scratch sequence would not fit beside it
+    dropStash();
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    if (g_session.tokens.size() + instruction.size() + COMPACT_MAX_TOKENS > n_ctx &&
+        g_session.tokens.size() > n_prefix &&
+        llama_memory_seq_rm(mem, SEQ_MAIN, static_cast<llama_pos>(n_prefix), -1)) {
+        g_session.tokens.resize(n_prefix);
+        for (int32_t& end : g_session.segment_ends) {
+            end = end > static_cast<int32_t>(n_prefix) ? -1 : end;
+        }
+    }
+
+    LOGI("Summarizing %zu history segments (%zu tokens)", cut + 1, n_prefix - static_cast<size_t>(start));
+    std::string summary;
+    if (!generateScratch(tokens, COMPACT_MAX_TOKENS, summary)) {
+        LOGI("History compaction preempted");
+        return -1;
+    }
+    summary.erase(0, summary.find_first_not_of(" \t\n"));
+    summary.erase(summary.find_last_not_of(" \t\n") + 1);
+    if (summary.empty()) {
+        LOGW("History compaction produced an empty summary");
+        return -1;
+    }
+
+    g_history_memories[newest_id] = request.memory_prefix + summary + request.memory_suffix;
+    while (g_history_memories.size() > MAX_HISTORY_MEMORIES) {
+        g_history_memories.erase(g_history_memories.begin());
+    }
+
+    // Splice: prefill the system prompt, the memory and the rest of the kept history
+    // so the next turn only decodes its new messages. Preemption keeps what is done;
+    // a request already waiting gets the cache as it is.
+    const AssembledPrompt next = assemblePrompt(segments, budget);
+    const int32_t n_splice = next.segment_ends[kept.back()];
+    bool spliced = false;
+    if (n_splice > 0 && !backgroundPreempted()) {
+        const std::vector<llama_token> prefix(next.tokens.begin(), next.tokens.begin() + n_splice);
+        llama_batch batch = llama_batch_init(llama_n_batch(g_ctx), 0, 1);
+        spliced = decodePrompt(batch, prefix, reuseCachedPrefix(prefix));
+        llama_batch_free(batch);
+        g_session.segment_ends.assign(next.segment_ends.begin(), next.segment_ends.begin() + kept.back() + 1);
+        for (int32_t& end : g_session.segment_ends) {
+            end = end > static_cast<int32_t>(g_session.tokens.size()) ? -1 : end;
+        }
+    }
+
+    LOGI("Compacted %zu history segments into a %zu character memory%s", cut + 1, summary.size(),
+         spliced ? "" : ", prefill of the new prefix left to the next turn");
+    return static_cast<int>(cut + 1);
+}
+
+/**
+ * Log-probability of `token` under one row of logits (log-softmax at a single index).
+ */
+static float tokenLogprob(const float* logits, int n_vocab, llama_token token) {
+    float max_logit = logits[0];
+    for (int i = 1; i < n_vocab; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += std::exp(static_cast<double>(logits[i] - max_logit));
+    }
+    return logits[token] - max_logit - static_cast<float>(std::log(sum));
+}
+
+void clearScoreSequences() {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    for (llama_seq_id seq = SEQ_SCORE; seq < SEQ_MAX; ++seq) {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+    }
+}
+
+/**
+ * The prompt is prefilled once on SEQ_SCORE, sharing whatever prefix the chat
+ * sequence already has cached, and copied to one scratch sequence per candidate.
+ * Candidate tokens are then decoded together, SCORE_SLOTS candidates at a time,
+ * with logits requested only for tokens whose successor is scored: the first token
+ * of every candidate is scored from the prompt logits, the last one is never decoded.
+ */
+bool scoreCandidates(
+        const std::string& prompt,
+        const std::vector<std::string>& candidates,
+        std::vector<std::vector<float>>& logprobs) {
+
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    const llama_vocab* vocab = llama_model_get_vocab(g_model.get());
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_ctx = llama_n_ctx(g_ctx);
+    const size_t n_batch = llama_n_batch(g_ctx);
+
+    const std::vector<llama_token> prompt_tokens = common_tokenize(g_ctx, prompt, true);
+    if (prompt_tokens.empty()) {
+        LOGE("Empty scoring prompt");
+        return false;
+    }
+
+    // Tokenize each candidate together with the prompt so the boundary tokenizes the
+    // way generation would see it; fall back to a standalone tokenization when the
+    // candidate merges into the prompt's last token.
+    std::vector<std::vector<llama_token>> candidate_tokens(candidates.size());
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        const std::vector<llama_token> joint = common_tokenize(g_ctx, prompt + candidates[c], true);
+        if (commonPrefixLength(prompt_tokens, joint) == prompt_tokens.size()) {
+            candidate_tokens[c].assign(joint.begin() + prompt_tokens.size(), joint.end());
+        } else {
+            candidate_tokens[c] = common_tokenize(g_ctx, candidates[c], false);
+        }
+        if (prompt_tokens.size() + candidate_tokens[c].size() > static_cast<size_t>(n_ctx)) {
+            LOGE("Candidate %zu does not fit in the context (%zu + %zu tokens)",
+                 c, prompt_tokens.size(), candidate_tokens[c].size());
+            return false;
+        }
+    }
+
+    // Share the prefix the chat sequence already holds, decode the rest of the prompt
+    size_t n_shared = g_session.lora_key == g_lora_key
+            ? std::min(commonPrefixLength(g_session.tokens, prompt_tokens), prompt_tokens.size() - 1)
+            : 0;
+    clearScoreSequences();
+    if (n_shared > 0) {
+        llama_memory_seq_cp(mem, SEQ_MAIN, SEQ_SCORE, 0, static_cast<llama_pos>(n_shared));
+    }
+
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(n_batch), 0, 1);
+    bool ok = true;
+
+    for (size_t i = n_shared; ok && i < prompt_tokens.size(); i += n_batch) {
+        const size_t n = std::min(n_batch, prompt_tokens.size() - i);
+        common_batch_clear(batch);
+        for (size_t j = 0; j < n; ++j) {
+            const size_t pos = i + j;
+            common_batch_add(batch, prompt_tokens[pos], static_cast<llama_pos>(pos), {SEQ_SCORE},
+                             pos == prompt_tokens.size() - 1);
+        }
+        if (decodeMain(batch) != 0) {
+            LOGE("Failed to decode scoring prompt at %zu", i);
+            ok = false;
+        }
+    }
+
+    // Every candidate's first token comes from the prompt's last logits
+    if (ok) {
+        const float* prompt_logits = llama_get_logits_ith(g_ctx, -1);
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            logprobs[c].clear();
+            if (!candidate_tokens[c].empty()) {
+                logprobs[c].push_back(tokenLogprob(prompt_logits, n_vocab, candidate_tokens[c][0]));
+            }
+        }
+    }
+
+    const llama_pos n_prompt = static_cast<llama_pos>(prompt_tokens.size());
+
+    for (size_t first = 0; ok && first < candidates.size(); first += SCORE_SLOTS) {
+        const size_t last = std::min(first + SCORE_SLOTS, candidates.size());
+
+        // (candidate, token index) of every batch row that has logits enabled
+        std::vector<std::pair<size_t, size_t>> rows;
+
+        for (size_t c = first; c < last; ++c) {
+            const llama_seq_id seq = SEQ_CANDIDATE + static_cast<llama_seq_id>(c - first);
+            llama_memory_seq_rm(mem, seq, -1, -1);
+            if (candidate_tokens[c].size() > 1) {
+                llama_memory_seq_cp(mem, SEQ_SCORE, seq, -1, -1);
+            }
+        }
+
+        auto flush = [&]() {
+            if (batch.n_tokens == 0) {
+                return true;
+            }
+            if (decodeMain(batch) != 0) {
+                LOGE("Failed to decode scoring batch (%d tokens)", batch.n_tokens);
+                return false;
+            }
+            for (size_t r = 0; r < rows.size(); ++r) {
+                const size_t c = rows[r].first;
+                const size_t t = rows[r].second;
+                const float* logits = llama_get_logits_ith(g_ctx, static_cast<int32_t>(r));
+                logprobs[c].push_back(tokenLogprob(logits, n_vocab, candidate_tokens[c][t + 1]));
+            }
+            rows.clear();
+            common_batch_clear(batch);
+            return true;
+        };
+
+        common_batch_clear(batch);
+        for (size_t c = first; ok && c < last; ++c) {
+            const llama_seq_id seq = SEQ_CANDIDATE + static_cast<llama_seq_id>(c - first);
+            const std::vector<llama_token>& tokens = candidate_tokens[c];
+            // The final token predicts nothing we score, so it is never decoded
+            for (size_t t = 0; ok && t + 1 < tokens.size(); ++t) {
+                if (static_cast<size_t>(batch.n_tokens) == n_batch) {
+                    ok = flush();
+                }
+                common_batch_add(batch, tokens[t], n_prompt + static_cast<llama_pos>(t), {seq}, true);
+                rows.emplace_back(c, t);
+            }
+        }
+        ok = ok && flush();
+
+        for (size_t c = first; c < last; ++c) {
+            llama_memory_seq_rm(mem, SEQ_CANDIDATE + static_cast<llama_seq_id>(c - first), -1, -1);
+        }
+    }
+
+    llama_batch_free(batch);
+    clearScoreSequences();
+    return ok;
+}
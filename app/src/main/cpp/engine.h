@@ -0,0 +1,329 @@
+#pragma once
+
+#include "llama.h"
+#include "token_cache.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Inference engine core: the serving model and context, the KV prefix cache that
+ * mirrors them, sampling, generation and candidate scoring. Nothing here depends on
+ * JNI, so the same code runs behind llama_jni.cpp in the app and in the host tools.
+ *
+ * Everything below is guarded by g_mutex unless noted otherwise.
+ */
+
+// Serializes all use of the serving model and context
+extern std::mutex g_mutex;
+
+// Models are owned through reference-counted handles: the chat context's model is
+// also held by an embedding context created on it, and is freed with the last handle
+using ModelHandle = std::shared_ptr<llama_model>;
+extern ModelHandle g_model;
+extern llama_context* g_ctx;
+
+// Set from any thread to end the running generation after the current token
+extern std::atomic<bool> g_should_stop;
+
+// Background work (warmup, history compaction) runs under g_mutex but aborts its
+// graph computations as soon as a foreground request wants the lock.
+// g_background_running is only set while the background task holds g_mutex, so
+// foreground decodes are never aborted. g_foreground_waiting counts foreground
+// requests announced by ForegroundLock that have not got the lock yet.
+extern std::atomic<bool> g_background_running;
+extern std::atomic<bool> g_background_cancel;
+extern std::atomic<int> g_foreground_waiting;
+
+ModelHandle makeModelHandle(llama_model* model);
+
+/** True while background work should give up g_mutex, see g_background_running. */
+bool backgroundPreempted();
+
+/** llama abort callback for background work: backgroundPreempted(). */
+bool abortBackgroundWork(void* data);
+
+/** Explicitly cancel running background work (e.g. the user turned warmup off). */
+void preemptBackgroundWork();
+
+/**
+ * g_mutex held for a foreground request. The request is counted in
+ * g_foreground_waiting before it waits, so background work that holds the lock, or
+ * takes it first, yields at its next check instead of running to completion.
+ */
+class ForegroundLock {
+public:
+    ForegroundLock();
+    ForegroundLock(const ForegroundLock&) = delete;
+    ForegroundLock& operator=(const ForegroundLock&) = delete;
+
+private:
+    std::unique_lock<std::mutex> lock_;
+};
+
+/**
+ * g_mutex held for background work, with g_background_running set for its lifetime.
+ * yielded() is true from the start when a foreground request was already waiting;
+ * the task should then return without doing anything.
+ */
+class BackgroundTask {
+public:
+    BackgroundTask();
+    ~BackgroundTask();
+    BackgroundTask(const BackgroundTask&) = delete;
+    BackgroundTask& operator=(const BackgroundTask&) = delete;
+
+    bool yielded() const { return backgroundPreempted(); }
+
+private:
+    std::unique_lock<std::mutex> lock_;
+};
+
+// KV sequence layout. The cache is unified, so copying a sequence only tags cells.
+constexpr llama_seq_id SEQ_MAIN = 0;   // live conversation
+constexpr llama_seq_id SEQ_STASH = 1;  // branch kept alive by forkAt()
+constexpr llama_seq_id SEQ_SCORE = 2;  // scoring prompt, forked per candidate
+constexpr llama_seq_id SEQ_CANDIDATE = 3;
+constexpr int SCORE_SLOTS = 8;         // candidates scored per batched decode
+constexpr int SEQ_MAX = SEQ_CANDIDATE + SCORE_SLOTS;
+
+/**
+ * Mirror of a KV sequence: tokens[i] is cached at position i.
+ * segment_ends[k] is the checkpoint recorded after prompt segment k of the last prompt,
+ * or -1 once a context shift has discarded the tokens before it.
+ */
+struct KvSession {
+    std::vector<llama_token> tokens;
+    std::vector<int32_t> segment_ends;
+    std::string lora_key;  // adapters the tokens were decoded with, see g_lora_key
+
+    void clear() {
+        tokens.clear();
+        segment_ends.clear();
+        lora_key.clear();
+    }
+};
+
+extern KvSession g_session;
+extern KvSession g_stash;
+
+// Adapters and scales currently applied to g_ctx ("" for none). Cached tokens only
+// match a prompt decoded under the same key.
+extern std::string g_lora_key;
+
+void dropStash();
+
+/** llama_decode that gives up the stashed branch when the cache has no free slot. */
+int decodeMain(llama_batch& batch);
+
+/** Forget the cached conversation and the stash, keeping the context. */
+void resetSession();
+
+/**
+ * One message of a prompt, already in the chat template. Messages the app stores
+ * carry their id and role, so their tokens are kept in g_token_cache between turns.
+ */
+struct PromptSegment {
+    std::string text;
+    int64_t message_id = -1;
+    int32_t role = -1;
+    bool pinned = true;  // false for history that may be left out when the context is short
+};
+
+// PromptSegment roles of stored messages, as in PromptSegment.Role on the app side
+constexpr int32_t ROLE_SYSTEM = 0;
+constexpr int32_t ROLE_USER = 1;
+constexpr int32_t ROLE_ASSISTANT = 2;
+
+// Summaries written by compactHistory(), keyed by the id of the newest message they
+// cover. Each is a prompt segment that stands in for that message and all history
+// before it.
+extern std::map<int64_t, std::string> g_history_memories;
+
+// Tokens of recent prompt segments, so unchanged history is not tokenized again
+extern TokenCache g_token_cache;
+
+/**
+ * Prompt tokens ready for prefill. segment_ends holds one checkpoint per request
+ * segment, -1 for the segments that were left out.
+ */
+struct AssembledPrompt {
+    std::vector<llama_token> tokens;
+    std::vector<int32_t> segment_ends;
+    size_t n_summarized = 0;  // oldest history segments replaced by a memory
+    size_t n_dropped = 0;     // history segments after those that were left out
+    int64_t window_start = -1;  // message id of the oldest kept history segment
+};
+
+// window_start of the last generated prompt, -1 for none
+extern int64_t g_window_start;
+
+/**
+ * Tokenize prompt segments one at a time so every segment boundary is a known token
+ * position. All pinned segments are kept, plus the newest unpinned (history) segments
+ * that fit in `budget` tokens alongside them; history older than the first segment
+ * that does not fit is left out with it, so the kept history stays contiguous.
+ * Only the first kept segment gets the BOS token.
+ *
+ * When a history segment has an entry in g_history_memories, the newest such one is
+ * replaced by the memory and all history before it is summarized away.
+ *
+ * History is windowed for the KV prefix cache: while the history from g_window_start
+ * on still fits, older history stays out and the prompt keeps the last one's prefix.
+ * Once it does not fit, the window slides in one step to the newest history filling
+ * half of the room left by the pinned segments, so the next turns share a prefix again.
+ */
+AssembledPrompt assemblePrompt(const std::vector<PromptSegment>& segments, int budget);
+
+/**
+ * Prompt tokens available to a request: the context less room for the reply and
+ * `reserve_tokens`. The reply's share is capped at half the context, since
+ * generation shifts the context when it runs out.
+ */
+int promptBudget(int max_tokens, int reserve_tokens);
+
+size_t commonPrefixLength(const std::vector<llama_token>& a, const std::vector<llama_token>& b);
+
+/**
+ * Keep the longest cached prefix of `tokens` in the main sequence and drop the rest.
+ * Switches to the stashed branch first if it matches further.
+ * Returns the number of prompt tokens that do not need to be decoded again.
+ */
+size_t reuseCachedPrefix(const std::vector<llama_token>& tokens);
+
+/**
+ * Decode tokens[start..] into the main sequence in n_batch sized chunks,
+ * requesting logits only for the final token.
+ */
+bool decodePrompt(llama_batch& batch, const std::vector<llama_token>& tokens, size_t start);
+
+/**
+ * Free room in the main sequence by discarding half of the tokens after the system
+ * segment and shifting the rest down. Checkpoints inside the discarded range are
+ * invalidated, later ones move with their tokens.
+ */
+bool shiftContext();
+
+llama_sampler* createSampler(float temperature, float top_p, int top_k);
+
+/**
+ * The sampled token and its top alternatives, as log-probabilities under the
+ * model's raw distribution (before top-k/top-p/temperature).
+ */
+struct TokenLogprobs {
+    int top_n = 0;
+    llama_token token = LLAMA_TOKEN_NULL;
+    float logprob = 0.0f;
+    std::vector<std::pair<llama_token, float>> top;
+};
+
+/** Equivalent of llama_sampler_sample that also fills `out`. */
+llama_token sampleWithLogprobs(llama_sampler* smpl, TokenLogprobs& out);
+
+/**
+ * Serialize `lp` into `dst` in native byte order:
+ * int32 token, float32 logprob, int32 n, then n x (int32 token, float32 logprob,
+ * uint16 piece length, UTF-8 piece bytes). Alternatives that do not fit are dropped.
+ * Returns the record length.
+ */
+size_t writeLogprobRecord(const TokenLogprobs& lp, uint8_t* dst, size_t capacity);
+
+// Receives the text of each generated token; returning false stops generation
+using PieceCallback = std::function<bool(const std::string& piece)>;
+
+/**
+ * Prompt tokens served from the KV prefix cache instead of being decoded, over all
+ * generations since startup.
+ */
+struct PrefixCacheStats {
+    uint64_t prompts = 0;
+    uint64_t prompt_tokens = 0;
+    uint64_t reused_tokens = 0;
+};
+
+extern PrefixCacheStats g_prefix_stats;
+
+/**
+ * Where the time of one generation went. Prefill covers matching the cache and
+ * decoding the prompt tokens it did not hold; decode covers sampling and decoding
+ * every generated token.
+ */
+struct GenerationStats {
+    size_t n_prompt = 0;
+    size_t n_reused = 0;
+    int n_generated = 0;
+    int64_t t_prefill_us = 0;
+    int64_t t_decode_us = 0;
+};
+
+/**
+ * Prefill the prompt on top of the cached prefix, then sample up to maxTokens tokens.
+ * When `logprobs` is set it describes the token passed to `onPiece`.
+ * Returns the number of generated tokens, or -1 when the prompt could not be decoded.
+ */
+int runGeneration(
+        const std::vector<llama_token>& tokens,
+        const std::vector<int32_t>& segment_ends,
+        int maxTokens,
+        llama_sampler* smpl,
+        TokenLogprobs* logprobs,
+        const PieceCallback& onPiece,
+        GenerationStats* stats = nullptr);
+
+struct GenerationRequest {
+    std::vector<PromptSegment> segments;  // one per message, see assemblePrompt()
+    int max_tokens = 512;
+    float temperature = 0.7f;
+    float top_p = 0.9f;
+    int top_k = 40;
+};
+
+// Last request generate() completed, for compactHistory()
+extern GenerationRequest g_last_request;
+
+/**
+ * One request end to end on the serving context: assemble the prompt within the
+ * context budget, sample with the request's settings and stream pieces to `onPiece`.
+ * Clears g_should_stop first. Same result as runGeneration(); caller holds g_mutex.
+ */
+int generate(const GenerationRequest& request, TokenLogprobs* logprobs,
+             const PieceCallback& onPiece, GenerationStats* stats = nullptr);
+
+/** Chat template text compactHistory() wraps the conversation and its summary in. */
+struct CompactionRequest {
+    std::string instruction;    // asks for the summary, ends where the reply starts
+    std::string memory_prefix;  // memory segment = prefix + summary + suffix
+    std::string memory_suffix;
+};
+
+/**
+ * Background work: once the last conversation fills more than COMPACT_THRESHOLD of
+ * its prompt budget, summarize the oldest half of its kept history into an entry of
+ * g_history_memories. The summary is generated on SEQ_SCORE from the prefix the main
+ * sequence already holds; the shortened prompt is then prefilled into the main
+ * sequence so the next turn reuses it. Runs inside a BackgroundTask; every decode
+ * stops as soon as a foreground request waits for g_mutex.
+ * Returns the number of history segments summarized, 0 when nothing needed it, or
+ * -1 if it was preempted or failed before the memory was stored.
+ */
+int compactHistory(const CompactionRequest& request);
+
+/** Empty the scratch sequences (SEQ_SCORE and up) used by scoring and warmup. */
+void clearScoreSequences();
+
+/**
+ * Log-probabilities of each candidate continuation of `prompt`, written to
+ * `logprobs[c]` one value per candidate token. Returns false if a decode failed.
+ * The chat sequence is untouched.
+ */
+bool scoreCandidates(
+        const std::string& prompt,
+        const std::vector<std::string>& candidates,
+        std::vector<std::vector<float>>& logprobs);
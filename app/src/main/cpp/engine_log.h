@@ -0,0 +1,17 @@
+#pragma once
+
+// Log macros for code shared by the app and the host tools: logcat on Android,
+// stderr elsewhere. Define LOG_TAG before including.
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+#include <cstdio>
+#define ENGINE_LOG(level, ...) \
+    (fprintf(stderr, "%s/%s: ", level, LOG_TAG), fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGI(...) ENGINE_LOG("I", __VA_ARGS__)
+#define LOGW(...) ENGINE_LOG("W", __VA_ARGS__)
+#define LOGE(...) ENGINE_LOG("E", __VA_ARGS__)
+#endif
@@ -0,0 +1,141 @@
+#include "gguf_inspect.h"
+
+#include "ggml.h"
+#include "gguf.h"
+
+#include <android/log.h>
+
+#include <cstdio>
+#include <map>
+
+#define LOG_TAG "GgufInspect"
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+
+static std::string readString(const gguf_context* gguf, const char* key) {
+    const int64_t id = gguf_find_key(gguf, key);
+    return id >= 0 && gguf_get_kv_type(gguf, id) == GGUF_TYPE_STRING ? gguf_get_val_str(gguf, id) : "";
+}
+
+static uint32_t readU32(const gguf_context* gguf, const std::string& key) {
+    const int64_t id = gguf_find_key(gguf, key.c_str());
+    if (id < 0) {
+        return 0;
+    }
+    switch (gguf_get_kv_type(gguf, id)) {
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(gguf, id);
+        case GGUF_TYPE_INT32:  return static_cast<uint32_t>(gguf_get_val_i32(gguf, id));
+        case GGUF_TYPE_UINT64: return static_cast<uint32_t>(gguf_get_val_u64(gguf, id));
+        default:               return 0;
+    }
+}
+
+bool inspectGguf(const std::string& path, GgufSummary& summary) {
+    // no_alloc without a ggml context parses the header, KV pairs and tensor
+    // infos only; the reader stops before the data section
+    gguf_init_params params = {true, nullptr};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (gguf == nullptr) {
+        LOGW("Failed to read GGUF header of %s", path.c_str());
+        return false;
+    }
+
+    summary = GgufSummary();
+    summary.version = gguf_get_version(gguf);
+    summary.metadata_bytes = gguf_get_data_offset(gguf);
+    summary.name = readString(gguf, "general.name");
+    summary.architecture = readString(gguf, "general.architecture");
+    summary.size_label = readString(gguf, "general.size_label");
+    summary.chat_template = readString(gguf, "tokenizer.chat_template");
+    summary.file_type = readU32(gguf, "general.file_type");
+
+    const std::string& arch = summary.architecture;
+    summary.context_length = readU32(gguf, arch + ".context_length");
+    summary.embedding_length = readU32(gguf, arch + ".embedding_length");
+    summary.block_count = readU32(gguf, arch + ".block_count");
+
+    const int64_t tokens_id = gguf_find_key(gguf, "tokenizer.ggml.tokens");
+    if (tokens_id >= 0 && gguf_get_kv_type(gguf, tokens_id) == GGUF_TYPE_ARRAY) {
+        summary.n_vocab = static_cast<uint32_t>(gguf_get_arr_n(gguf, tokens_id));
+    }
+
+    // Element counts follow from the byte sizes, so tensor shapes are not needed
+    std::map<ggml_type, uint64_t> bytes_by_type;
+    summary.n_tensors = static_cast<uint64_t>(gguf_get_n_tensors(gguf));
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+        const ggml_type type = gguf_get_tensor_type(gguf, i);
+        const uint64_t bytes = gguf_get_tensor_size(gguf, i);
+        summary.weight_bytes += bytes;
+        summary.n_params += bytes / ggml_type_size(type) * ggml_blck_size(type);
+        bytes_by_type[type] += bytes;
+    }
+    gguf_free(gguf);
+
+    uint64_t dominant = 0;
+    for (const auto& entry : bytes_by_type) {
+        if (entry.second > dominant) {
+            dominant = entry.second;
+            summary.quantization = ggml_type_name(entry.first);
+        }
+    }
+    return true;
+}
+
+static void appendJsonString(std::string& out, const std::string& value) {
+    out += '"';
+    for (const unsigned char c : value) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
+
+std::string ggufSummaryToJson(const GgufSummary& summary) {
+    std::string out = "{";
+    auto key = [&](const char* name) {
+        if (out.size() > 1) {
+            out += ',';
+        }
+        out += '"';
+        out += name;
+        out += "\":";
+    };
+    auto str = [&](const char* name, const std::string& value) {
+        key(name);
+        appendJsonString(out, value);
+    };
+    auto num = [&](const char* name, uint64_t value) {
+        key(name);
+        out += std::to_string(value);
+    };
+
+    str("name", summary.name);
+    str("architecture", summary.architecture);
+    str("size_label", summary.size_label);
+    str("quantization", summary.quantization);
+    num("version", summary.version);
+    num("n_params", summary.n_params);
+    num("n_tensors", summary.n_tensors);
+    num("weight_bytes", summary.weight_bytes);
+    num("metadata_bytes", summary.metadata_bytes);
+    num("file_type", summary.file_type);
+    num("context_length", summary.context_length);
+    num("embedding_length", summary.embedding_length);
+    num("block_count", summary.block_count);
+    num("n_vocab", summary.n_vocab);
+    str("chat_template", summary.chat_template);
+    out += '}';
+    return out;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Listing metadata of a GGUF file, read from its header, key-value section and
+ * tensor infos; tensor data is never touched. Missing keys read as empty or 0.
+ */
+struct GgufSummary {
+    std::string name;
+    std::string architecture;
+    std::string size_label;
+    std::string quantization;  // ggml type holding the most weight bytes, e.g. "q4_K"
+    std::string chat_template;
+    uint32_t version = 0;
+    uint64_t n_params = 0;
+    uint64_t n_tensors = 0;
+    uint64_t weight_bytes = 0;
+    uint64_t metadata_bytes = 0;  // offset of the tensor data
+    uint32_t file_type = 0;       // general.file_type (llama_ftype)
+    uint32_t context_length = 0;
+    uint32_t embedding_length = 0;
+    uint32_t block_count = 0;
+    uint32_t n_vocab = 0;
+};
+
+bool inspectGguf(const std::string& path, GgufSummary& summary);
+
+/** The summary as a flat JSON object with snake_case keys. */
+std::string ggufSummaryToJson(const GgufSummary& summary);
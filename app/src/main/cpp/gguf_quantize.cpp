@@ -0,0 +1,319 @@
+#include "gguf_quantize.h"
+
+#include "ggml.h"
+#include "ggml-cpp.h"
+#include "gguf.h"
+
+#include <android/log.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#define LOG_TAG "GgufQuantize"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+// Weights llama.cpp leaves unquantized although they are 2D: expert routers, tiny
+// per-layer projections, positional tables and recurrent-state parameters
+static const char* const KEEP_TENSORS[] = {
+    "_norm.weight", "ffn_gate_inp.weight", "altup", "laurel", "per_layer_model_proj",
+    "ssm_conv1d.weight", "shortconv.conv.weight", "attn_rel_b.weight", ".position_embd.",
+    "time_mix_first.weight", "time_mix_w0.weight", "time_mix_w1.weight", "time_mix_w2.weight",
+    "time_mix_v0.weight", "time_mix_v1.weight", "time_mix_v2.weight", "time_mix_a0.weight",
+    "time_mix_a1.weight", "time_mix_a2.weight", "time_mix_g1.weight", "time_mix_g2.weight",
+    "time_mix_decay_w1.weight", "time_mix_decay_w2.weight", "time_mix_lerp_fused.weight",
+};
+
+/** What the per-tensor type choice needs from the whole model. */
+struct QuantizeMix {
+    llama_ftype ftype;
+    ggml_type base;   // type most weights get
+    int n_layer;
+    bool has_output;  // false when the output projection is tied to token_embd
+};
+
+static ggml_type baseType(llama_ftype ftype) {
+    switch (ftype) {
+        case LLAMA_FTYPE_MOSTLY_F16:    return GGML_TYPE_F16;
+        case LLAMA_FTYPE_MOSTLY_BF16:   return GGML_TYPE_BF16;
+        case LLAMA_FTYPE_MOSTLY_Q4_0:   return GGML_TYPE_Q4_0;
+        case LLAMA_FTYPE_MOSTLY_Q4_1:   return GGML_TYPE_Q4_1;
+        case LLAMA_FTYPE_MOSTLY_Q5_0:   return GGML_TYPE_Q5_0;
+        case LLAMA_FTYPE_MOSTLY_Q5_1:   return GGML_TYPE_Q5_1;
+        case LLAMA_FTYPE_MOSTLY_Q8_0:   return GGML_TYPE_Q8_0;
+        case LLAMA_FTYPE_MOSTLY_Q4_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q4_K_M: return GGML_TYPE_Q4_K;
+        case LLAMA_FTYPE_MOSTLY_Q5_K_S:
+        case LLAMA_FTYPE_MOSTLY_Q5_K_M: return GGML_TYPE_Q5_K;
+        case LLAMA_FTYPE_MOSTLY_Q6_K:   return GGML_TYPE_Q6_K;
+        case LLAMA_FTYPE_MOSTLY_IQ4_NL: return GGML_TYPE_IQ4_NL;
+        default:                        return GGML_TYPE_COUNT;
+    }
+}
+
+static bool isQuantizable(const ggml_tensor* tensor) {
+    const std::string name = tensor->name;
+    if (ggml_n_dims(tensor) < 2 || name.size() < 6 || name.compare(name.size() - 6, 6, "weight") != 0) {
+        return false;
+    }
+    for (const char* keep : KEEP_TENSORS) {
+        if (name.find(keep) != std::string::npos) {
+            return false;
+        }
+    }
+    return name != "position_embd.weight" && name != "token_types.weight";
+}
+
+static int layerOf(const std::string& name) {
+    return name.compare(0, 4, "blk.") == 0 ? std::atoi(name.c_str() + 4) : -1;
+}
+
+// The first and last eighth of the layers, and every third one between them
+static bool useMoreBits(int i_layer, int n_layer) {
+    return i_layer < n_layer / 8 || i_layer >= 7 * n_layer / 8 || (i_layer - n_layer / 8) % 3 == 2;
+}
+
+/**
+ * llama.cpp's llama_tensor_get_type() for the file types baseType() accepts, minus
+ * the per-architecture and MoE special cases.
+ */
+static ggml_type tensorType(const ggml_tensor* tensor, const QuantizeMix& mix) {
+    if (!ggml_is_quantized(mix.base)) {
+        return mix.base;
+    }
+    const std::string name = tensor->name;
+    const int64_t nx = tensor->ne[0];
+    const int i_layer = layerOf(name);
+    const llama_ftype ftype = mix.ftype;
+    const bool k_mix = ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M || ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M;
+
+    ggml_type type = mix.base;
+    if (name == "output.weight" || (!mix.has_output && name == "token_embd.weight")) {
+        type = nx % ggml_blck_size(type) != 0 ? GGML_TYPE_Q8_0 : type == GGML_TYPE_Q8_0 ? type : GGML_TYPE_Q6_K;
+    } else if (name.find("attn_v.weight") != std::string::npos) {
+        if (k_mix && useMoreBits(i_layer, mix.n_layer)) {
+            type = GGML_TYPE_Q6_K;
+        } else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && i_layer < 4) {
+            type = GGML_TYPE_Q5_K;
+        }
+    } else if (name.find("attn_qkv.weight") != std::string::npos) {
+        if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_M) {
+            type = GGML_TYPE_Q5_K;
+        } else if (ftype == LLAMA_FTYPE_MOSTLY_Q5_K_M) {
+            type = GGML_TYPE_Q6_K;
+        }
+    } else if (name.find("ffn_down") != std::string::npos) {
+        if (ftype == LLAMA_FTYPE_MOSTLY_IQ4_NL && i_layer < mix.n_layer / 8) {
+            type = GGML_TYPE_Q5_K;
+        } else if (k_mix && useMoreBits(i_layer, mix.n_layer)) {
+            type = GGML_TYPE_Q6_K;
+        } else if (ftype == LLAMA_FTYPE_MOSTLY_Q4_K_S && i_layer < mix.n_layer / 8) {
+            type = GGML_TYPE_Q5_K;
+        }
+    }
+
+    // Rows must hold whole blocks; k-quant blocks are 256 wide
+    if (nx % ggml_blck_size(type) != 0) {
+        switch (type) {
+            case GGML_TYPE_Q4_K: type = GGML_TYPE_Q5_0; break;
+            case GGML_TYPE_Q5_K: type = GGML_TYPE_Q5_1; break;
+            case GGML_TYPE_Q6_K: type = GGML_TYPE_Q8_0; break;
+            default: break;
+        }
+        if (nx % ggml_blck_size(type) != 0) {
+            type = GGML_TYPE_F16;
+        }
+    }
+    return type;
+}
+
+static bool readAll(int fd, void* data, size_t size, uint64_t offset) {
+    auto* bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t n = pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size, uint64_t offset) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+/**
+ * Convert `tensor`, whose data is `src`, to `type` in `dst`. Rows are split between
+ * `n_threads` threads, each converting its rows to F32 in `f32` and quantizing them.
+ */
+static bool convertTensor(const ggml_tensor* tensor, const uint8_t* src, ggml_type type, int n_threads,
+                          std::vector<float>& f32, std::vector<uint8_t>& dst) {
+    const int64_t n_per_row = tensor->ne[0];
+    const int64_t n_rows = ggml_nrows(tensor);
+    const size_t src_row = ggml_row_size(tensor->type, n_per_row);
+    const ggml_to_float_t to_float = ggml_get_type_traits(tensor->type)->to_float;
+    if (tensor->type != GGML_TYPE_F32 && to_float == nullptr) {
+        LOGE("Cannot convert %s from %s", tensor->name, ggml_type_name(tensor->type));
+        return false;
+    }
+
+    // F32 sources are quantized in place
+    const float* input = reinterpret_cast<const float*>(src);
+    if (tensor->type != GGML_TYPE_F32) {
+        f32.resize(static_cast<size_t>(n_rows * n_per_row));
+        input = f32.data();
+    }
+    dst.resize(n_rows * ggml_row_size(type, n_per_row));
+
+    const int64_t n_workers = std::max<int64_t>(1, std::min<int64_t>(n_threads, n_rows));
+    const int64_t rows_per_worker = (n_rows + n_workers - 1) / n_workers;
+    auto convert = [&](int64_t first, int64_t count) {
+        if (tensor->type != GGML_TYPE_F32) {
+            to_float(src + first * src_row, f32.data() + first * n_per_row, count * n_per_row);
+        }
+        ggml_quantize_chunk(type, input, dst.data(), first * n_per_row, count, n_per_row, nullptr);
+    };
+    std::vector<std::thread> workers;
+    for (int64_t first = rows_per_worker; first < n_rows; first += rows_per_worker) {
+        workers.emplace_back(convert, first, std::min(rows_per_worker, n_rows - first));
+    }
+    convert(0, std::min(rows_per_worker, n_rows));
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return true;
+}
+
+bool quantizeGguf(const std::string& src, const std::string& dst, llama_ftype ftype, int n_threads,
+                  const QuantizeProgressCallback& progress) {
+    const ggml_type base = baseType(ftype);
+    if (base == GGML_TYPE_COUNT) {
+        LOGE("Unsupported file type %d", ftype);
+        return false;
+    }
+
+    // Tensor shapes come with a no_alloc ggml context; the data is read per tensor
+    ggml_context* meta_raw = nullptr;
+    gguf_init_params params = {true, &meta_raw};
+    gguf_context_ptr in(gguf_init_from_file(src.c_str(), params));
+    ggml_context_ptr meta(meta_raw);
+    if (in == nullptr) {
+        LOGE("Failed to read GGUF metadata of %s", src.c_str());
+        return false;
+    }
+    const int64_t split_id = gguf_find_key(in.get(), "split.count");
+    if (split_id >= 0 && gguf_get_kv_type(in.get(), split_id) == GGUF_TYPE_UINT16 &&
+        gguf_get_val_u16(in.get(), split_id) > 1) {
+        LOGE("%s is split across files", src.c_str());
+        return false;
+    }
+
+    QuantizeMix mix = {ftype, base, 0, gguf_find_tensor(in.get(), "output.weight") >= 0};
+    const int64_t arch_id = gguf_find_key(in.get(), "general.architecture");
+    if (arch_id >= 0 && gguf_get_kv_type(in.get(), arch_id) == GGUF_TYPE_STRING) {
+        const std::string key = std::string(gguf_get_val_str(in.get(), arch_id)) + ".block_count";
+        const int64_t id = gguf_find_key(in.get(), key.c_str());
+        mix.n_layer = id >= 0 && gguf_get_kv_type(in.get(), id) == GGUF_TYPE_UINT32 ?
+                static_cast<int>(gguf_get_val_u32(in.get(), id)) : 0;
+    }
+
+    gguf_context_ptr out(gguf_init_empty());
+    gguf_set_kv(out.get(), in.get());
+    gguf_set_val_u32(out.get(), "general.quantization_version", GGML_QNT_VERSION);
+    gguf_set_val_u32(out.get(), "general.file_type", static_cast<uint32_t>(ftype));
+
+    // Every tensor info goes in first, so the metadata size and data offsets are final
+    const int64_t n_tensors = gguf_get_n_tensors(in.get());
+    std::vector<const ggml_tensor*> tensors(n_tensors);
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        const char* name = gguf_get_tensor_name(in.get(), i);
+        const ggml_tensor* tensor = ggml_get_tensor(meta.get(), name);
+        tensors[i] = tensor;
+        gguf_add_tensor(out.get(), tensor);
+        if (isQuantizable(tensor)) {
+            gguf_set_tensor_type(out.get(), name, tensorType(tensor, mix));
+        }
+    }
+
+    const int in_fd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    const int out_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const uint64_t in_data = gguf_get_data_offset(in.get());
+    const uint64_t out_data = gguf_get_meta_size(out.get());
+    const int threads = n_threads > 0 ? n_threads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    bool ok = in_fd >= 0 && out_fd >= 0;
+    if (!ok) {
+        LOGE("Cannot open %s", in_fd < 0 ? src.c_str() : dst.c_str());
+    }
+
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> converted;
+    std::vector<float> f32;
+    uint64_t out_end = out_data;
+    for (int64_t i = 0; ok && i < n_tensors; ++i) {
+        if (!progress(static_cast<int>(i), static_cast<int>(n_tensors))) {
+            LOGI("Quantization stopped after %" PRId64 " of %" PRId64 " tensors", i, n_tensors);
+            ok = false;
+            break;
+        }
+
+        const ggml_tensor* tensor = tensors[i];
+        const ggml_type type = gguf_get_tensor_type(out.get(), i);
+        data.resize(gguf_get_tensor_size(in.get(), i));
+        if (!readAll(in_fd, data.data(), data.size(), in_data + gguf_get_tensor_offset(in.get(), i))) {
+            LOGE("Failed to read %s from %s", tensor->name, src.c_str());
+            ok = false;
+            break;
+        }
+        const std::vector<uint8_t>* written = &data;
+        if (type != tensor->type) {
+            if (!convertTensor(tensor, data.data(), type, threads, f32, converted)) {
+                ok = false;
+                break;
+            }
+            written = &converted;
+        }
+
+        const uint64_t offset = out_data + gguf_get_tensor_offset(out.get(), i);
+        ok = written->size() == gguf_get_tensor_size(out.get(), i) &&
+             writeAll(out_fd, written->data(), written->size(), offset);
+        if (!ok) {
+            LOGE("Failed to write %s to %s", tensor->name, dst.c_str());
+        }
+        out_end = GGML_PAD(offset + written->size(), gguf_get_alignment(out.get()));
+    }
+
+    if (ok) {
+        // Padding between tensors was skipped over, so it reads back as zeros
+        std::vector<uint8_t> header(out_data);
+        gguf_get_meta_data(out.get(), header.data());
+        ok = writeAll(out_fd, header.data(), header.size(), 0) &&
+             ftruncate(out_fd, static_cast<off_t>(out_end)) == 0 &&
+             progress(static_cast<int>(n_tensors), static_cast<int>(n_tensors));
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        ok = close(out_fd) == 0 && ok;
+    }
+    return ok;
+}
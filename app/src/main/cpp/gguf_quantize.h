@@ -0,0 +1,24 @@
+#pragma once
+
+#include "llama.h"
+
+#include <functional>
+#include <string>
+
+/** Tensors written and the total; returning false stops the pass before the next tensor. */
+using QuantizeProgressCallback = std::function<bool(int done, int total)>;
+
+/**
+ * Requantize the GGUF file `src` to `ftype` and write it to `dst`, one tensor at a
+ * time: each is read with pread, converted to F32 if it is quantized, requantized on
+ * `n_threads` threads with ggml_quantize_chunk and appended, so memory stays near the
+ * largest tensor in F32. Weights get llama.cpp's per-tensor type mix for `ftype`
+ * (e.g. Q6_K output and more bits for some attn_v / ffn_down layers in the _M types);
+ * norms, biases, routers and other small tensors are copied. Types that need an
+ * importance matrix and split files are not supported.
+ *
+ * `progress` runs before each tensor and once at the end. False when the pass failed
+ * or was stopped; `dst` is then left incomplete for the caller to remove.
+ */
+bool quantizeGguf(const std::string& src, const std::string& dst, llama_ftype ftype, int n_threads,
+                  const QuantizeProgressCallback& progress);
@@ -5,12 +5,29 @@
 #include <memory>
 #include <mutex>
 #include <atomic>
+#include <list>
 #include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 
 // llama.cpp headers
 #include "llama.h"
 #include "common.h"
 #include "sampling.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include "cpu_backend.h"
+#include "cpu_topology.h"
+#include "engine.h"
+#include "gguf_inspect.h"
+#include "gguf_quantize.h"
+#include "memory_planner.h"
+#include "repack_cache.h"
+#include "vector_index.h"
+#include "weight_prefetch.h"
 
 #define LOG_TAG "LlamaJNI"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
@@ -294,432 +311,2283 @@ static std::string sanitizeInputString(JNIEnv* env, jstring jstr) {
     return result;
 }
 
-// Global state
-static std::mutex g_mutex;
-static llama_model* g_model = nullptr;
-static llama_context* g_ctx = nullptr;
-static std::atomic<bool> g_should_stop{false};
+// Serving model and KV cache state (g_mutex, g_model, g_ctx, g_session, ...) live in
+// engine.cpp; this file adapts them to JNI and manages loading and parking models.
+
+// Params the serving model and context were loaded with
 static common_params g_params;
+// Whether g_params.flash_attn_type was picked by benchmark (flash attention "auto")
+static bool g_flash_attn_auto = false;
 
-extern "C" {
+// Timings of the last load, reported by nativeGetModelInfo (-1 until known)
+static int64_t g_load_ms = -1;
+static int64_t g_warmup_ms = -1;
+
+// Weight file of the loaded model, for prefetching and residency reports. Kept apart
+// from g_mutex so reports do not wait for a running generation.
+static std::mutex g_weights_mutex;
+static std::string g_weights_path;
+static bool g_weights_mapped = false;
+static std::vector<WeightRange> g_weight_ranges;
+static WeightPrefetcher g_prefetcher;
+static RepackProfile g_repack;
 
 /**
- * Initialize the LLM library
+ * Tensor ranges of the loaded model that are read from the file, i.e. without those
+ * copied into the repack buffer; read on first use. Caller holds g_weights_mutex.
  */
-JNIEXPORT jboolean JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeInit(
-        JNIEnv* env,
-        jobject /* this */) {
-    LOGI("Initializing Llama native library");
-    
-    // Initialize llama backend
-    llama_backend_init();
-    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
-    
-    LOGI("Llama backend initialized successfully");
-    return JNI_TRUE;
+static const std::vector<WeightRange>* loadedWeightRanges() {
+    if (g_weights_path.empty()) {
+        return nullptr;
+    }
+    if (g_weight_ranges.empty()) {
+        if (!readWeightRanges(g_weights_path, g_weight_ranges)) {
+            return nullptr;
+        }
+        excludeRepackedRanges(g_weight_ranges, g_repack.tensors);
+    }
+    return &g_weight_ranges;
 }
 
+// Load stages reported to LlamaEngine.LoadProgressCallback. CPU weight repacking is
+// done per tensor as it is uploaded, so it is reported as part of LOAD_STAGE_TENSORS.
+static constexpr jint LOAD_STAGE_MAPPING = 0;  // file open, metadata, mmap
+static constexpr jint LOAD_STAGE_TENSORS = 1;  // tensor data read and upload
+static constexpr jint LOAD_STAGE_CONTEXT = 2;  // KV cache and compute buffers
+
+// Loads are serialized by g_load_mutex and only take g_mutex to install the new
+// model, so the serving model keeps answering while the next one loads
+static std::mutex g_load_mutex;
+static std::atomic<bool> g_load_cancel{false};
+
+// Estimated footprint of the serving model, checked against the load's memory budget
+static std::atomic<uint64_t> g_serving_bytes{0};
+
+// Upper bound of automatic context sizing; past this prefill time, not memory, is the limit
+static constexpr uint32_t AUTO_MAX_CONTEXT = 8192;
+
+// nativeLoadModel results
+static constexpr jint LOAD_FAILED = 0;       // nothing is loaded
+static constexpr jint LOAD_COLD = 1;         // loaded after unloading any previous model
+static constexpr jint LOAD_SWAPPED = 2;      // loaded and warmed beside the previous model, then swapped in
+static constexpr jint LOAD_FAILED_KEPT = 3;  // staged load failed, the previous model still serves
+
+struct LoadProgress {
+    JNIEnv* env;
+    jobject callback;
+    jmethodID method;
+};
+
 /**
- * Load a model from file path
+ * Forward a load stage to the Kotlin callback. Returns false when the load should
+ * stop: nativeCancelLoad was called, or the callback returned false or threw.
  */
-JNIEXPORT jboolean JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeLoadModel(
-        JNIEnv* env,
-        jobject /* this */,
-        jstring modelPath,
-        jint nThreads,
-        jint nGpuLayers,
-        jint contextSize) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    const char* path = env->GetStringUTFChars(modelPath, nullptr);
-    LOGI("Loading model from: %s", path);
-    LOGI("Threads: %d, GPU Layers: %d, Context: %d", nThreads, nGpuLayers, contextSize);
-    
-    // Free existing model if any
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
+static bool reportLoadProgress(const LoadProgress& progress, jint stage, float value) {
+    if (g_load_cancel.load()) {
+        return false;
     }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
+    if (progress.method == nullptr) {
+        return true;
     }
-    
-    // Set up model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = nGpuLayers;
-    
-    // Load model using new API
-    g_model = llama_model_load_from_file(path, model_params);
-    if (!g_model) {
-        LOGE("Failed to load model from: %s", path);
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
+    const jboolean keep = progress.env->CallBooleanMethod(
+            progress.callback, progress.method, stage, static_cast<jfloat>(value));
+    if (progress.env->ExceptionCheck()) {
+        LOGE("Exception in load progress callback, cancelling load");
+        progress.env->ExceptionClear();
+        return false;
     }
-    
-    // Set up context parameters
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = contextSize;
-    ctx_params.n_threads = nThreads;
-    ctx_params.n_threads_batch = nThreads;
-    
-    // Create context using new API
-    g_ctx = llama_init_from_model(g_model, ctx_params);
-    if (!g_ctx) {
-        LOGE("Failed to create context");
-        llama_model_free(g_model);
-        g_model = nullptr;
-        env->ReleaseStringUTFChars(modelPath, path);
-        return JNI_FALSE;
+    return keep == JNI_TRUE;
+}
+
+static bool onTensorLoadProgress(float value, void* data) {
+    return reportLoadProgress(*static_cast<const LoadProgress*>(data), LOAD_STAGE_TENSORS, value);
+}
+
+// nativeQuantize results
+static constexpr jint QUANTIZE_OK = 0;
+static constexpr jint QUANTIZE_FAILED = 1;
+static constexpr jint QUANTIZE_CANCELLED = 2;
+static constexpr jint QUANTIZE_BUSY = 3;
+
+// One quantization at a time; it needs no model or context of its own
+static std::mutex g_quantize_mutex;
+static std::atomic<bool> g_quantize_cancel{false};
+
+struct QuantizeProgress {
+    JNIEnv* env;
+    jobject callback;
+    jmethodID method;  // onProgress(II)Z
+};
+
+/**
+ * Forward tensors done / total to the Kotlin callback. Returns false when the
+ * quantization should stop: nativeCancelQuantize was called, or the callback
+ * returned false or threw.
+ */
+static bool reportQuantizeProgress(const QuantizeProgress& progress, int done, int total) {
+    if (g_quantize_cancel.load()) {
+        return false;
+    }
+    if (progress.method == nullptr) {
+        return true;
+    }
+    const jboolean keep = progress.env->CallBooleanMethod(progress.callback, progress.method, done, total);
+    if (progress.env->ExceptionCheck()) {
+        LOGE("Exception in quantize progress callback, cancelling");
+        progress.env->ExceptionClear();
+        return false;
+    }
+    return keep == JNI_TRUE;
+}
+
+/** llama.cpp log sink: warnings and errors go to logcat. */
+static void onLlamaLog(ggml_log_level level, const char* text, void* /* user_data */) {
+    if (level == GGML_LOG_LEVEL_ERROR) {
+        LOGE("%s", text);
+    } else if (level == GGML_LOG_LEVEL_WARN) {
+        LOGW("%s", text);
     }
-    
-    // Initialize default params
-    g_params = common_params();
-    g_params.model.path = path;
-    g_params.n_ctx = contextSize;
-    g_params.cpuparams.n_threads = nThreads;
-    
-    env->ReleaseStringUTFChars(modelPath, path);
-    
-    LOGI("Model loaded successfully");
-    return JNI_TRUE;
 }
 
+// LoRA adapters loaded on the serving model, by file path. llama.cpp frees them with
+// the model, so they move with it when it is parked.
+struct LoraAdapter {
+    std::string path;
+    llama_adapter_lora* adapter;
+};
+static std::vector<LoraAdapter> g_adapters;
+
 /**
- * Unload the current model
+ * Read a Java String[] into sanitized UTF-8 strings.
  */
-JNIEXPORT void JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeUnloadModel(
-        JNIEnv* env,
-        jobject /* this */) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    LOGI("Unloading model");
-    
-    // Free llama.cpp resources
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
+static std::vector<std::string> toStringVector(JNIEnv* env, jobjectArray array) {
+    std::vector<std::string> result;
+    if (array == nullptr) {
+        return result;
     }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
+    const jsize count = env->GetArrayLength(array);
+    result.reserve(count);
+    for (jsize i = 0; i < count; ++i) {
+        jstring item = (jstring) env->GetObjectArrayElement(array, i);
+        result.push_back(sanitizeInputString(env, item));
+        env->DeleteLocalRef(item);
     }
-    
-    LOGI("Model unloaded successfully");
+    return result;
 }
 
 /**
- * Generate text completion
+ * Prompt segments from parallel arrays of texts, message ids, roles and pinned flags.
+ * Ids and roles may be null, or -1 for segments that are not stored messages; without
+ * flags every segment is pinned.
  */
-JNIEXPORT jstring JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGenerate(
-        JNIEnv* env,
-        jobject /* this */,
-        jstring prompt,
-        jint maxTokens,
-        jfloat temperature,
-        jfloat topP,
-        jint topK) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_model || !g_ctx) {
-        LOGE("Model not loaded");
-        return safeNewStringUTF(env, "");
+static std::vector<PromptSegment> toPromptSegments(JNIEnv* env, jobjectArray texts, jlongArray messageIds,
+                                                   jintArray roles, jbooleanArray pinned) {
+    std::vector<std::string> strings = toStringVector(env, texts);
+    std::vector<PromptSegment> segments(strings.size());
+    for (size_t i = 0; i < strings.size(); ++i) {
+        segments[i].text = std::move(strings[i]);
     }
-    
-    const std::string promptStr = sanitizeInputString(env, prompt);
-    LOGI("Generating with prompt: %s", promptStr.c_str());
-    LOGI("Max tokens: %d, Temperature: %.2f", maxTokens, temperature);
-    
-    // Tokenize prompt using common_tokenize
-    std::vector<llama_token> tokens_list = common_tokenize(g_ctx, promptStr, true);
-    
-    const int n_ctx = llama_n_ctx(g_ctx);
-    const int n_predict = maxTokens;
-    
-    // Prepare sampling
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-    
-    // Create batch
-    llama_batch batch = llama_batch_init(n_ctx, 0, 1);
-    
-    // Get vocab for token operations
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
-    
-    // Add prompt tokens to batch
-    for (size_t i = 0; i < tokens_list.size(); i++) {
-        common_batch_add(batch, tokens_list[i], i, {0}, false);
+    if (messageIds != nullptr && env->GetArrayLength(messageIds) == static_cast<jsize>(segments.size())) {
+        std::vector<jlong> ids(segments.size());
+        env->GetLongArrayRegion(messageIds, 0, static_cast<jsize>(ids.size()), ids.data());
+        for (size_t i = 0; i < segments.size(); ++i) {
+            segments[i].message_id = ids[i];
+        }
     }
-    
-    // Prepare for generation
-    batch.logits[batch.n_tokens - 1] = true;
-    
-    if (llama_decode(g_ctx, batch) != 0) {
-        LOGE("Failed to decode");
-        llama_batch_free(batch);
-        llama_sampler_free(smpl);
-        return safeNewStringUTF(env, "");
+    if (roles != nullptr && env->GetArrayLength(roles) == static_cast<jsize>(segments.size())) {
+        std::vector<jint> values(segments.size());
+        env->GetIntArrayRegion(roles, 0, static_cast<jsize>(values.size()), values.data());
+        for (size_t i = 0; i < segments.size(); ++i) {
+            segments[i].role = values[i];
+        }
     }
-    
-    int n_cur = batch.n_tokens;
-    int n_decode = 0;
-    std::string result;
-    
-    // Generation loop
-    while (n_cur <= n_ctx && n_decode < n_predict) {
-        // Sample next token
-        const llama_token new_token_id = llama_sampler_sample(smpl, g_ctx, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
+    if (pinned != nullptr && env->GetArrayLength(pinned) == static_cast<jsize>(segments.size())) {
+        std::vector<jboolean> flags(segments.size());
+        env->GetBooleanArrayRegion(pinned, 0, static_cast<jsize>(flags.size()), flags.data());
+        for (size_t i = 0; i < segments.size(); ++i) {
+            segments[i].pinned = flags[i] != JNI_FALSE;
         }
-        
-        // Convert token to text
-        std::string piece = common_token_to_piece(g_ctx, new_token_id);
-        result.append(piece);
-        
-        // Check for Phi-3 stop sequences
-        if (result.find("<|end|>") != std::string::npos ||
-            result.find("<|user|>") != std::string::npos ||
-            result.find("<|assistant|>") != std::string::npos ||
-            result.find("<|system|>") != std::string::npos) {
-            LOGI("Stop sequence detected, ending generation");
-            break;
+    }
+    return segments;
+}
+
+// Sidecar that g_token_cache is persisted to after each streamed generation ("" for none)
+static std::string g_token_cache_path;
+
+/**
+ * Explicit ggml threadpools for decode and prompt batches. When pinned, workers are
+ * restricted to the given CPUs (default: the fastest cores by sysfs capacity) with the
+ * configured priority and poll level; otherwise ggml's per-call threads are used.
+ */
+struct ThreadpoolSettings {
+    bool pinned = false;
+    std::vector<int> decode_cpus;  // empty: fastest n_threads cores
+    std::vector<int> batch_cpus;   // empty: fastest n_threads_batch cores
+    ggml_sched_priority priority = GGML_SCHED_PRIO_NORMAL;
+    uint32_t poll = 50;
+};
+
+static ThreadpoolSettings g_tp_settings;
+static ggml_threadpool* g_threadpool = nullptr;
+static ggml_threadpool* g_threadpool_batch = nullptr;
+
+// Resolved through the CPU backend registry so this keeps working with dynamically
+// loaded CPU backends, like llama.cpp's own tools do.
+static ggml_backend_reg_t cpuBackendReg() {
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    return dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+}
+
+static void freeThreadpools() {
+    ggml_backend_reg_t reg = cpuBackendReg();
+    auto* threadpool_free = reg ? reinterpret_cast<decltype(ggml_threadpool_free)*>(
+            ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free")) : nullptr;
+    if (threadpool_free != nullptr) {
+        if (g_threadpool_batch && g_threadpool_batch != g_threadpool) {
+            threadpool_free(g_threadpool_batch);
         }
-        
-        // Prepare next batch
-        common_batch_clear(batch);
-        common_batch_add(batch, new_token_id, n_cur, {0}, true);
-        
-        n_decode++;
-        n_cur++;
-        
-        if (llama_decode(g_ctx, batch) != 0) {
-            LOGE("Failed to decode at position %d", n_cur);
-            break;
+        if (g_threadpool) {
+            threadpool_free(g_threadpool);
         }
     }
-    
-    llama_batch_free(batch);
-    llama_sampler_free(smpl);
-    
-    LOGI("Generated %d tokens", n_decode);
-    return safeNewStringUTF(env, result.c_str());
+    g_threadpool = nullptr;
+    g_threadpool_batch = nullptr;
+}
+
+static ggml_threadpool* createThreadpool(int n_threads, const std::vector<int>& cpus) {
+    ggml_backend_reg_t reg = cpuBackendReg();
+    auto* threadpool_new = reg ? reinterpret_cast<decltype(ggml_threadpool_new)*>(
+            ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new")) : nullptr;
+    if (threadpool_new == nullptr) {
+        LOGW("CPU backend does not expose ggml_threadpool_new");
+        return nullptr;
+    }
+
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    params.prio = g_tp_settings.priority;
+    params.poll = g_tp_settings.poll;
+    // Workers (and the calling thread, which ggml runs as worker 0) float within the
+    // mask rather than being bound one per core, so the caller is never stuck on one CPU
+    params.strict_cpu = false;
+
+    const std::vector<int> mask_cpus = cpus.empty() ? fastestCpus(n_threads) : cpus;
+    for (int cpu : mask_cpus) {
+        if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+            params.cpumask[cpu] = true;
+        }
+    }
+    return threadpool_new(&params);
 }
 
 /**
- * Generate text with streaming callback
+ * Set the context's thread counts and (re)build the threadpools to match.
+ * Caller holds g_mutex.
  */
-JNIEXPORT void JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGenerateStream(
-        JNIEnv* env,
-        jobject thiz,
-        jstring prompt,
-        jint maxTokens,
-        jfloat temperature,
-        jfloat topP,
-        jint topK,
-        jobject callback) {
-    
-    std::lock_guard<std::mutex> lock(g_mutex);
-    
-    if (!g_model || !g_ctx) {
-        LOGE("Model not loaded");
-        return;
+static bool applyThreadpools(int n_threads, int n_threads_batch) {
+    llama_detach_threadpool(g_ctx);
+    freeThreadpools();
+    llama_set_n_threads(g_ctx, n_threads, n_threads_batch);
+
+    if (!g_tp_settings.pinned) {
+        return false;
     }
-    
-    g_should_stop.store(false);
-    
-    const std::string promptStr = sanitizeInputString(env, prompt);
-    LOGI("Streaming generation with prompt: %s", promptStr.c_str());
-    
-    // **CRITICAL FIX: Clear KV cache before each generation**
-    llama_memory_t mem = llama_get_memory(g_ctx);
-    llama_memory_clear(mem, false);  // Clear metadata but keep data buffers
-    LOGI("KV cache cleared");
-    
-    // Get callback methods
-    jclass callbackClass = env->GetObjectClass(callback);
-    jmethodID onTokenMethod = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;)V");
-    jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
-    
-    // Tokenize prompt using common_tokenize
-    std::vector<llama_token> tokens_list = common_tokenize(g_ctx, promptStr, true);
-    
-    const int n_ctx = llama_n_ctx(g_ctx);
-    const int n_predict = maxTokens;
-    
-    // Get vocab for token operations
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
-    
-    // Prepare sampling
-    auto sparams = llama_sampler_chain_default_params();
-    sparams.no_perf = false;
-    llama_sampler* smpl = llama_sampler_chain_init(sparams);
-    
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(topK));
-    llama_sampler_chain_add(smpl, llama_sampler_init_top_p(topP, 1));
-    llama_sampler_chain_add(smpl, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(smpl, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
-    
-    // Create batch
-    llama_batch batch = llama_batch_init(n_ctx, 0, 1);
-    
-    // Add prompt tokens to batch
-    for (size_t i = 0; i < tokens_list.size(); i++) {
-        common_batch_add(batch, tokens_list[i], i, {0}, false);
+
+    g_threadpool = createThreadpool(n_threads, g_tp_settings.decode_cpus);
+    if (n_threads_batch == n_threads && g_tp_settings.batch_cpus == g_tp_settings.decode_cpus) {
+        g_threadpool_batch = g_threadpool;
+    } else {
+        g_threadpool_batch = createThreadpool(n_threads_batch, g_tp_settings.batch_cpus);
     }
-    
-    // Prepare for generation
-    batch.logits[batch.n_tokens - 1] = true;
-    
-    LOGI("Decoding initial batch with %d tokens...", batch.n_tokens);
-    int decode_result = llama_decode(g_ctx, batch);
-    if (decode_result != 0) {
-        LOGE("Failed to decode initial batch, error code: %d", decode_result);
-        LOGE("Context size: %d, Batch tokens: %d", n_ctx, batch.n_tokens);
-        llama_batch_free(batch);
-        llama_sampler_free(smpl);
-        
-        // Call error callback
-        jstring errorMsg = safeNewStringUTF(env, "Failed to decode prompt");
-        jclass callbackClass = env->GetObjectClass(callback);
-        // Try to call onComplete to prevent hanging
-        jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
-        env->CallVoidMethod(callback, onCompleteMethod);
-        env->DeleteLocalRef(errorMsg);
-        return;
+
+    if (!g_threadpool || !g_threadpool_batch) {
+        LOGE("Failed to create threadpools, using unpinned threads");
+        freeThreadpools();
+        return false;
     }
-    LOGI("Initial batch decoded successfully");
-    
-    int n_cur = batch.n_tokens;
-    int n_decode = 0;
-    std::string accumulated_text;
-    std::string utf8_remainder;
-    
-    // Generation loop with streaming
-    while (n_cur <= n_ctx && n_decode < n_predict && !g_should_stop.load()) {
-        // Sample next token
-        const llama_token new_token_id = llama_sampler_sample(smpl, g_ctx, -1);
-        
-        // Check for EOS
-        if (llama_vocab_is_eog(vocab, new_token_id)) {
-            break;
-        }
-        
-        // Convert token to text
-        std::string token_str = common_token_to_piece(g_ctx, new_token_id);
-        accumulated_text += token_str;
-        
-        // Check for Phi-3 stop sequences
-        if (accumulated_text.find("<|end|>") != std::string::npos ||
-            accumulated_text.find("<|user|>") != std::string::npos ||
-            accumulated_text.find("<|assistant|>") != std::string::npos ||
-            accumulated_text.find("<|system|>") != std::string::npos) {
-            LOGI("Stop sequence detected, ending generation");
-            break;
-        }
-        
-        // Stream the token if not empty - use safe string conversion
-        if (!token_str.empty()) {
-            LOGI("Token before conversion: length=%zu, first_byte=0x%02X", token_str.length(), (unsigned char)token_str[0]);
-            jstring jtoken = safeNewStringUTFStreaming(env, token_str, utf8_remainder);
-            if (jtoken != nullptr) {
-                jsize jlen = env->GetStringLength(jtoken);
-                if (jlen > 0) {
-                    env->CallVoidMethod(callback, onTokenMethod, jtoken);
-                    if (env->ExceptionCheck()) {
-                        LOGE("Exception in onToken callback, clearing and continuing");
-                        env->ExceptionClear();
-                    }
-                }
-                env->DeleteLocalRef(jtoken);
-            }
-        }
-        
-        // Prepare next batch
-        common_batch_clear(batch);
-        common_batch_add(batch, new_token_id, n_cur, {0}, true);
-        
-        n_decode++;
-        n_cur++;
-        
-        if (llama_decode(g_ctx, batch) != 0) {
-            LOGE("Failed to decode at position %d", n_cur);
-            break;
-        }
+
+    llama_attach_threadpool(g_ctx, g_threadpool, g_threadpool_batch);
+    LOGI("Attached pinned threadpools: %d decode / %d batch threads, prio %d, poll %u",
+         n_threads, n_threads_batch, g_tp_settings.priority, g_tp_settings.poll);
+    return true;
+}
+
+/**
+ * Time a prefill of n_prompt tokens and n_gen single-token decodes on sequence `seq`
+ * of `ctx`, which is emptied afterwards. Token ids are arbitrary; only the cost of
+ * the graph matters.
+ */
+static bool timePrefillDecode(llama_context* ctx, llama_seq_id seq, int n_prompt, int n_gen,
+                              double& prefill_tps, double& decode_tps) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    llama_batch batch = llama_batch_init(std::max(n_prompt, 1), 0, 1);
+    bool ok = true;
+
+    common_batch_clear(batch);
+    for (int i = 0; i < n_prompt; ++i) {
+        common_batch_add(batch, (i * 7919 + 13) % n_vocab, i, {seq}, i == n_prompt - 1);
     }
-    
-    llama_batch_free(batch);
-    llama_sampler_free(smpl);
-    
-    // Flush any remaining partial sequences
-    if (!utf8_remainder.empty()) {
-        jstring jflush = safeNewStringUTFStreaming(env, "", utf8_remainder);
-        if (jflush != nullptr && env->GetStringLength(jflush) > 0) {
-            env->CallVoidMethod(callback, onTokenMethod, jflush);
-            if (env->ExceptionCheck()) {
-                LOGE("Exception in onToken flush callback, clearing");
-                env->ExceptionClear();
-            }
-        }
-        if (jflush != nullptr) {
-            env->DeleteLocalRef(jflush);
-        }
+    int64_t t_start_us = ggml_time_us();
+    ok = llama_decode(ctx, batch) == 0;
+    llama_synchronize(ctx);
+    prefill_tps = n_prompt / std::max((ggml_time_us() - t_start_us) / 1e6, 1e-6);
+
+    t_start_us = ggml_time_us();
+    for (int i = 0; ok && i < n_gen; ++i) {
+        common_batch_clear(batch);
+        common_batch_add(batch, (i * 104729 + 7) % n_vocab, n_prompt + i, {seq}, true);
+        ok = llama_decode(ctx, batch) == 0;
     }
+    llama_synchronize(ctx);
+    decode_tps = n_gen / std::max((ggml_time_us() - t_start_us) / 1e6, 1e-6);
 
-    // Call completion callback
-    env->CallVoidMethod(callback, onCompleteMethod);
-    
-    LOGI("Streaming complete. Generated %d tokens", n_decode);
+    llama_batch_free(batch);
+    llama_memory_seq_rm(llama_get_memory(ctx), seq, -1, -1);
+    return ok;
 }
 
 /**
- * Stop ongoing generation
+ * Time prefill and decode with n_threads threads, on the scoring scratch sequence
+ * so the chat cache is untouched. Caller holds g_mutex.
  */
-JNIEXPORT void JNICALL
-Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeStopGeneration(
-        JNIEnv* env,
-        jobject /* this */) {
-    LOGI("Stopping generation");
-    g_should_stop.store(true);
+static bool benchmarkThreads(int n_threads, int n_prompt, int n_gen, double& prefill_tps, double& decode_tps) {
+    applyThreadpools(n_threads, n_threads);
+    clearScoreSequences();
+    return timePrefillDecode(g_ctx, SEQ_SCORE, n_prompt, n_gen, prefill_tps, decode_tps);
+}
+
+// Embedding state: a separate embedding-mode context, either on the chat model
+// or on a dedicated embedding GGUF. g_embd_model holds a handle to either.
+static std::mutex g_embd_mutex;
+static ModelHandle g_embd_model;
+static llama_context* g_embd_ctx = nullptr;
+
+static void freeEmbeddingContext() {
+    if (g_embd_ctx) {
+        llama_free(g_embd_ctx);
+        g_embd_ctx = nullptr;
+    }
+    g_embd_model.reset();
 }
 
 /**
- * Get model information
+ * A chat model and its context, with everything that belongs to them: the params
+ * they were loaded with and the cached conversation. Loads build one off g_mutex;
+ * installModel() swaps it with the serving globals. A swapped-out slot is either
+ * parked for a fast switch back or released with freeModelSlot().
  */
-JNIEXPORT jstring JNICALL
+struct ModelSlot {
+    std::string key;  // model path plus the params that shape its context
+    ModelHandle model;
+    llama_context* ctx = nullptr;
+    common_params params;
+    KvSession session;
+    KvSession stash;
+    bool mapped = false;
+    uint64_t bytes = 0;
+    RepackProfile repack;
+    std::vector<LoraAdapter> adapters;
+    std::string lora_key;
+    bool flash_attn_auto = false;
+};
+
+static std::string g_serving_key;
+
+// Models kept loaded but not serving, most recently used first. The serving model
+// plus these stay within g_parked_limit bytes. Lock order: g_mutex, then this.
+static std::mutex g_parked_mutex;
+static std::list<ModelSlot> g_parked;
+static std::atomic<uint64_t> g_parked_limit{0};
+
+/**
+ * Drop an embedding context that runs on `model`, after any batch still using it.
+ */
+static void releaseEmbeddingOn(const ModelHandle& model) {
+    std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+    if (g_embd_ctx && g_embd_model == model) {
+        freeEmbeddingContext();
+    }
+}
+
+static void freeModelSlot(ModelSlot& slot) {
+    if (slot.model) {
+        releaseEmbeddingOn(slot.model);
+    }
+    if (slot.ctx) {
+        llama_free(slot.ctx);
+        slot.ctx = nullptr;
+    }
+    // Adapters are freed with their model
+    slot.adapters.clear();
+    slot.lora_key.clear();
+    slot.model.reset();
+    slot.key.clear();
+}
+
+/**
+ * Make `slot` the serving model and return the previous one in it, detached from
+ * the threadpools. Caller holds g_mutex, so no request is running on either model.
+ */
+static void installModel(ModelSlot& slot) {
+    if (g_ctx) {
+        llama_detach_threadpool(g_ctx);
+    }
+    freeThreadpools();
+
+    std::swap(g_serving_key, slot.key);
+    std::swap(g_model, slot.model);
+    std::swap(g_ctx, slot.ctx);
+    std::swap(g_params, slot.params);
+    std::swap(g_flash_attn_auto, slot.flash_attn_auto);
+    std::swap(g_session, slot.session);
+    std::swap(g_stash, slot.stash);
+    std::swap(g_adapters, slot.adapters);
+    std::swap(g_lora_key, slot.lora_key);
+    slot.bytes = g_serving_bytes.exchange(slot.bytes);
+
+    std::lock_guard<std::mutex> weights_lock(g_weights_mutex);
+    g_prefetcher.stop();
+    g_weight_ranges.clear();
+    g_weights_path = g_ctx ? g_params.model.path : "";
+    std::swap(g_weights_mapped, slot.mapped);
+    std::swap(g_repack, slot.repack);
+}
+
+/**
+ * Drop least recently used parked models until the serving model, the parked ones
+ * and `incoming` bytes fit the limit. Evicted slots are moved to `evicted` so they
+ * can be freed without holding g_parked_mutex.
+ */
+static void evictParked(uint64_t incoming, std::list<ModelSlot>& evicted) {
+    std::lock_guard<std::mutex> parked_lock(g_parked_mutex);
+    uint64_t total = g_serving_bytes.load() + incoming;
+    for (const ModelSlot& parked : g_parked) {
+        total += parked.bytes;
+    }
+    while (!g_parked.empty() && total > g_parked_limit.load()) {
+        total -= g_parked.back().bytes;
+        LOGI("Evicting parked model %s", g_parked.back().params.model.path.c_str());
+        evicted.splice(evicted.begin(), g_parked, std::prev(g_parked.end()));
+    }
+}
+
+static void freeModelSlots(std::list<ModelSlot>& slots) {
+    for (ModelSlot& slot : slots) {
+        freeModelSlot(slot);
+    }
+    slots.clear();
+}
+
+/**
+ * Park a slot that was just swapped out, unless the limit leaves no room for it;
+ * returns false if the caller must free it instead. Its embedding context goes,
+ * since retrieval follows the serving model.
+ */
+static bool parkModelSlot(ModelSlot& slot, std::list<ModelSlot>& evicted) {
+    if (!slot.model || slot.bytes + g_serving_bytes.load() > g_parked_limit.load()) {
+        return false;
+    }
+    releaseEmbeddingOn(slot.model);
+    evictParked(slot.bytes, evicted);
+
+    std::lock_guard<std::mutex> parked_lock(g_parked_mutex);
+    LOGI("Parking model %s", slot.params.model.path.c_str());
+    g_parked.push_front(std::move(slot));
+    slot = ModelSlot();
+    return true;
+}
+
+/**
+ * Take the most recently used parked slot matching `key`, or, when `by_path` is set,
+ * any parked slot loaded from the file `key`. Returns false if there is none.
+ */
+static bool takeParked(const std::string& key, bool by_path, ModelSlot& slot) {
+    std::lock_guard<std::mutex> parked_lock(g_parked_mutex);
+    for (auto it = g_parked.begin(); it != g_parked.end(); ++it) {
+        if ((by_path ? it->params.model.path : it->key) == key) {
+            slot = std::move(*it);
+            g_parked.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Swap a parked slot in and park (or free) the model it replaces, keeping the
+ * thread settings the caller asks for. Caller holds g_mutex.
+ */
+static void activateParked(ModelSlot& slot, int n_threads, int n_threads_batch) {
+    installModel(slot);
+    applyThreadpools(n_threads, n_threads_batch);
+    g_params.cpuparams.n_threads = n_threads;
+    g_params.cpuparams_batch.n_threads = n_threads_batch;
+
+    std::list<ModelSlot> evicted;
+    if (!parkModelSlot(slot, evicted)) {
+        freeModelSlot(slot);
+    }
+    freeModelSlots(evicted);
+}
+
+/**
+ * Make the model loaded from `path` serve a request, switching to it if it is
+ * parked. An empty path means the serving model. Caller holds g_mutex.
+ */
+static bool activateModel(const std::string& path) {
+    if (path.empty() || (g_ctx && g_params.model.path == path)) {
+        return g_ctx != nullptr;
+    }
+    ModelSlot slot;
+    if (!takeParked(path, true, slot)) {
+        LOGE("Model %s is not loaded", path.c_str());
+        return false;
+    }
+    const int64_t t_start_us = ggml_time_us();
+    activateParked(slot, g_params.cpuparams.n_threads, g_params.cpuparams_batch.n_threads);
+    LOGI("Switched to %s in %lld ms", path.c_str(), static_cast<long long>((ggml_time_us() - t_start_us) / 1000));
+    return true;
+}
+
+/**
+ * Free the chat model, every parked model and everything bound to them.
+ * Caller holds g_mutex.
+ */
+static void releaseModel() {
+    ModelSlot empty;
+    installModel(empty);
+    freeModelSlot(empty);
+
+    std::list<ModelSlot> parked;
+    {
+        std::lock_guard<std::mutex> parked_lock(g_parked_mutex);
+        parked.swap(g_parked);
+    }
+    freeModelSlots(parked);
+}
+
+/**
+ * Adapter loaded from `path` on the serving model, loading it on first use.
+ * Null if the file is not a LoRA for this model. Caller holds g_mutex.
+ */
+static llama_adapter_lora* findLoraAdapter(const std::string& path) {
+    for (const LoraAdapter& entry : g_adapters) {
+        if (entry.path == path) {
+            return entry.adapter;
+        }
+    }
+    const int64_t t_start_us = ggml_time_us();
+    llama_adapter_lora* adapter = llama_adapter_lora_init(g_model.get(), path.c_str());
+    if (adapter == nullptr) {
+        LOGE("Failed to load LoRA adapter %s", path.c_str());
+        return nullptr;
+    }
+    g_adapters.push_back({path, adapter});
+    LOGI("Loaded LoRA adapter %s in %lld ms", path.c_str(),
+         static_cast<long long>((ggml_time_us() - t_start_us) / 1000));
+    return adapter;
+}
+
+/**
+ * Apply the adapter set of a request: paths[i] at scales[i], adapters with scale 0
+ * left out. Only re-applies when the set changed, which just swaps the context's
+ * adapter list, so switching persona costs no reload. Caller holds g_mutex.
+ */
+static bool applyLoraAdapters(JNIEnv* env, jobjectArray paths, jfloatArray scales) {
+    const std::vector<std::string> lora_paths = toStringVector(env, paths);
+    std::vector<float> lora_scales(lora_paths.size(), 1.0f);
+    if (scales != nullptr) {
+        const jsize n = std::min<jsize>(env->GetArrayLength(scales), static_cast<jsize>(lora_scales.size()));
+        env->GetFloatArrayRegion(scales, 0, n, lora_scales.data());
+    }
+
+    std::vector<std::pair<std::string, float>> active;
+    for (size_t i = 0; i < lora_paths.size(); ++i) {
+        if (lora_scales[i] != 0.0f) {
+            active.emplace_back(lora_paths[i], lora_scales[i]);
+        }
+    }
+    std::sort(active.begin(), active.end());
+    std::string key;
+    for (const auto& entry : active) {
+        key += entry.first + "@" + std::to_string(entry.second) + ";";
+    }
+    if (key == g_lora_key) {
+        return true;
+    }
+
+    std::vector<std::pair<llama_adapter_lora*, float>> adapters;
+    for (const auto& entry : active) {
+        llama_adapter_lora* adapter = findLoraAdapter(entry.first);
+        if (adapter == nullptr) {
+            return false;
+        }
+        adapters.emplace_back(adapter, entry.second);
+    }
+    llama_clear_adapter_lora(g_ctx);
+    for (const auto& entry : adapters) {
+        if (llama_set_adapter_lora(g_ctx, entry.first, entry.second) != 0) {
+            LOGE("Failed to apply LoRA adapter");
+            llama_clear_adapter_lora(g_ctx);
+            g_lora_key.clear();
+            return false;
+        }
+    }
+    g_lora_key = key;
+    LOGI("LoRA adapters now: %s", key.empty() ? "none" : key.c_str());
+    return true;
+}
+
+/**
+ * Write one pooled embedding row, optionally L2-normalized. int8 rows are stored as
+ * a float32 scale followed by n_embd symmetric int8 values.
+ */
+static void writeEmbeddingRow(const float* embd, int n_embd, bool normalize, bool int8, uint8_t* dst) {
+    float norm = 1.0f;
+    if (normalize) {
+        double sum = 0.0;
+        for (int i = 0; i < n_embd; ++i) {
+            sum += static_cast<double>(embd[i]) * embd[i];
+        }
+        norm = sum > 0.0 ? static_cast<float>(1.0 / std::sqrt(sum)) : 0.0f;
+    }
+
+    if (!int8) {
+        float* out = reinterpret_cast<float*>(dst);
+        for (int i = 0; i < n_embd; ++i) {
+            out[i] = embd[i] * norm;
+        }
+        return;
+    }
+
+    float max_abs = 0.0f;
+    for (int i = 0; i < n_embd; ++i) {
+        max_abs = std::max(max_abs, std::fabs(embd[i] * norm));
+    }
+    const float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    std::memcpy(dst, &scale, sizeof(float));
+    int8_t* out = reinterpret_cast<int8_t*>(dst + sizeof(float));
+    for (int i = 0; i < n_embd; ++i) {
+        out[i] = static_cast<int8_t>(std::lround(embd[i] * norm / scale));
+    }
+}
+
+static size_t embeddingRowBytes(int n_embd, bool int8) {
+    return int8 ? sizeof(float) + n_embd : sizeof(float) * n_embd;
+}
+
+/**
+ * Embed texts on the embedding context, packing as many texts as fit into one
+ * batch on separate sequence IDs. Rows are written to `out` in input order.
+ * Returns the number of rows written, or -1 on failure. Caller holds g_embd_mutex.
+ */
+static int embedTexts(const std::vector<std::string>& texts, bool normalize, bool int8, uint8_t* out) {
+    const llama_model* model = llama_get_model(g_embd_ctx);
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const int n_embd = llama_model_n_embd(model);
+    const size_t n_batch = llama_n_batch(g_embd_ctx);
+    const int n_seq_max = static_cast<int>(llama_n_seq_max(g_embd_ctx));
+    const size_t row_bytes = embeddingRowBytes(n_embd, int8);
+    const bool use_encode = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+
+    std::vector<std::vector<llama_token>> inputs;
+    inputs.reserve(texts.size());
+    size_t n_tokens_total = 0;
+    for (const std::string& text : texts) {
+        std::vector<llama_token> tokens = common_tokenize(vocab, text, true);
+        if (tokens.size() > n_batch) {
+            // Pooling needs the whole sequence in one ubatch
+            LOGW("Embedding input truncated from %zu to %zu tokens", tokens.size(), n_batch);
+            tokens.resize(n_batch);
+        }
+        n_tokens_total += tokens.size();
+        inputs.push_back(std::move(tokens));
+    }
+
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(n_batch), 0, 1);
+    const int64_t t_start_us = ggml_time_us();
+
+    size_t next = 0;
+    while (next < inputs.size()) {
+        // Pack texts until either the token budget or the sequence slots run out
+        const size_t first = next;
+        common_batch_clear(batch);
+        while (next < inputs.size() &&
+               static_cast<int>(next - first) < n_seq_max &&
+               batch.n_tokens + inputs[next].size() <= n_batch) {
+            const llama_seq_id seq = static_cast<llama_seq_id>(next - first);
+            const std::vector<llama_token>& tokens = inputs[next];
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                common_batch_add(batch, tokens[i], static_cast<llama_pos>(i), {seq}, true);
+            }
+            next++;
+        }
+
+        llama_memory_clear(llama_get_memory(g_embd_ctx), true);
+        const int ret = use_encode ? llama_encode(g_embd_ctx, batch) : llama_decode(g_embd_ctx, batch);
+        if (ret != 0) {
+            LOGE("Embedding batch failed, error code: %d", ret);
+            llama_batch_free(batch);
+            return -1;
+        }
+
+        for (size_t i = first; i < next; ++i) {
+            const float* embd = llama_get_embeddings_seq(g_embd_ctx, static_cast<llama_seq_id>(i - first));
+            if (embd == nullptr) {
+                LOGE("No pooled embedding for sequence %zu", i - first);
+                llama_batch_free(batch);
+                return -1;
+            }
+            writeEmbeddingRow(embd, n_embd, normalize, int8, out + i * row_bytes);
+        }
+    }
+
+    llama_batch_free(batch);
+
+    const double elapsed_s = (ggml_time_us() - t_start_us) / 1e6;
+    if (elapsed_s > 0.0) {
+        LOGI("Embedded %zu texts (%zu tokens) in %.3f s: %.1f texts/s, %.1f tokens/s",
+             texts.size(), n_tokens_total, elapsed_s,
+             texts.size() / elapsed_s, n_tokens_total / elapsed_s);
+    }
+    return static_cast<int>(texts.size());
+}
+
+extern "C" {
+
+/**
+ * Initialize the LLM library
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeInit(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring nativeLibDir) {
+    LOGI("Initializing Llama native library");
+    
+    // The CPU backend is one of several builds shipped as separate libraries; register
+    // the best one this CPU supports before anything asks ggml for a device.
+    // ANDROGPT_CPU_VARIANT forces a specific one (for comparing variants).
+    const char* dir = env->GetStringUTFChars(nativeLibDir, nullptr);
+    const char* forced = getenv("ANDROGPT_CPU_VARIANT");
+    CpuBackendInfo cpu;
+    const bool cpu_loaded = loadCpuBackend(dir, forced ? forced : "", cpu);
+    env->ReleaseStringUTFChars(nativeLibDir, dir);
+    for (const CpuVariant& variant : cpu.candidates) {
+        LOGI("CPU backend variant %s: score %d", variant.name.c_str(), variant.score);
+    }
+    if (!cpu_loaded) {
+        LOGE("No CPU backend variant could be loaded");
+        return JNI_FALSE;
+    }
+    LOGI("Using CPU backend %s (%s)", cpu.variant.c_str(), cpuBackendFeatures().c_str());
+    
+    // Initialize llama backend
+    llama_backend_init();
+    llama_numa_init(GGML_NUMA_STRATEGY_DISABLED);
+    llama_log_set(onLlamaLog, nullptr);
+    if (!installRepackCache()) {
+        LOGI("Repacked weights are not cached");
+    }
+    
+    LOGI("Llama backend initialized successfully");
+    return JNI_TRUE;
+}
+
+/**
+ * Dummy prefill and single-token decode on the scratch sequence, so weights are
+ * paged in and both graphs' compute buffers are allocated. Leaves no KV state
+ * behind. Returns the llama_decode result (2 when aborted).
+ */
+static int warmupDecode(llama_context* ctx, const llama_model* model) {
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    std::vector<llama_token> tokens;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) {
+        tokens.push_back(llama_vocab_bos(vocab));
+    }
+    if (llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL) {
+        tokens.push_back(llama_vocab_eos(vocab));
+    }
+    if (tokens.empty()) {
+        tokens.push_back(0);
+    }
+    
+    // Warmup mode activates every expert of MoE models so all weights are touched
+    llama_set_warmup(ctx, true);
+    
+    llama_batch batch = llama_batch_init(static_cast<int32_t>(tokens.size()), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        common_batch_add(batch, tokens[i], static_cast<llama_pos>(i), {SEQ_SCORE}, i == tokens.size() - 1);
+    }
+    int ret = llama_decode(ctx, batch);
+    
+    // A single-token decode builds the generation graph as well
+    if (ret == 0) {
+        common_batch_clear(batch);
+        common_batch_add(batch, tokens.back(), static_cast<llama_pos>(tokens.size()), {SEQ_SCORE}, true);
+        ret = llama_decode(ctx, batch);
+    }
+    llama_synchronize(ctx);
+    llama_batch_free(batch);
+    
+    llama_memory_seq_rm(llama_get_memory(ctx), SEQ_SCORE, -1, -1);
+    llama_set_warmup(ctx, false);
+    llama_perf_context_reset(ctx);
+    return ret;
+}
+
+static bool abortStagedLoad(void* /* data */) {
+    return g_load_cancel.load();
+}
+
+/**
+ * Load a model and its chat context into `slot` without touching the serving model.
+ * Returns false, with nothing left allocated, on failure or cancellation.
+ */
+static bool loadModelSlot(const std::string& path, const llama_model_params& model_params,
+                          const llama_context_params& ctx_params, const LoadProgress& progress,
+                          ModelSlot& slot) {
+    if (!reportLoadProgress(progress, LOAD_STAGE_MAPPING, 0.0f)) {
+        return false;
+    }
+
+    // Returns null when the progress callback cancels
+    llama_model* model = llama_model_load_from_file(path.c_str(), model_params);
+    if (!model) {
+        if (!g_load_cancel.load()) {
+            LOGE("Failed to load model from: %s", path.c_str());
+        }
+        return false;
+    }
+    slot.model = makeModelHandle(model);
+
+    if (!reportLoadProgress(progress, LOAD_STAGE_CONTEXT, 0.0f)) {
+        freeModelSlot(slot);
+        return false;
+    }
+
+    slot.ctx = llama_init_from_model(model, ctx_params);
+    if (!slot.ctx) {
+        LOGE("Failed to create context");
+        freeModelSlot(slot);
+        return false;
+    }
+
+    slot.params.model.path = path;
+    slot.mapped = model_params.use_mmap;
+    return true;
+}
+
+// Flash attention "auto" benchmark: a prefill deep enough that attention over the
+// cache shows in the decode time, and few enough decodes to run on every new n_ctx
+static constexpr int FLASH_ATTN_BENCH_PROMPT = 256;
+static constexpr int FLASH_ATTN_BENCH_DECODE = 16;
+// Reply length of the turn the two settings are compared on
+static constexpr int FLASH_ATTN_TURN_DECODE = 128;
+
+/**
+ * Time prefill and decode in slot.ctx with flash attention on and off, recreating the
+ * context for each, and leave slot.ctx on the faster one (`enabled`). Each setting is
+ * scored by the time of a representative turn at its measured rates,
+ * FLASH_ATTN_BENCH_PROMPT / prefill_tps + FLASH_ATTN_TURN_DECODE / decode_tps, and
+ * flash attention is enabled when its turn is shorter. A setting whose benchmark
+ * failed never wins. ctx_params are the params slot.ctx was created with. Returns
+ * false, with the slot freed, when a context cannot be created or the load is
+ * cancelled.
+ */
+static bool chooseFlashAttention(ModelSlot& slot, llama_context_params ctx_params, bool& enabled) {
+    auto recreate = [&](bool flash_attn) {
+        llama_free(slot.ctx);
+        ctx_params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+        slot.ctx = llama_init_from_model(slot.model.get(), ctx_params);
+        if (!slot.ctx) {
+            LOGE("Failed to create context with flash attention %s", flash_attn ? "on" : "off");
+            freeModelSlot(slot);
+            return false;
+        }
+        return true;
+    };
+
+    const int n_prompt = std::min<int>({FLASH_ATTN_BENCH_PROMPT, static_cast<int>(ctx_params.n_ctx) / 2,
+                                        static_cast<int>(llama_n_batch(slot.ctx))});
+    double turn_s[2] = {INFINITY, INFINITY};  // off, on
+    for (const bool flash_attn : {true, false}) {
+        const bool current = ctx_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED;
+        if (flash_attn != current && !recreate(flash_attn)) {
+            return false;
+        }
+        // The first graph run pages in weights and allocates compute buffers, keep it untimed
+        double prefill_tps = 0.0;
+        double decode_tps = 0.0;
+        llama_set_abort_callback(slot.ctx, abortStagedLoad, nullptr);
+        const bool ok = warmupDecode(slot.ctx, slot.model.get()) == 0 &&
+                timePrefillDecode(slot.ctx, SEQ_SCORE, n_prompt, FLASH_ATTN_BENCH_DECODE,
+                                  prefill_tps, decode_tps) &&
+                prefill_tps > 0.0 && decode_tps > 0.0;
+        llama_set_abort_callback(slot.ctx, abortBackgroundWork, nullptr);
+        if (g_load_cancel.load()) {
+            freeModelSlot(slot);
+            return false;
+        }
+        if (!ok) {
+            LOGW("Flash attention %s benchmark failed", flash_attn ? "on" : "off");
+            continue;
+        }
+        turn_s[flash_attn] = FLASH_ATTN_BENCH_PROMPT / prefill_tps + FLASH_ATTN_TURN_DECODE / decode_tps;
+        LOGI("Flash attention %s: prefill %.1f tok/s, decode %.1f tok/s, turn %.2f s (n_ctx %u)",
+             flash_attn ? "on" : "off", prefill_tps, decode_tps, turn_s[flash_attn], ctx_params.n_ctx);
+    }
+
+    enabled = turn_s[1] < turn_s[0];
+    return !enabled || recreate(true);
+}
+
+/**
+ * Load a model from file path. While a model is serving, the new one is loaded and
+ * warmed beside it and swapped in once ready, if both fit in memoryBudget bytes
+ * (0 for no limit); otherwise the serving model is unloaded first. Returns one of
+ * the LOAD_* results.
+ *
+ * contextSize <= 0 sizes the context, batch and KV type with the memory planner
+ * against memoryBudget (or available RAM). Otherwise nBatch <= 0 keeps llama.cpp's
+ * batch sizes and kvType < 0 means an F16 cache.
+ *
+ * flashAttn is a llama_flash_attn_type. AUTO benchmarks both kernels the first time a
+ * model runs with a given context size on this CPU and records the faster one in the
+ * attention sidecar. A quantized KV cache always runs with flash attention.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeLoadModel(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring modelPath,
+        jint nThreads,
+        jint nThreadsBatch,
+        jint nGpuLayers,
+        jint contextSize,
+        jint nBatch,
+        jint kvType,
+        jint flashAttn,
+        jboolean useMmap,
+        jboolean useMlock,
+        jlong memoryBudget,
+        jobject progressCallback) {
+    
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    
+    // A cancel only targets the load in progress, not one queued behind it
+    g_load_cancel.store(false);
+    
+    LoadProgress progress{env, progressCallback, nullptr};
+    if (progressCallback != nullptr) {
+        jclass callbackClass = env->GetObjectClass(progressCallback);
+        progress.method = env->GetMethodID(callbackClass, "onProgress", "(IF)Z");
+        env->DeleteLocalRef(callbackClass);
+    }
+    
+    if (nThreadsBatch <= 0) {
+        nThreadsBatch = nThreads;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    const char* path_chars = env->GetStringUTFChars(modelPath, nullptr);
+    const std::string path = path_chars;
+    env->ReleaseStringUTFChars(modelPath, path_chars);
+    LOGI("Loading model from: %s", path.c_str());
+    LOGI("Threads: %d decode / %d batch, GPU Layers: %d, Context: %d",
+         nThreads, nThreadsBatch, nGpuLayers, contextSize);
+    
+    // Parked models match on everything that shapes the model and its context;
+    // thread counts are applied on every switch
+    const std::string key = path + "|ctx=" + std::to_string(contextSize) + "|batch=" + std::to_string(nBatch) +
+            "|kv=" + std::to_string(kvType) + "|fa=" + std::to_string(flashAttn) + "|gpu=" + std::to_string(nGpuLayers) +
+            "|mmap=" + std::to_string(useMmap) + "|mlock=" + std::to_string(useMlock);
+    ModelSlot parked;
+    if (takeParked(key, false, parked)) {
+        ForegroundLock lock;
+        activateParked(parked, nThreads, nThreadsBatch);
+        g_load_ms = (ggml_time_us() - t_start_us) / 1000;
+        g_warmup_ms = -1;
+        reportLoadProgress(progress, LOAD_STAGE_CONTEXT, 1.0f);
+        LOGI("Switched to parked model in %lld ms", static_cast<long long>(g_load_ms));
+        return LOAD_SWAPPED;
+    }
+    
+    ModelShape shape;
+    if (!readModelShape(path, shape)) {
+        LOGE("Not a readable GGUF file: %s", path.c_str());
+        return g_serving_bytes.load() > 0 ? LOAD_FAILED_KEPT : LOAD_FAILED;
+    }
+    
+    const uint64_t serving = g_serving_bytes.load();
+    const ggml_type type_kv = kvType >= 0 ? static_cast<ggml_type>(kvType) : GGML_TYPE_F16;
+    MemoryPlan plan = estimateMemory(shape, static_cast<uint32_t>(std::max(contextSize, 0)),
+                                     static_cast<uint32_t>(nBatch > 0 ? nBatch : 512), type_kv);
+    if (contextSize <= 0) {
+        // Size for the memory this model would have on its own; if that leaves no
+        // room for the serving model beside it, the swap below falls back to cold
+        const uint64_t available = memoryBudget > 0 ? static_cast<uint64_t>(memoryBudget)
+                                                    : availableMemoryBytes() + serving;
+        if (!planMemory(shape, available, AUTO_MAX_CONTEXT, plan)) {
+            LOGE("Model does not fit in %llu MiB", static_cast<unsigned long long>(available >> 20));
+            return serving > 0 ? LOAD_FAILED_KEPT : LOAD_FAILED;
+        }
+        contextSize = static_cast<jint>(plan.n_ctx);
+        nBatch = static_cast<jint>(plan.n_batch);
+    }
+    const uint64_t needed = plan.total();
+    
+    // The sidecars are keyed by file, CPU variant and ggml version, which is everything
+    // the repacked layouts and the flash attention choice depend on besides the context size
+    const std::string repack_key = repackProfileKey(path);
+    AttentionProfile attention;
+    if (!readAttentionProfile(path, repack_key, attention)) {
+        attention.key = repack_key;
+    }
+    
+    bool flash_attn = flashAttn == LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    bool measure_flash_attn = false;
+    if (plan.type_kv != GGML_TYPE_F16) {
+        // llama.cpp only supports a quantized V cache with flash attention
+        flash_attn = true;
+    } else if (flashAttn == LLAMA_FLASH_ATTN_TYPE_AUTO) {
+        const auto measured = attention.flash_attn.find(static_cast<uint32_t>(contextSize));
+        measure_flash_attn = measured == attention.flash_attn.end();
+        flash_attn = measure_flash_attn || measured->second;
+    }
+    {
+        std::list<ModelSlot> evicted;
+        evictParked(needed, evicted);
+        freeModelSlots(evicted);
+    }
+    const bool staged = serving > 0 &&
+            (memoryBudget <= 0 || serving + needed <= static_cast<uint64_t>(memoryBudget));
+    
+    if (serving > 0 && !staged) {
+        LOGI("~%llu MiB model does not fit beside the ~%llu MiB serving one (budget %lld MiB), unloading first",
+             static_cast<unsigned long long>(needed >> 20), static_cast<unsigned long long>(serving >> 20),
+             static_cast<long long>(memoryBudget >> 20));
+        ForegroundLock lock;
+        releaseModel();
+        g_load_ms = -1;
+        g_warmup_ms = -1;
+    }
+    
+    // Set up model parameters
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = nGpuLayers;
+    model_params.use_mmap = useMmap == JNI_TRUE;
+    // Android caps RLIMIT_MEMLOCK low for apps; llama.cpp warns and carries on if mlock fails
+    model_params.use_mlock = useMlock == JNI_TRUE;
+    // Also replaces llama.cpp's default progress dots on stderr
+    model_params.progress_callback = onTensorLoadProgress;
+    model_params.progress_callback_user_data = &progress;
+    
+    // Set up context parameters
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = contextSize;
+    if (nBatch > 0) {
+        ctx_params.n_batch = nBatch;
+        ctx_params.n_ubatch = std::min<uint32_t>(nBatch, ctx_params.n_ubatch);
+    }
+    ctx_params.type_k = plan.type_kv;
+    ctx_params.type_v = plan.type_kv;
+    ctx_params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    ctx_params.n_threads = nThreads;
+    ctx_params.n_threads_batch = nThreadsBatch;
+    ctx_params.n_seq_max = SEQ_MAX;
+    ctx_params.kv_unified = true;
+    ctx_params.abort_callback = abortBackgroundWork;
+    ctx_params.abort_callback_data = nullptr;
+    
+    const jint failed = staged ? LOAD_FAILED_KEPT : LOAD_FAILED;
+    ModelSlot slot;
+    // Maps the weights the CPU backend repacked on an earlier load of this file from
+    // the sidecar instead of repacking them again, and records which tensors they are
+    // so prefetch and residency skip their file ranges
+    RepackCacheSession repack_cache(path, repack_key);
+    if (!loadModelSlot(path, model_params, ctx_params, progress, slot)) {
+        if (g_load_cancel.load()) {
+            LOGI("Model load cancelled");
+        }
+        return failed;
+    }
+    const int64_t load_ms = (ggml_time_us() - t_start_us) / 1000;
+    repack_cache.finish(load_ms, slot.repack);
+    if (measure_flash_attn) {
+        if (!chooseFlashAttention(slot, ctx_params, flash_attn)) {
+            if (g_load_cancel.load()) {
+                LOGI("Model load cancelled");
+            }
+            return failed;
+        }
+        attention.flash_attn[static_cast<uint32_t>(contextSize)] = flash_attn;
+        if (!repack_key.empty() && !writeAttentionProfile(path, attention)) {
+            LOGW("Could not write the attention profile of %s", path.c_str());
+        }
+    }
+    LOGI("Flash attention %s%s", flash_attn ? "on" : "off",
+         flashAttn == LLAMA_FLASH_ATTN_TYPE_AUTO ? " (auto)" : "");
+    
+    slot.key = key;
+    slot.bytes = needed;
+    slot.params.n_ctx = contextSize;
+    slot.params.n_batch = static_cast<int32_t>(ctx_params.n_batch);
+    slot.params.n_ubatch = static_cast<int32_t>(ctx_params.n_ubatch);
+    slot.params.cache_type_k = ctx_params.type_k;
+    slot.params.cache_type_v = ctx_params.type_v;
+    slot.params.flash_attn_type = flash_attn ? LLAMA_FLASH_ATTN_TYPE_ENABLED : LLAMA_FLASH_ATTN_TYPE_DISABLED;
+    slot.flash_attn_auto = flashAttn == LLAMA_FLASH_ATTN_TYPE_AUTO && plan.type_kv == GGML_TYPE_F16;
+    slot.params.cpuparams.n_threads = nThreads;
+    slot.params.cpuparams_batch.n_threads = nThreadsBatch;
+    
+    // Warm the new model before it takes over, so the first request after the swap
+    // does not pay for it; the serving model stays usable meanwhile
+    int64_t warmup_ms = -1;
+    if (staged) {
+        const int64_t t_warmup_us = ggml_time_us();
+        llama_set_abort_callback(slot.ctx, abortStagedLoad, nullptr);
+        const int ret = warmupDecode(slot.ctx, slot.model.get());
+        llama_set_abort_callback(slot.ctx, abortBackgroundWork, nullptr);
+        if (ret == 0) {
+            warmup_ms = (ggml_time_us() - t_warmup_us) / 1000;
+        } else if (ret != 2) {
+            LOGW("Staged warmup decode failed (%d)", ret);
+        }
+    }
+    
+    if (!reportLoadProgress(progress, LOAD_STAGE_CONTEXT, 1.0f)) {
+        LOGI("Model load cancelled");
+        freeModelSlot(slot);
+        return failed;
+    }
+    
+    {
+        // Requests hold g_mutex while they run, so in-flight ones finish on the old
+        // model before it is swapped out
+        ForegroundLock lock;
+        
+        installModel(slot);
+        applyThreadpools(nThreads, nThreadsBatch);
+        
+        g_load_ms = (ggml_time_us() - t_start_us) / 1000;
+        g_warmup_ms = warmup_ms;
+    }
+    
+    // The previous model is parked or freed outside g_mutex so the new one serves right away
+    std::list<ModelSlot> evicted;
+    if (!parkModelSlot(slot, evicted)) {
+        freeModelSlot(slot);
+    }
+    freeModelSlots(evicted);
+    
+    LOGI("Model %s in %lld ms", staged ? "swapped in" : "loaded", static_cast<long long>(g_load_ms));
+    return staged ? LOAD_SWAPPED : LOAD_COLD;
+}
+
+/**
+ * Abort a model load in progress. The load frees whatever it had allocated; a model
+ * that was serving before a staged load keeps serving.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeCancelLoad(
+        JNIEnv* env,
+        jobject /* this */) {
+    LOGI("Cancelling model load");
+    g_load_cancel.store(true);
+}
+
+/**
+ * Requantize a GGUF file to another llama_ftype, e.g. Q8_0 to Q4_0 so the CPU repack
+ * path applies. quantizeGguf reads and converts one tensor at a time, so peak memory
+ * stays around the largest tensor rather than the model. Output goes to dst + ".part"
+ * and is renamed once complete. Progress is reported as onProgress(tensorsDone,
+ * tensorCount): Boolean before each tensor; returning false, or nativeCancelQuantize,
+ * stops the pass at the next tensor and removes the partial output. Returns a
+ * QUANTIZE_* result; QUANTIZE_BUSY when another quantization is running.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeQuantize(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring srcPath,
+        jstring dstPath,
+        jint ftype,
+        jint nThreads,
+        jobject progressCallback) {
+    
+    std::unique_lock<std::mutex> lock(g_quantize_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        LOGW("Another quantization is running");
+        return QUANTIZE_BUSY;
+    }
+    g_quantize_cancel.store(false);
+    
+    const std::string src = sanitizeInputString(env, srcPath);
+    const std::string dst = sanitizeInputString(env, dstPath);
+    const std::string partial = dst + ".part";
+    
+    QuantizeProgress progress{env, progressCallback, nullptr};
+    if (progressCallback != nullptr) {
+        jclass callbackClass = env->GetObjectClass(progressCallback);
+        progress.method = env->GetMethodID(callbackClass, "onProgress", "(II)Z");
+        env->DeleteLocalRef(callbackClass);
+    }
+    
+    LOGI("Quantizing %s to ftype %d with %d threads", src.c_str(), ftype, nThreads);
+    const int64_t t_start_us = ggml_time_us();
+    bool cancelled = false;
+    const bool ok = quantizeGguf(src, partial, static_cast<llama_ftype>(ftype), nThreads,
+                                 [&](int done, int total) {
+        cancelled = !reportQuantizeProgress(progress, done, total);
+        return !cancelled;
+    });
+    
+    if (cancelled) {
+        std::remove(partial.c_str());
+        LOGI("Quantization cancelled");
+        return QUANTIZE_CANCELLED;
+    }
+    if (!ok || std::rename(partial.c_str(), dst.c_str()) != 0) {
+        std::remove(partial.c_str());
+        LOGE("Quantization of %s failed", src.c_str());
+        return QUANTIZE_FAILED;
+    }
+    LOGI("Quantized %s in %.1f s", dst.c_str(), (ggml_time_us() - t_start_us) / 1e6);
+    return QUANTIZE_OK;
+}
+
+/** Cancel the quantization in progress; it stops before its next tensor. */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeCancelQuantize(
+        JNIEnv* env,
+        jobject /* this */) {
+    LOGI("Cancelling quantization");
+    g_quantize_cancel.store(true);
+}
+
+/**
+ * Total bytes the serving model and parked ones may take. Models replaced by a load
+ * are parked while they fit, so switching back takes no reload; 0 parks nothing.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeSetModelCacheLimit(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong bytes) {
+    
+    g_parked_limit.store(bytes > 0 ? static_cast<uint64_t>(bytes) : 0);
+    std::list<ModelSlot> evicted;
+    evictParked(0, evicted);
+    freeModelSlots(evicted);
+}
+
+/**
+ * Memory plan for a model file without loading it: the largest safe context for
+ * `available` bytes (0 for MemAvailable), capped at maxContext (0 for the training
+ * context). Returns [n_ctx, n_batch, KV ggml_type, weight, KV, compute, overhead
+ * bytes], or null if the file is unreadable or nothing fits.
+ */
+JNIEXPORT jlongArray JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativePlanMemory(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring modelPath,
+        jlong available,
+        jint maxContext) {
+    
+    const std::string path = sanitizeInputString(env, modelPath);
+    ModelShape shape;
+    MemoryPlan plan;
+    const uint64_t budget = available > 0 ? static_cast<uint64_t>(available) : availableMemoryBytes();
+    if (!readModelShape(path, shape) ||
+        !planMemory(shape, budget, static_cast<uint32_t>(std::max(maxContext, 0)), plan)) {
+        return nullptr;
+    }
+    
+    const jlong values[7] = {
+        static_cast<jlong>(plan.n_ctx), static_cast<jlong>(plan.n_batch), static_cast<jlong>(plan.type_kv),
+        static_cast<jlong>(plan.weight_bytes), static_cast<jlong>(plan.kv_bytes),
+        static_cast<jlong>(plan.compute_bytes), static_cast<jlong>(plan.overhead_bytes)
+    };
+    jlongArray result = env->NewLongArray(7);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 7, values);
+    }
+    return result;
+}
+
+/**
+ * Listing metadata of a GGUF file (architecture, parameter count, quantization,
+ * context length, chat template, ...) as a JSON object, read from the header
+ * without loading weights. Returns null if the file is not a readable GGUF.
+ */
+JNIEXPORT jstring JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeInspectGguf(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring modelPath) {
+    
+    const std::string path = sanitizeInputString(env, modelPath);
+    GgufSummary summary;
+    if (!inspectGguf(path, summary)) {
+        return nullptr;
+    }
+    return safeNewStringUTF(env, ggufSummaryToJson(summary).c_str());
+}
+
+/**
+ * Run a short dummy prefill and decode so weights are paged in and compute buffers
+ * are allocated before the first real request. Aborts early, leaving no state
+ * behind, when a foreground request arrives or nativeCancelWarmup is called.
+ * Returns the warmup duration in ms, or -1 if it was cancelled or failed.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeWarmup(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    BackgroundTask task;
+    
+    if (!g_ctx || !g_model || task.yielded()) {
+        return -1;
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    
+    clearScoreSequences();
+    const int ret = warmupDecode(g_ctx, g_model.get());
+    
+    if (ret == 2) {
+        LOGI("Warmup cancelled");
+        return -1;
+    }
+    if (ret != 0) {
+        LOGW("Warmup decode failed (%d)", ret);
+        return -1;
+    }
+    
+    g_warmup_ms = (ggml_time_us() - t_start_us) / 1000;
+    LOGI("Warmup finished in %lld ms", static_cast<long long>(g_warmup_ms));
+    return g_warmup_ms;
+}
+
+/**
+ * Abort a running warmup. Safe to call from any thread. Foreground requests need not
+ * call this, taking ForegroundLock already makes background work yield.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeCancelWarmup(
+        JNIEnv* env,
+        jobject /* this */) {
+    preemptBackgroundWork();
+}
+
+/**
+ * Summarize the oldest history of the last conversation into a memory segment once it
+ * fills most of the context (see compactHistory). Runs as background work: any
+ * foreground request preempts it. The strings are chat template text: instruction asks
+ * for the summary, memoryPrefix and memorySuffix wrap it into a prompt segment.
+ * Returns the number of history messages summarized, 0 if none needed it, or -1 if
+ * it was preempted or failed.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeCompactHistory(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring instruction,
+        jstring memoryPrefix,
+        jstring memorySuffix) {
+    
+    CompactionRequest request;
+    request.instruction = sanitizeInputString(env, instruction);
+    request.memory_prefix = sanitizeInputString(env, memoryPrefix);
+    request.memory_suffix = sanitizeInputString(env, memorySuffix);
+    
+    BackgroundTask task;
+    
+    if (!g_ctx || !g_model || task.yielded()) {
+        return -1;
+    }
+    return compactHistory(request);
+}
+
+/**
+ * Start a background pass that reads the model's weights into the page cache in
+ * layer order. Only meaningful for mmap'd models. Returns false if nothing started.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativePrefetchWeights(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::lock_guard<std::mutex> weights_lock(g_weights_mutex);
+    
+    const std::vector<WeightRange>* ranges = loadedWeightRanges();
+    if (ranges == nullptr || !g_weights_mapped) {
+        return JNI_FALSE;
+    }
+    g_prefetcher.start(g_weights_path, *ranges);
+    return JNI_TRUE;
+}
+
+/**
+ * Weight residency of the loaded model as [resident bytes, total bytes], or null
+ * when unknown (no model, or weights not memory-mapped).
+ */
+JNIEXPORT jlongArray JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetWeightResidency(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::lock_guard<std::mutex> weights_lock(g_weights_mutex);
+    
+    const std::vector<WeightRange>* ranges = loadedWeightRanges();
+    uint64_t resident = 0;
+    uint64_t total = 0;
+    if (ranges == nullptr || !g_weights_mapped || !weightResidency(g_weights_path, *ranges, resident, total)) {
+        return nullptr;
+    }
+    
+    const jlong values[2] = {static_cast<jlong>(resident), static_cast<jlong>(total)};
+    jlongArray result = env->NewLongArray(2);
+    if (result != nullptr) {
+        env->SetLongArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+/**
+ * Unload the current model
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeUnloadModel(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    ForegroundLock lock;
+    LOGI("Unloading model");
+    
+    // Free llama.cpp resources
+    releaseModel();
+    
+    LOGI("Model unloaded successfully");
+}
+
+/**
+ * Load a LoRA adapter GGUF on the serving model ahead of the requests that use it.
+ * Requests name adapters by path, so this only moves the load cost out of the first
+ * one. Returns false if the file is not an adapter for this model.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeLoadLora(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring loraPath) {
+    
+    ForegroundLock lock;
+    
+    if (!g_model) {
+        LOGE("Model not loaded");
+        return JNI_FALSE;
+    }
+    return findLoraAdapter(sanitizeInputString(env, loraPath)) != nullptr ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Free a LoRA adapter of the serving model. If it was applied, the context falls back
+ * to no adapters and the next request applies its own set again.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeUnloadLora(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring loraPath) {
+    
+    ForegroundLock lock;
+    
+    const std::string path = sanitizeInputString(env, loraPath);
+    auto it = std::find_if(g_adapters.begin(), g_adapters.end(),
+                           [&](const LoraAdapter& entry) { return entry.path == path; });
+    if (it == g_adapters.end()) {
+        return;
+    }
+    if (g_lora_key.find(path + "@") != std::string::npos) {
+        llama_clear_adapter_lora(g_ctx);
+        g_lora_key.clear();
+    }
+    llama_adapter_lora_free(it->adapter);
+    g_adapters.erase(it);
+    LOGI("Unloaded LoRA adapter %s", path.c_str());
+}
+
+/**
+ * Generate text completion
+ */
+JNIEXPORT jstring JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGenerate(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring prompt,
+        jint maxTokens,
+        jfloat temperature,
+        jfloat topP,
+        jint topK,
+        jstring modelPath,
+        jobjectArray loraPaths,
+        jfloatArray loraScales) {
+    
+    ForegroundLock lock;
+    
+    if (!activateModel(modelPath != nullptr ? sanitizeInputString(env, modelPath) : "")) {
+        LOGE("Model not loaded");
+        return safeNewStringUTF(env, "");
+    }
+    if (!applyLoraAdapters(env, loraPaths, loraScales)) {
+        return safeNewStringUTF(env, "");
+    }
+    
+    GenerationRequest request;
+    request.segments = {PromptSegment{sanitizeInputString(env, prompt)}};
+    request.max_tokens = maxTokens;
+    request.temperature = temperature;
+    request.top_p = topP;
+    request.top_k = topK;
+    LOGI("Generating with prompt: %s", request.segments[0].text.c_str());
+    LOGI("Max tokens: %d, Temperature: %.2f", maxTokens, temperature);
+    
+    std::string result;
+    const int n_decode = generate(request, nullptr, [&result](const std::string& piece) {
+        result.append(piece);
+        return true;
+    });
+    
+    LOGI("Generated %d tokens", n_decode);
+    return safeNewStringUTF(env, result.c_str());
+}
+
+/**
+ * Generate text with streaming callback.
+ * The prompt arrives as one string per message so the engine can checkpoint
+ * every message boundary and reuse the cached prefix on the next turn. Unpinned
+ * (history) segments are left out oldest first when the prompt would not leave
+ * room for maxTokens.
+ * loraPaths / loraScales select the adapters for this request (null for none).
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGenerateStream(
+        JNIEnv* env,
+        jobject thiz,
+        jobjectArray promptSegments,
+        jlongArray segmentMessageIds,
+        jintArray segmentRoles,
+        jbooleanArray segmentPinned,
+        jint maxTokens,
+        jfloat temperature,
+        jfloat topP,
+        jint topK,
+        jint topLogprobs,
+        jobject logprobBuffer,
+        jstring modelPath,
+        jobjectArray loraPaths,
+        jfloatArray loraScales,
+        jobject callback) {
+    
+    ForegroundLock lock;
+    
+    if (!activateModel(modelPath != nullptr ? sanitizeInputString(env, modelPath) : "")) {
+        LOGE("Model not loaded");
+        return;
+    }
+    if (!applyLoraAdapters(env, loraPaths, loraScales)) {
+        return;
+    }
+    
+    GenerationRequest request;
+    request.segments = toPromptSegments(env, promptSegments, segmentMessageIds, segmentRoles, segmentPinned);
+    request.max_tokens = maxTokens;
+    request.temperature = temperature;
+    request.top_p = topP;
+    request.top_k = topK;
+    LOGI("Streaming generation with %zu prompt segments", request.segments.size());
+    
+    // Get callback methods
+    jclass callbackClass = env->GetObjectClass(callback);
+    jmethodID onTokenMethod = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;)V");
+    jmethodID onCompleteMethod = env->GetMethodID(callbackClass, "onComplete", "()V");
+    
+    // Logprob records go to a direct buffer owned by the caller, one per token
+    uint8_t* record_buf = nullptr;
+    size_t record_capacity = 0;
+    jmethodID onLogprobsMethod = nullptr;
+    TokenLogprobs logprobs;
+    if (logprobBuffer != nullptr) {
+        record_buf = static_cast<uint8_t*>(env->GetDirectBufferAddress(logprobBuffer));
+        record_capacity = static_cast<size_t>(env->GetDirectBufferCapacity(logprobBuffer));
+        onLogprobsMethod = env->GetMethodID(callbackClass, "onTokenLogprobs", "(I)V");
+        logprobs.top_n = std::max(0, static_cast<int>(topLogprobs));
+    }
+    const bool want_logprobs = record_buf != nullptr && onLogprobsMethod != nullptr;
+    
+    std::string utf8_remainder;
+    
+    const int n_decode = generate(request, want_logprobs ? &logprobs : nullptr,
+            [&](const std::string& token_str) {
+                if (want_logprobs) {
+                    const size_t length = writeLogprobRecord(logprobs, record_buf, record_capacity);
+                    env->CallVoidMethod(callback, onLogprobsMethod, static_cast<jint>(length));
+                    if (env->ExceptionCheck()) {
+                        LOGE("Exception in onTokenLogprobs callback, clearing");
+                        env->ExceptionClear();
+                    }
+                }
+                
+                // Stream the token if not empty - use safe string conversion
+                if (token_str.empty()) {
+                    return true;
+                }
+                jstring jtoken = safeNewStringUTFStreaming(env, token_str, utf8_remainder);
+                if (jtoken != nullptr) {
+                    if (env->GetStringLength(jtoken) > 0) {
+                        env->CallVoidMethod(callback, onTokenMethod, jtoken);
+                        if (env->ExceptionCheck()) {
+                            LOGE("Exception in onToken callback, clearing and continuing");
+                            env->ExceptionClear();
+                        }
+                    }
+                    env->DeleteLocalRef(jtoken);
+                }
+                return true;
+            });
+    
+    if (n_decode < 0) {
+        // Call onComplete to prevent the caller from hanging
+        LOGE("Failed to decode prompt");
+        env->CallVoidMethod(callback, onCompleteMethod);
+        return;
+    }
+    
+    // Flush any remaining partial sequences
+    if (!utf8_remainder.empty()) {
+        jstring jflush = safeNewStringUTFStreaming(env, "", utf8_remainder);
+        if (jflush != nullptr && env->GetStringLength(jflush) > 0) {
+            env->CallVoidMethod(callback, onTokenMethod, jflush);
+            if (env->ExceptionCheck()) {
+                LOGE("Exception in onToken flush callback, clearing");
+                env->ExceptionClear();
+            }
+        }
+        if (jflush != nullptr) {
+            env->DeleteLocalRef(jflush);
+        }
+    }
+
+    // Call completion callback
+    env->CallVoidMethod(callback, onCompleteMethod);
+    
+    LOGI("Streaming complete. Generated %d tokens", n_decode);
+    
+    // Appends only the segments tokenized for this prompt
+    if (!g_token_cache_path.empty() && !g_token_cache.save(g_token_cache_path)) {
+        LOGW("Could not save the token cache to %s", g_token_cache_path.c_str());
+    }
+}
+
+/**
+ * Number of unpinned (history) segments, oldest first, that nativeGenerateStream would
+ * not put in this prompt verbatim, summarized into a memory or left out, with
+ * reserveTokens more set aside. -1 without a model. Tokens are counted exactly and
+ * stay in the token cache for the generation.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeFitPrompt(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray promptSegments,
+        jlongArray segmentMessageIds,
+        jintArray segmentRoles,
+        jbooleanArray segmentPinned,
+        jint maxTokens,
+        jint reserveTokens) {
+    
+    const std::vector<PromptSegment> segments =
+            toPromptSegments(env, promptSegments, segmentMessageIds, segmentRoles, segmentPinned);
+    
+    ForegroundLock lock;
+    if (!g_model || !g_ctx) {
+        return -1;
+    }
+    const AssembledPrompt prompt = assemblePrompt(segments, promptBudget(maxTokens, reserveTokens));
+    return static_cast<jint>(prompt.n_summarized + prompt.n_dropped);
+}
+
+/**
+ * Persist message token ids to `path` so they survive restarts, loading what it
+ * already holds. An empty path stops persisting.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeSetTokenCacheFile(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring path) {
+    const std::string file = path != nullptr ? sanitizeInputString(env, path) : "";
+    
+    ForegroundLock lock;
+    g_token_cache_path = file;
+    if (!file.empty()) {
+        g_token_cache.load(file);
+    }
+}
+
+/**
+ * Rewind the main sequence to the checkpoint taken before prompt segment
+ * `messageIndex` of the last prompt (0 is the system prompt). The dropped branch
+ * is stashed, so regenerating or switching back to it needs no prefill.
+ * Returns the number of tokens kept, or -1 if the checkpoint is unknown.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeForkAt(
+        JNIEnv* env,
+        jobject /* this */,
+        jint messageIndex) {
+    
+    ForegroundLock lock;
+    
+    if (!g_ctx || messageIndex < 0 ||
+        messageIndex > static_cast<jint>(g_session.segment_ends.size())) {
+        LOGW("forkAt(%d): no such checkpoint", messageIndex);
+        return -1;
+    }
+    
+    const int32_t pos = messageIndex == 0 ? 0 : g_session.segment_ends[messageIndex - 1];
+    if (pos < 0) {
+        LOGW("forkAt(%d): checkpoint was discarded by a context shift", messageIndex);
+        return -1;
+    }
+    
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    
+    // Stash the current branch before truncating it
+    dropStash();
+    llama_memory_seq_cp(mem, SEQ_MAIN, SEQ_STASH, -1, -1);
+    g_stash = g_session;
+    
+    if (!llama_memory_seq_rm(mem, SEQ_MAIN, pos, -1)) {
+        LOGW("forkAt(%d): partial KV removal unsupported, clearing", messageIndex);
+        llama_memory_seq_rm(mem, SEQ_MAIN, -1, -1);
+        g_session.clear();
+        return 0;
+    }
+    g_session.tokens.resize(pos);
+    g_session.segment_ends.resize(messageIndex);
+    
+    LOGI("forkAt(%d): kept %d tokens, stashed %zu", messageIndex, pos, g_stash.tokens.size());
+    return pos;
+}
+
+/**
+ * Score candidate continuations of a prompt without generating.
+ * Returns, per candidate, [total log-prob, token count, token log-probs...]
+ * concatenated into one array, or null on failure.
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeScore(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring prompt,
+        jobjectArray candidates,
+        jstring modelPath,
+        jobjectArray loraPaths,
+        jfloatArray loraScales) {
+    
+    ForegroundLock lock;
+    
+    if (!activateModel(modelPath != nullptr ? sanitizeInputString(env, modelPath) : "")) {
+        LOGE("Model not loaded");
+        return nullptr;
+    }
+    if (!applyLoraAdapters(env, loraPaths, loraScales)) {
+        return nullptr;
+    }
+    
+    const std::vector<std::string> inputs = toStringVector(env, candidates);
+    if (inputs.empty()) {
+        return env->NewFloatArray(0);
+    }
+    
+    const int64_t t_start_us = ggml_time_us();
+    std::vector<std::vector<float>> logprobs(inputs.size());
+    if (!scoreCandidates(sanitizeInputString(env, prompt), inputs, logprobs)) {
+        return nullptr;
+    }
+    
+    std::vector<jfloat> packed;
+    size_t n_tokens = 0;
+    for (const std::vector<float>& lps : logprobs) {
+        float total = 0.0f;
+        for (float lp : lps) {
+            total += lp;
+        }
+        packed.push_back(total);
+        packed.push_back(static_cast<jfloat>(lps.size()));
+        packed.insert(packed.end(), lps.begin(), lps.end());
+        n_tokens += lps.size();
+    }
+    LOGI("Scored %zu candidates (%zu tokens) in %.1f ms",
+         inputs.size(), n_tokens, (ggml_time_us() - t_start_us) / 1000.0);
+    
+    jfloatArray result = env->NewFloatArray(static_cast<jsize>(packed.size()));
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, static_cast<jsize>(packed.size()), packed.data());
+    }
+    return result;
+}
+
+/**
+ * Benchmark prefill and decode throughput at each of the given thread counts, with
+ * pinned threadpools or ggml's default threads.
+ * Returns [threads, prefill tok/s, decode tok/s] per count, or null on failure.
+ * The context's thread settings are restored afterwards.
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeBenchmarkThreads(
+        JNIEnv* env,
+        jobject /* this */,
+        jintArray threadCounts,
+        jint promptTokens,
+        jint genTokens,
+        jboolean pinned) {
+    
+    ForegroundLock lock;
+    
+    if (!g_ctx || !g_model) {
+        LOGE("Model not loaded");
+        return nullptr;
+    }
+    
+    const jsize n_counts = env->GetArrayLength(threadCounts);
+    std::vector<jint> counts(n_counts);
+    env->GetIntArrayRegion(threadCounts, 0, n_counts, counts.data());
+    
+    const int n_prompt = std::max(1, std::min<int>({promptTokens, static_cast<int>(llama_n_batch(g_ctx)),
+                                                    static_cast<int>(llama_n_ctx(g_ctx)) / 4}));
+    const int n_gen = std::max(1, static_cast<int>(genTokens));
+    const int saved_threads = llama_n_threads(g_ctx);
+    const int saved_threads_batch = llama_n_threads_batch(g_ctx);
+    const bool saved_pinned = g_tp_settings.pinned;
+    g_tp_settings.pinned = pinned == JNI_TRUE;
+    
+    // Untimed pass so the first measurement does not pay for page faults
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+    bool ok = n_counts > 0 && benchmarkThreads(counts[0], n_prompt, 1, prefill_tps, decode_tps);
+    
+    std::vector<jfloat> results;
+    for (jsize i = 0; ok && i < n_counts; ++i) {
+        ok = benchmarkThreads(counts[i], n_prompt, n_gen, prefill_tps, decode_tps);
+        LOGI("Threads %d (%s): prefill %.1f tok/s, decode %.1f tok/s",
+             counts[i], g_tp_settings.pinned ? "pinned" : "unpinned", prefill_tps, decode_tps);
+        results.push_back(static_cast<jfloat>(counts[i]));
+        results.push_back(static_cast<jfloat>(prefill_tps));
+        results.push_back(static_cast<jfloat>(decode_tps));
+    }
+    
+    g_tp_settings.pinned = saved_pinned;
+    applyThreadpools(saved_threads, saved_threads_batch);
+    if (!ok) {
+        LOGE("Thread benchmark failed");
+        return nullptr;
+    }
+    
+    jfloatArray result = env->NewFloatArray(static_cast<jsize>(results.size()));
+    if (result != nullptr) {
+        env->SetFloatArrayRegion(result, 0, static_cast<jsize>(results.size()), results.data());
+    }
+    return result;
+}
+
+/**
+ * Change the decode and prefill thread counts of the loaded context.
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeSetThreads(
+        JNIEnv* env,
+        jobject /* this */,
+        jint nThreads,
+        jint nThreadsBatch) {
+    
+    ForegroundLock lock;
+    
+    if (!g_ctx) {
+        return;
+    }
+    applyThreadpools(nThreads, nThreadsBatch);
+    g_params.cpuparams.n_threads = nThreads;
+    g_params.cpuparams_batch.n_threads = nThreadsBatch;
+    LOGI("Threads set to %d decode / %d batch", nThreads, nThreadsBatch);
+}
+
+/**
+ * Configure threadpool pinning for this and later model loads. Null CPU lists pick
+ * the fastest cores; priority follows ggml_sched_priority, poll is 0 (sleep) to 100.
+ * Returns true if pinned threadpools are attached to the loaded context.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeConfigureThreadpools(
+        JNIEnv* env,
+        jobject /* this */,
+        jboolean pinned,
+        jintArray decodeCpus,
+        jintArray batchCpus,
+        jint priority,
+        jint poll) {
+    
+    ForegroundLock lock;
+    
+    auto toCpuList = [env](jintArray array) {
+        std::vector<int> cpus;
+        if (array != nullptr) {
+            cpus.resize(env->GetArrayLength(array));
+            env->GetIntArrayRegion(array, 0, static_cast<jsize>(cpus.size()), cpus.data());
+        }
+        return cpus;
+    };
+    
+    g_tp_settings.pinned = pinned == JNI_TRUE;
+    g_tp_settings.decode_cpus = toCpuList(decodeCpus);
+    g_tp_settings.batch_cpus = toCpuList(batchCpus);
+    g_tp_settings.priority = static_cast<ggml_sched_priority>(
+            std::max<int>(GGML_SCHED_PRIO_LOW, std::min<int>(priority, GGML_SCHED_PRIO_REALTIME)));
+    g_tp_settings.poll = static_cast<uint32_t>(std::max(0, std::min(static_cast<int>(poll), 100)));
+    
+    if (!g_ctx) {
+        return JNI_FALSE;
+    }
+    return applyThreadpools(llama_n_threads(g_ctx), llama_n_threads_batch(g_ctx)) ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Online CPUs fastest first, as [cpu id, capacity] pairs.
+ */
+JNIEXPORT jintArray JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetCpuCapacities(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::vector<jint> packed;
+    for (const CpuCore& cpu : cpusByCapacity()) {
+        packed.push_back(cpu.id);
+        packed.push_back(static_cast<jint>(cpu.capacity));
+    }
+    
+    jintArray result = env->NewIntArray(static_cast<jsize>(packed.size()));
+    if (result != nullptr) {
+        env->SetIntArrayRegion(result, 0, static_cast<jsize>(packed.size()), packed.data());
+    }
+    return result;
+}
+
+/**
+ * Replace the embedding context with one on `model`. Caller holds g_embd_mutex.
+ */
+static jboolean installEmbeddingContext(const ModelHandle& model, llama_pooling_type pooling, jint nThreads,
+                                        jint batchSize, jint maxSequences) {
+    freeEmbeddingContext();
+    g_embd_model = model;
+    
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.embeddings = true;
+    ctx_params.pooling_type = pooling;
+    ctx_params.n_ctx = batchSize;
+    ctx_params.n_batch = batchSize;
+    ctx_params.n_ubatch = batchSize;
+    ctx_params.n_seq_max = maxSequences;
+    ctx_params.kv_unified = true;
+    ctx_params.n_threads = nThreads;
+    ctx_params.n_threads_batch = nThreads;
+    
+    g_embd_ctx = llama_init_from_model(g_embd_model.get(), ctx_params);
+    if (!g_embd_ctx) {
+        LOGE("Failed to create embedding context");
+        freeEmbeddingContext();
+        return JNI_FALSE;
+    }
+    
+    if (llama_pooling_type(g_embd_ctx) == LLAMA_POOLING_TYPE_NONE) {
+        LOGE("Embedding context has no pooling, choose MEAN, CLS or LAST");
+        freeEmbeddingContext();
+        return JNI_FALSE;
+    }
+    
+    LOGI("Embedding context ready: pooling %d, batch %d, %d sequences",
+         llama_pooling_type(g_embd_ctx), batchSize, maxSequences);
+    return JNI_TRUE;
+}
+
+/**
+ * Create the embedding context. With an empty path it runs on the loaded chat
+ * model, otherwise the given (usually small) embedding GGUF is loaded for it.
+ * batchSize bounds the tokens packed into one batch, maxSequences the texts.
+ * A dedicated model loads with no lock held, so chat and the current embedding
+ * context keep serving until it is swapped in.
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeLoadEmbeddingModel(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring modelPath,
+        jint poolingType,
+        jint nThreads,
+        jint batchSize,
+        jint maxSequences) {
+    
+    const std::string path = modelPath != nullptr ? sanitizeInputString(env, modelPath) : "";
+    enum llama_pooling_type pooling = static_cast<enum llama_pooling_type>(poolingType);
+    
+    if (!path.empty()) {
+        LOGI("Loading embedding model from: %s", path.c_str());
+        llama_model* model = llama_model_load_from_file(path.c_str(), llama_model_default_params());
+        if (!model) {
+            LOGE("Failed to load embedding model from: %s", path.c_str());
+            return JNI_FALSE;
+        }
+        const ModelHandle handle = makeModelHandle(model);
+        std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+        return installEmbeddingContext(handle, pooling, nThreads, batchSize, maxSequences);
+    }
+    
+    // g_mutex keeps the chat model from being released before the context is on it
+    ForegroundLock lock;
+    if (!g_model) {
+        LOGE("Model not loaded");
+        return JNI_FALSE;
+    }
+    if (pooling == LLAMA_POOLING_TYPE_UNSPECIFIED) {
+        // Chat models carry no pooling metadata, mean pooling is the sane default
+        pooling = LLAMA_POOLING_TYPE_MEAN;
+    }
+    std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+    return installEmbeddingContext(g_model, pooling, nThreads, batchSize, maxSequences);
+}
+
+/**
+ * Free the embedding context (and its dedicated model, if any)
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeUnloadEmbeddingModel(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+    freeEmbeddingContext();
+}
+
+/**
+ * Dimension of the vectors returned by nativeEmbed, or 0 without an embedding context
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetEmbeddingDim(
+        JNIEnv* env,
+        jobject /* this */) {
+    
+    std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+    return g_embd_ctx ? llama_model_n_embd(llama_get_model(g_embd_ctx)) : 0;
+}
+
+/**
+ * Embed a batch of texts into a direct ByteBuffer in native byte order.
+ * float32 rows are n_embd floats; int8 rows are a float scale plus n_embd bytes.
+ * Returns the number of rows written, or -1 on failure.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeEmbed(
+        JNIEnv* env,
+        jobject /* this */,
+        jobjectArray texts,
+        jboolean normalize,
+        jboolean int8,
+        jobject outBuffer) {
+    
+    std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+    
+    if (!g_embd_ctx) {
+        LOGE("Embedding context not loaded");
+        return -1;
+    }
+    
+    const std::vector<std::string> inputs = toStringVector(env, texts);
+    const int n_embd = llama_model_n_embd(llama_get_model(g_embd_ctx));
+    const size_t needed = inputs.size() * embeddingRowBytes(n_embd, int8);
+    
+    uint8_t* out = static_cast<uint8_t*>(env->GetDirectBufferAddress(outBuffer));
+    if (out == nullptr || static_cast<size_t>(env->GetDirectBufferCapacity(outBuffer)) < needed) {
+        LOGE("Embedding output buffer must be direct and hold %zu bytes", needed);
+        return -1;
+    }
+    
+    return embedTexts(inputs, normalize, int8, out);
+}
+
+/**
+ * Open (or create) a history index file for vectors of the embedding dimension.
+ * Returns an opaque handle, or 0 on failure.
+ */
+JNIEXPORT jlong JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexOpen(
+        JNIEnv* env,
+        jobject /* this */,
+        jstring indexPath,
+        jint dim) {
+    
+    const std::string path = sanitizeInputString(env, indexPath);
+    std::unique_ptr<VectorIndex> index = VectorIndex::open(path, dim);
+    return reinterpret_cast<jlong>(index.release());
+}
+
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexClose(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle) {
+    
+    delete reinterpret_cast<VectorIndex*>(handle);
+}
+
+/**
+ * Embed texts in batches on the embedding context and append them to the index
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexAddTexts(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlongArray ids,
+        jlong group,
+        jobjectArray texts) {
+    
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    const std::vector<std::string> inputs = toStringVector(env, texts);
+    if (index == nullptr || inputs.empty() || env->GetArrayLength(ids) != static_cast<jsize>(inputs.size())) {
+        return JNI_FALSE;
+    }
+    
+    std::vector<int64_t> id_values(inputs.size());
+    env->GetLongArrayRegion(ids, 0, static_cast<jsize>(id_values.size()), reinterpret_cast<jlong*>(id_values.data()));
+    
+    std::vector<float> vectors;
+    {
+        std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+        if (!g_embd_ctx || llama_model_n_embd(llama_get_model(g_embd_ctx)) != index->dim()) {
+            LOGE("Embedding context missing or dimension does not match the index");
+            return JNI_FALSE;
+        }
+        vectors.resize(inputs.size() * index->dim());
+        if (embedTexts(inputs, true, false, reinterpret_cast<uint8_t*>(vectors.data())) < 0) {
+            return JNI_FALSE;
+        }
+    }
+    
+    return index->add(id_values.data(), group, vectors.data(), inputs.size()) ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Embed the query and return up to k nearest ids within the group, best first.
+ * Returns the number of hits written to outIds/outScores, or -1 on failure.
+ */
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexSearchText(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong group,
+        jstring query,
+        jint k,
+        jlongArray outIds,
+        jfloatArray outScores) {
+    
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    if (index == nullptr) {
+        return -1;
+    }
+    
+    std::vector<float> vector(index->dim());
+    {
+        std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+        if (!g_embd_ctx || llama_model_n_embd(llama_get_model(g_embd_ctx)) != index->dim()) {
+            LOGE("Embedding context missing or dimension does not match the index");
+            return -1;
+        }
+        if (embedTexts({sanitizeInputString(env, query)}, true, false, reinterpret_cast<uint8_t*>(vector.data())) < 0) {
+            return -1;
+        }
+    }
+    
+    const jint capacity = std::min(env->GetArrayLength(outIds), env->GetArrayLength(outScores));
+    const std::vector<VectorIndex::Hit> hits = index->search(vector.data(), group, std::min(k, capacity));
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const jlong id = hits[i].id;
+        const jfloat score = hits[i].score;
+        env->SetLongArrayRegion(outIds, static_cast<jsize>(i), 1, &id);
+        env->SetFloatArrayRegion(outScores, static_cast<jsize>(i), 1, &score);
+    }
+    return static_cast<jint>(hits.size());
+}
+
+JNIEXPORT jlong JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexMaxId(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong group) {
+    
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    return index ? index->maxId(group) : -1;
+}
+
+JNIEXPORT jint JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeIndexRemoveGroup(
+        JNIEnv* env,
+        jobject /* this */,
+        jlong handle,
+        jlong group) {
+    
+    VectorIndex* index = reinterpret_cast<VectorIndex*>(handle);
+    return index ? static_cast<jint>(index->removeGroup(group)) : 0;
+}
+
+/**
+ * Stop ongoing generation
+ */
+JNIEXPORT void JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeStopGeneration(
+        JNIEnv* env,
+        jobject /* this */) {
+    LOGI("Stopping generation");
+    g_should_stop.store(true);
+}
+
+/**
+ * Get model information
+ */
+JNIEXPORT jstring JNICALL
 Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetModelInfo(
         JNIEnv* env,
         jobject /* this */) {
     
-    std::lock_guard<std::mutex> lock(g_mutex);
+    ForegroundLock lock;
     
     if (!g_model) {
         return safeNewStringUTF(env, "No model loaded");
     }
     
     // Get vocab and model metadata
-    const llama_vocab* vocab = llama_model_get_vocab(g_model);
+    const llama_vocab* vocab = llama_model_get_vocab(g_model.get());
     const int n_vocab = llama_vocab_n_tokens(vocab);
-    const int n_ctx_train = llama_model_n_ctx_train(g_model);
-    const int n_embd = llama_model_n_embd(g_model);
+    const int n_ctx_train = llama_model_n_ctx_train(g_model.get());
+    const int n_embd = llama_model_n_embd(g_model.get());
     
     char desc[256];
-    llama_model_desc(g_model, desc, sizeof(desc));
+    llama_model_desc(g_model.get(), desc, sizeof(desc));
     
     // Format info string
     std::string info = "Model: ";
@@ -731,11 +2599,81 @@ Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetModelInfo(
     if (g_ctx) {
         const int n_ctx = llama_n_ctx(g_ctx);
         info += "\nContext (current): " + std::to_string(n_ctx);
+        info += "\nBatch: " + std::to_string(llama_n_batch(g_ctx));
+        info += "\nKV cache: ";
+        info += ggml_type_name(g_params.cache_type_k);
+        info += "\nFlash attention: ";
+        info += g_params.flash_attn_type == LLAMA_FLASH_ATTN_TYPE_ENABLED ? "on" : "off";
+        info += g_flash_attn_auto ? " (auto)" : "";
+    }
+    {
+        const TokenCache::Stats cache = g_token_cache.stats();
+        const uint64_t lookups = cache.hits + cache.misses;
+        info += "\nToken cache: " + std::to_string(cache.entries) + " segments, " +
+                std::to_string(cache.tokens) + " tokens";
+        if (lookups > 0) {
+            info += ", " + std::to_string(cache.hits * 100 / lookups) + "% hits";
+        }
+    }
+    if (g_prefix_stats.prompt_tokens > 0) {
+        info += "\nPrefix cache: " + std::to_string(g_prefix_stats.reused_tokens * 100 / g_prefix_stats.prompt_tokens) +
+                "% of prompt tokens reused over " + std::to_string(g_prefix_stats.prompts) + " prompts";
+    }
+    if (!g_adapters.empty()) {
+        info += "\nLoRA adapters: " + std::to_string(g_adapters.size()) + " loaded";
+        info += g_lora_key.empty() ? ", none applied" : ", applied " + g_lora_key;
+    }
+    {
+        std::lock_guard<std::mutex> parked_lock(g_parked_mutex);
+        if (!g_parked.empty()) {
+            info += "\nParked models: " + std::to_string(g_parked.size());
+        }
+    }
+    if (g_load_ms >= 0) {
+        info += "\nLoad time: " + std::to_string(g_load_ms) + " ms";
+    }
+    if (g_warmup_ms >= 0) {
+        info += "\nWarmup time: " + std::to_string(g_warmup_ms) + " ms";
+    }
+    {
+        std::lock_guard<std::mutex> weights_lock(g_weights_mutex);
+        if (g_repack.repacked_bytes > 0) {
+            info += "\nRepacked weights: " + std::to_string(g_repack.repacked_bytes >> 20) + " MiB";
+            for (size_t i = 0; i < g_repack.types.size(); ++i) {
+                info += i == 0 ? " (" : ", ";
+                info += ggml_type_name(g_repack.types[i]);
+            }
+            info += g_repack.types.empty() ? "" : ")";
+        }
+        if (g_repack.cold_load_ms >= 0) {
+            info += "\nFirst load: " + std::to_string(g_repack.cold_load_ms) + " ms";
+        }
+        if (g_repack.warm_load_ms >= 0) {
+            info += "\nLoad from repack cache: " + std::to_string(g_repack.warm_load_ms) + " ms";
+        }
     }
     
+    info += "\nCPU backend: " + cpuBackendInfo().variant;
+    
     return safeNewStringUTF(env, info.c_str());
 }
 
+/**
+ * Name of the CPU backend variant in use (e.g. "armv8.2_dotprod") followed by the
+ * features it detected, or an empty string if none was loaded
+ */
+JNIEXPORT jstring JNICALL
+Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeGetCpuBackend(
+        JNIEnv* env,
+        jobject /* this */) {
+    const CpuBackendInfo cpu = cpuBackendInfo();
+    if (cpu.variant.empty()) {
+        return safeNewStringUTF(env, "");
+    }
+    const std::string backend = cpu.variant + " (" + cpuBackendFeatures() + ")";
+    return safeNewStringUTF(env, backend.c_str());
+}
+
 /**
  * Cleanup resources
  */
@@ -744,17 +2682,14 @@ Java_com_androgpt_yaser_data_inference_LlamaEngine_nativeCleanup(
         JNIEnv* env,
         jobject /* this */) {
     
-    std::lock_guard<std::mutex> lock(g_mutex);
+    ForegroundLock lock;
     LOGI("Cleaning up native resources");
     
     // Cleanup llama.cpp resources
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
-    }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
+    releaseModel();
+    {
+        std::lock_guard<std::mutex> embd_lock(g_embd_mutex);
+        freeEmbeddingContext();
     }
     
     llama_backend_free();
@@ -0,0 +1,160 @@
+#include "memory_planner.h"
+
+#include "gguf.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#define LOG_TAG "MemoryPlanner"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+
+// Runtime allocations the estimate does not model: graph metadata, the tokenizer,
+// sampler state and the native heap of the JNI layer
+static constexpr uint64_t OVERHEAD_BYTES = 96ull << 20;
+
+// Fraction of the available memory a plan may use
+static constexpr double SAFETY_FRACTION = 0.9;
+
+static constexpr uint32_t MIN_CTX = 512;
+static constexpr uint32_t CTX_STEP = 256;
+static constexpr uint32_t BATCH_SIZES[] = {512, 256, 128};
+static constexpr ggml_type KV_TYPES[] = {GGML_TYPE_F16, GGML_TYPE_Q8_0};
+
+bool readModelShape(const std::string& path, ModelShape& shape) {
+    gguf_init_params params = {true, nullptr};
+    gguf_context* gguf = gguf_init_from_file(path.c_str(), params);
+    if (gguf == nullptr) {
+        LOGW("Failed to read GGUF metadata of %s", path.c_str());
+        return false;
+    }
+
+    shape = ModelShape();
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+        shape.weight_bytes += gguf_get_tensor_size(gguf, i);
+    }
+
+    const int64_t arch_id = gguf_find_key(gguf, "general.architecture");
+    const std::string arch = arch_id >= 0 ? gguf_get_val_str(gguf, arch_id) : "";
+    auto readU32 = [&](const char* suffix) -> uint32_t {
+        const int64_t id = gguf_find_key(gguf, (arch + suffix).c_str());
+        return id >= 0 && gguf_get_kv_type(gguf, id) == GGUF_TYPE_UINT32 ? gguf_get_val_u32(gguf, id) : 0;
+    };
+    shape.n_layer = readU32(".block_count");
+    shape.n_embd = readU32(".embedding_length");
+    shape.n_head = readU32(".attention.head_count");
+    shape.n_head_kv = readU32(".attention.head_count_kv");
+    shape.n_ff = readU32(".feed_forward_length");
+    shape.n_ctx_train = readU32(".context_length");
+
+    const int64_t tokens_id = gguf_find_key(gguf, "tokenizer.ggml.tokens");
+    if (tokens_id >= 0 && gguf_get_kv_type(gguf, tokens_id) == GGUF_TYPE_ARRAY) {
+        shape.n_vocab = static_cast<uint32_t>(gguf_get_arr_n(gguf, tokens_id));
+    }
+    gguf_free(gguf);
+
+    if (shape.n_head_kv == 0) {
+        shape.n_head_kv = shape.n_head;
+    }
+    return true;
+}
+
+MemoryPlan estimateMemory(const ModelShape& shape, uint32_t n_ctx, uint32_t n_batch, ggml_type type_kv) {
+    MemoryPlan plan;
+    plan.n_ctx = n_ctx;
+    plan.n_batch = n_batch;
+    plan.type_kv = type_kv;
+    plan.weight_bytes = shape.weight_bytes;
+    plan.overhead_bytes = OVERHEAD_BYTES;
+
+    if (shape.n_head > 0) {
+        const int64_t n_embd_kv = shape.n_embd / shape.n_head * shape.n_head_kv;
+        plan.kv_bytes = 2ull * shape.n_layer * n_ctx * ggml_row_size(type_kv, n_embd_kv);
+    }
+
+    // Activations of one ubatch: residual stream and attention projections, the FFN
+    // up/gate pair, and logits of the last position
+    const uint64_t n_ff = shape.n_ff > 0 ? shape.n_ff : 4ull * shape.n_embd;
+    uint64_t compute = static_cast<uint64_t>(n_batch) * (6ull * shape.n_embd + 2ull * n_ff) * sizeof(float);
+    compute += static_cast<uint64_t>(shape.n_vocab) * sizeof(float);
+    if (type_kv == GGML_TYPE_F16) {
+        // Flash attention is left to llama.cpp here; without it the KQ scores of
+        // every head are materialized
+        compute += static_cast<uint64_t>(n_batch) * n_ctx * shape.n_head * sizeof(float);
+    }
+    plan.compute_bytes = compute;
+    return plan;
+}
+
+bool planMemory(const ModelShape& shape, uint64_t available, uint32_t max_ctx, MemoryPlan& plan) {
+    const uint64_t limit = static_cast<uint64_t>(available * SAFETY_FRACTION);
+    uint32_t cap = max_ctx > 0 ? max_ctx : shape.n_ctx_train;
+    if (cap == 0) {
+        cap = 4096;
+    }
+    cap = std::max(cap / CTX_STEP * CTX_STEP, MIN_CTX);
+
+    bool found = false;
+    for (uint32_t n_batch : BATCH_SIZES) {
+        for (ggml_type type_kv : KV_TYPES) {
+            if (estimateMemory(shape, MIN_CTX, n_batch, type_kv).total() > limit) {
+                continue;
+            }
+            // total() grows with n_ctx, so binary search the largest fitting step
+            uint32_t lo = MIN_CTX / CTX_STEP;
+            uint32_t hi = cap / CTX_STEP;
+            while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo + 1) / 2;
+                if (estimateMemory(shape, mid * CTX_STEP, n_batch, type_kv).total() <= limit) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            const uint32_t n_ctx = lo * CTX_STEP;
+            if (!found || n_ctx > plan.n_ctx) {
+                plan = estimateMemory(shape, n_ctx, n_batch, type_kv);
+                found = true;
+            }
+            if (n_ctx >= cap) {
+                break;
+            }
+        }
+        // A smaller batch only helps when no configuration fits at all
+        if (found) {
+            break;
+        }
+    }
+
+    if (found) {
+        LOGI("Plan: n_ctx %u, n_batch %u, KV %s; weights %llu + KV %llu + compute %llu + overhead %llu MiB of %llu MiB",
+             plan.n_ctx, plan.n_batch, ggml_type_name(plan.type_kv),
+             static_cast<unsigned long long>(plan.weight_bytes >> 20),
+             static_cast<unsigned long long>(plan.kv_bytes >> 20),
+             static_cast<unsigned long long>(plan.compute_bytes >> 20),
+             static_cast<unsigned long long>(plan.overhead_bytes >> 20),
+             static_cast<unsigned long long>(available >> 20));
+    } else {
+        LOGW("No configuration fits in %llu MiB", static_cast<unsigned long long>(available >> 20));
+    }
+    return found;
+}
+
+uint64_t availableMemoryBytes() {
+    FILE* f = std::fopen("/proc/meminfo", "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    while (std::fgets(line, sizeof(line), f) != nullptr) {
+        if (std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    std::fclose(f);
+    return static_cast<uint64_t>(kb) << 10;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <string>
+
+/**
+ * What the memory estimate needs from a GGUF file, read from its metadata alone.
+ * Head counts stored per layer (arrays) read as 0 and fall back to n_head.
+ */
+struct ModelShape {
+    uint64_t weight_bytes = 0;
+    uint32_t n_layer = 0;
+    uint32_t n_embd = 0;
+    uint32_t n_head = 0;
+    uint32_t n_head_kv = 0;
+    uint32_t n_ff = 0;
+    uint32_t n_vocab = 0;
+    uint32_t n_ctx_train = 0;
+};
+
+bool readModelShape(const std::string& path, ModelShape& shape);
+
+/**
+ * Estimated resident memory of a model with one chat context. The compute buffer
+ * covers a single ubatch of n_batch tokens. A quantized KV cache needs flash
+ * attention, which also avoids materializing the KQ matrix.
+ */
+struct MemoryPlan {
+    uint32_t n_ctx = 0;
+    uint32_t n_batch = 0;
+    ggml_type type_kv = GGML_TYPE_F16;
+    uint64_t weight_bytes = 0;
+    uint64_t kv_bytes = 0;
+    uint64_t compute_bytes = 0;
+    uint64_t overhead_bytes = 0;
+
+    uint64_t total() const { return weight_bytes + kv_bytes + compute_bytes + overhead_bytes; }
+};
+
+MemoryPlan estimateMemory(const ModelShape& shape, uint32_t n_ctx, uint32_t n_batch, ggml_type type_kv);
+
+/**
+ * Largest context (up to max_ctx, or the training context when 0) that fits in
+ * `available` bytes with a safety margin. F16 KV is preferred; Q8_0 is used when
+ * it reaches a larger context, and n_batch shrinks only if nothing fits otherwise.
+ * Returns false if not even the smallest configuration fits.
+ */
+bool planMemory(const ModelShape& shape, uint64_t available, uint32_t max_ctx, MemoryPlan& plan);
+
+/** MemAvailable from /proc/meminfo, or 0 if unreadable. */
+uint64_t availableMemoryBytes();
@@ -0,0 +1,577 @@
+#include "repack_cache.h"
+
+#include "cpu_backend.h"
+#include "ggml-backend.h"
+#include "ggml-backend-impl.h"
+
+#include <android/log.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#define LOG_TAG "RepackCache"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+
+#ifndef GGML_VERSION
+#define GGML_VERSION "unknown"
+#endif
+
+// Bytes hashed at each end of the file: the head holds the metadata, the tail the
+// last tensors, so a re-converted or re-downloaded file changes the fingerprint
+static constexpr size_t FINGERPRINT_BYTES = 1u << 20;
+
+static constexpr char SIDECAR_MAGIC[4] = {'A', 'G', 'R', 'P'};
+static constexpr uint32_t SIDECAR_VERSION = 1;
+
+// Buffer images start on this boundary so they can be mapped on 4 KiB and 16 KiB
+// page kernels alike
+static constexpr uint64_t IMAGE_ALIGNMENT = 64u << 10;
+
+// Sanity limits for tables read back from a sidecar
+static constexpr uint32_t MAX_IMAGES = 64;
+static constexpr uint64_t MAX_TENSORS = 1u << 20;
+
+/**
+ * Sidecar layout: this header, the key, one ImageRecord per CPU_REPACK buffer in the
+ * order the loader allocated them, one TensorRecord per repacked tensor, then the
+ * buffer images, each at an IMAGE_ALIGNMENT offset.
+ */
+struct SidecarHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t key_bytes;
+    uint32_t n_images;
+    uint64_t n_tensors;
+    int64_t cold_load_ms;
+    int64_t warm_load_ms;
+};
+
+struct ImageRecord {
+    uint64_t offset;  // in the file
+    uint64_t size;
+};
+
+struct TensorRecord {
+    char name[GGML_MAX_NAME];
+    uint32_t image;
+    uint32_t type;
+    uint64_t offset;  // in the image
+    uint64_t size;
+};
+
+struct RepackedTensor {
+    std::string name;
+    ggml_type type;
+    size_t buffer;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SessionBuffer {
+    ggml_backend_buffer_t buffer;
+    bool mapped;  // an image from the sidecar
+};
+
+struct RepackCacheSession::State {
+    std::string path;
+    std::string key;
+    int fd = -1;  // sidecar matching the key, -1 when there is none
+    SidecarHeader header {};
+    std::vector<ImageRecord> images;
+    std::unordered_map<std::string, TensorRecord> cached;
+    std::vector<SessionBuffer> buffers;  // CPU_REPACK buffers allocated by this load
+    std::vector<RepackedTensor> tensors;
+    bool repacked = false;  // some tensor had to be repacked on this load
+};
+
+// Session of the load running on this thread; the loader allocates and uploads the
+// weights on the thread that called llama_model_load_from_file
+static thread_local RepackCacheSession::State* t_session = nullptr;
+
+// The CPU_REPACK buffer type, and the functions ggml-cpu gives its buffers
+static ggml_backend_buffer_type_t g_repack_buft = nullptr;
+static decltype(ggml_backend_buffer_type_i::alloc_buffer) g_repack_alloc_buffer = nullptr;
+static decltype(ggml_backend_buffer_i::init_tensor) g_repack_init_tensor = nullptr;
+static decltype(ggml_backend_buffer_i::set_tensor) g_repack_set_tensor = nullptr;
+
+static std::string sidecarPath(const std::string& path) {
+    return path + ".repack";
+}
+
+static std::string attentionSidecarPath(const std::string& path) {
+    return path + ".attn";
+}
+
+static uint64_t roundUp(uint64_t value, uint64_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+static uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static bool fingerprintFile(const std::string& path, uint64_t& hash, uint64_t& size) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    hash = 0xcbf29ce484222325ull;
+
+    std::vector<uint8_t> buf(FINGERPRINT_BYTES);
+    const off_t offsets[2] = {0, static_cast<off_t>(size > FINGERPRINT_BYTES ? size - FINGERPRINT_BYTES : 0)};
+    for (off_t offset : offsets) {
+        const ssize_t n = pread(fd, buf.data(), buf.size(), offset);
+        if (n < 0) {
+            close(fd);
+            return false;
+        }
+        hash = fnv1a(buf.data(), static_cast<size_t>(n), hash);
+    }
+    close(fd);
+    return true;
+}
+
+std::string repackProfileKey(const std::string& path) {
+    uint64_t hash = 0;
+    uint64_t size = 0;
+    if (!fingerprintFile(path, hash, size)) {
+        return "";
+    }
+    // The loaded CPU backend variant and the features it found decide which layouts apply
+    char key[64];
+    snprintf(key, sizeof(key), "%016" PRIx64 "-%" PRIu64, hash, size);
+    return std::string(key) + "|" + cpuBackendInfo().variant + ":" + cpuBackendFeatures() +
+           "|ggml=" + GGML_VERSION;
+}
+
+static int findBuffer(const RepackCacheSession::State& state, ggml_backend_buffer_t buffer) {
+    for (size_t i = state.buffers.size(); i-- > 0;) {
+        if (state.buffers[i].buffer == buffer) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+static void recordTensor(RepackCacheSession::State& state, size_t buffer, const ggml_tensor* tensor) {
+    const auto* base = static_cast<const uint8_t*>(ggml_backend_buffer_get_base(state.buffers[buffer].buffer));
+    const auto offset = static_cast<uint64_t>(static_cast<const uint8_t*>(tensor->data) - base);
+    state.tensors.push_back({tensor->name, tensor->type, buffer, offset, ggml_nbytes(tensor)});
+}
+
+/**
+ * set_tensor of CPU_REPACK buffers allocated in a session. A tensor the mapped image
+ * already holds at the same place is left as it is; anything else is repacked by
+ * ggml-cpu, into the private copy of the page when the buffer is mapped.
+ */
+static void setRepackedTensor(ggml_backend_buffer_t buffer, ggml_tensor* tensor, const void* data,
+                              size_t offset, size_t size) {
+    RepackCacheSession::State* state = t_session;
+    const int index = state != nullptr ? findBuffer(*state, buffer) : -1;
+    if (index >= 0 && state->buffers[index].mapped && offset == 0 && size == ggml_nbytes(tensor)) {
+        const auto cached = state->cached.find(tensor->name);
+        const auto* base = static_cast<const uint8_t*>(ggml_backend_buffer_get_base(buffer));
+        if (cached != state->cached.end() && cached->second.image == static_cast<uint32_t>(index) &&
+            cached->second.type == static_cast<uint32_t>(tensor->type) && cached->second.size == size &&
+            cached->second.offset == static_cast<uint64_t>(static_cast<const uint8_t*>(tensor->data) - base)) {
+            recordTensor(*state, index, tensor);
+            return;
+        }
+    }
+    g_repack_set_tensor(buffer, tensor, data, offset, size);
+    if (index >= 0) {
+        recordTensor(*state, index, tensor);
+        state->repacked = true;
+    }
+}
+
+struct MappedImage {
+    void* addr;
+    size_t size;
+};
+
+static void freeMappedImage(ggml_backend_buffer_t buffer) {
+    auto* image = static_cast<MappedImage*>(buffer->context);
+    munmap(image->addr, image->size);
+    delete image;
+}
+
+static void* mappedImageBase(ggml_backend_buffer_t buffer) {
+    return static_cast<MappedImage*>(buffer->context)->addr;
+}
+
+static void memsetMappedTensor(ggml_backend_buffer_t /* buffer */, ggml_tensor* tensor, uint8_t value,
+                               size_t offset, size_t size) {
+    std::memset(static_cast<uint8_t*>(tensor->data) + offset, value, size);
+}
+
+static void clearMappedImage(ggml_backend_buffer_t buffer, uint8_t value) {
+    std::memset(mappedImageBase(buffer), value, buffer->size);
+}
+
+/**
+ * A CPU_REPACK buffer over a private mapping of a sidecar image. It keeps the repack
+ * buffer type, which is how ggml-cpu routes matmuls on its tensors to the repacked
+ * kernels, and the type's init_tensor, which attaches those kernels to each tensor.
+ */
+static ggml_backend_buffer_t mapImage(const RepackCacheSession::State& state, const ImageRecord& image,
+                                      ggml_backend_buffer_type_t buft, size_t size) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, state.fd, static_cast<off_t>(image.offset));
+    if (addr == MAP_FAILED) {
+        LOGW("Cannot map repacked weights from %s: %s", sidecarPath(state.path).c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    ggml_backend_buffer_i iface = {};
+    iface.free_buffer = freeMappedImage;
+    iface.get_base = mappedImageBase;
+    iface.init_tensor = g_repack_init_tensor;
+    iface.memset_tensor = memsetMappedTensor;
+    iface.set_tensor = setRepackedTensor;
+    iface.clear = clearMappedImage;
+    return ggml_backend_buffer_init(buft, iface, new MappedImage{addr, size}, size);
+}
+
+/** alloc_buffer of the CPU_REPACK buffer type once the cache is installed. */
+static ggml_backend_buffer_t allocRepackBuffer(ggml_backend_buffer_type_t buft, size_t size) {
+    RepackCacheSession::State* state = t_session;
+    if (state == nullptr) {
+        return g_repack_alloc_buffer(buft, size);
+    }
+
+    const size_t index = state->buffers.size();
+    ggml_backend_buffer_t buffer = nullptr;
+    if (state->fd >= 0 && index < state->images.size() && state->images[index].size == size) {
+        buffer = mapImage(*state, state->images[index], buft, size);
+    }
+    const bool mapped = buffer != nullptr;
+    if (!mapped) {
+        buffer = g_repack_alloc_buffer(buft, size);
+        if (buffer == nullptr) {
+            return nullptr;
+        }
+        buffer->iface.set_tensor = setRepackedTensor;
+    }
+    state->buffers.push_back({buffer, mapped});
+    return buffer;
+}
+
+bool installRepackCache() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+        auto get_extra_bufts = reg ? reinterpret_cast<ggml_backend_dev_get_extra_bufts_t>(
+                ggml_backend_reg_get_proc_address(reg, "ggml_backend_dev_get_extra_bufts")) : nullptr;
+        for (ggml_backend_buffer_type_t* buft = get_extra_bufts ? get_extra_bufts(dev) : nullptr;
+             buft != nullptr && *buft != nullptr; ++buft) {
+            if (std::strcmp(ggml_backend_buft_name(*buft), "CPU_REPACK") == 0) {
+                g_repack_buft = *buft;
+            }
+        }
+        if (g_repack_buft == nullptr) {
+            LOGI("The CPU backend repacks no weights, repack cache disabled");
+            return;
+        }
+
+        // ggml-cpu builds repack buffers as CPU buffers with its own init_tensor and
+        // set_tensor; a small one shows which
+        ggml_backend_buffer_t probe = g_repack_buft->iface.alloc_buffer(g_repack_buft, 64);
+        if (probe == nullptr) {
+            g_repack_buft = nullptr;
+            return;
+        }
+        g_repack_init_tensor = probe->iface.init_tensor;
+        g_repack_set_tensor = probe->iface.set_tensor;
+        ggml_backend_buffer_free(probe);
+
+        g_repack_alloc_buffer = g_repack_buft->iface.alloc_buffer;
+        g_repack_buft->iface.alloc_buffer = allocRepackBuffer;
+    });
+    return g_repack_buft != nullptr;
+}
+
+/** Open the sidecar of `state.path` if it was written under `state.key` and its tables are sound. */
+static bool openSidecar(RepackCacheSession::State& state) {
+    const std::string path = sidecarPath(state.path);
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    SidecarHeader header {};
+    const bool readable = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header);
+    const auto file_size = static_cast<uint64_t>(st.st_size);
+
+    std::string key(readable ? std::min<uint32_t>(header.key_bytes, 4096) : 0, '\0');
+    bool valid = readable && std::memcmp(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)) == 0 &&
+                 header.version == SIDECAR_VERSION && header.key_bytes == state.key.size() &&
+                 header.n_images <= MAX_IMAGES && header.n_tensors <= MAX_TENSORS &&
+                 pread(fd, &key[0], key.size(), sizeof(header)) == static_cast<ssize_t>(key.size()) &&
+                 key == state.key;
+
+    std::vector<ImageRecord> images(valid ? header.n_images : 0);
+    std::vector<TensorRecord> tensors(valid ? header.n_tensors : 0);
+    const uint64_t images_at = sizeof(header) + key.size();
+    const uint64_t tensors_at = images_at + images.size() * sizeof(ImageRecord);
+    valid = valid &&
+            pread(fd, images.data(), images.size() * sizeof(ImageRecord), static_cast<off_t>(images_at)) ==
+                static_cast<ssize_t>(images.size() * sizeof(ImageRecord)) &&
+            pread(fd, tensors.data(), tensors.size() * sizeof(TensorRecord), static_cast<off_t>(tensors_at)) ==
+                static_cast<ssize_t>(tensors.size() * sizeof(TensorRecord));
+    for (size_t i = 0; valid && i < images.size(); ++i) {
+        valid = images[i].offset % IMAGE_ALIGNMENT == 0 && images[i].offset <= file_size &&
+                images[i].size <= file_size - images[i].offset;
+    }
+    for (size_t i = 0; valid && i < tensors.size(); ++i) {
+        const TensorRecord& tensor = tensors[i];
+        valid = tensor.image < images.size() && tensor.offset <= images[tensor.image].size &&
+                tensor.size <= images[tensor.image].size - tensor.offset;
+    }
+    if (!valid) {
+        if (key == state.key && readable) {
+            LOGW("Ignoring %s, its tables do not match the file", path.c_str());
+        }
+        close(fd);
+        return false;
+    }
+
+    state.fd = fd;
+    state.header = header;
+    state.images = std::move(images);
+    for (TensorRecord& tensor : tensors) {
+        tensor.name[GGML_MAX_NAME - 1] = '\0';
+        state.cached[tensor.name] = tensor;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size, uint64_t offset) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+/** Write the session's buffers to a new sidecar, then rename it over the old one. */
+static bool writeRepackSidecar(const RepackCacheSession::State& state, int64_t cold_load_ms) {
+    const std::string target = sidecarPath(state.path);
+    const std::string tmp = target + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGW("Cannot write %s: %s", tmp.c_str(), strerror(errno));
+        return false;
+    }
+
+    SidecarHeader header {};
+    std::memcpy(header.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+    header.version = SIDECAR_VERSION;
+    header.key_bytes = static_cast<uint32_t>(state.key.size());
+    header.n_images = static_cast<uint32_t>(state.buffers.size());
+    header.n_tensors = state.tensors.size();
+    header.cold_load_ms = cold_load_ms;
+    header.warm_load_ms = -1;
+
+    std::vector<ImageRecord> images(state.buffers.size());
+    uint64_t offset = roundUp(sizeof(header) + state.key.size() + images.size() * sizeof(ImageRecord) +
+                              state.tensors.size() * sizeof(TensorRecord), IMAGE_ALIGNMENT);
+    for (size_t i = 0; i < images.size(); ++i) {
+        images[i] = {offset, ggml_backend_buffer_get_size(state.buffers[i].buffer)};
+        offset = roundUp(offset + images[i].size, IMAGE_ALIGNMENT);
+    }
+    std::vector<TensorRecord> tensors(state.tensors.size());
+    for (size_t i = 0; i < tensors.size(); ++i) {
+        const RepackedTensor& tensor = state.tensors[i];
+        std::strncpy(tensors[i].name, tensor.name.c_str(), GGML_MAX_NAME - 1);
+        tensors[i].image = static_cast<uint32_t>(tensor.buffer);
+        tensors[i].type = static_cast<uint32_t>(tensor.type);
+        tensors[i].offset = tensor.offset;
+        tensors[i].size = tensor.size;
+    }
+
+    const uint64_t images_at = sizeof(header) + state.key.size();
+    const uint64_t tensors_at = images_at + images.size() * sizeof(ImageRecord);
+    bool ok = writeAll(fd, &header, sizeof(header), 0) &&
+              writeAll(fd, state.key.data(), state.key.size(), sizeof(header)) &&
+              writeAll(fd, images.data(), images.size() * sizeof(ImageRecord), images_at) &&
+              writeAll(fd, tensors.data(), tensors.size() * sizeof(TensorRecord), tensors_at);
+    for (size_t i = 0; ok && i < images.size(); ++i) {
+        ok = writeAll(fd, ggml_backend_buffer_get_base(state.buffers[i].buffer), images[i].size, images[i].offset);
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), target.c_str()) != 0) {
+        LOGW("Could not write %s: %s", target.c_str(), strerror(errno));
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+RepackCacheSession::RepackCacheSession(const std::string& path, const std::string& key) : state_(new State) {
+    state_->path = path;
+    state_->key = key;
+    if (g_repack_buft == nullptr || key.empty()) {
+        return;
+    }
+    openSidecar(*state_);
+    t_session = state_.get();
+}
+
+RepackCacheSession::~RepackCacheSession() {
+    if (t_session == state_.get()) {
+        t_session = nullptr;
+    }
+    if (state_->fd >= 0) {
+        close(state_->fd);
+    }
+}
+
+void RepackCacheSession::finish(int64_t load_ms, RepackProfile& profile) {
+    State& state = *state_;
+    if (t_session == &state) {
+        t_session = nullptr;
+    }
+
+    profile = RepackProfile();
+    std::unordered_set<int> types;
+    for (const RepackedTensor& tensor : state.tensors) {
+        profile.repacked_bytes += tensor.size;
+        profile.tensors.push_back(tensor.name);
+        if (types.insert(tensor.type).second) {
+            profile.types.push_back(tensor.type);
+        }
+    }
+    if (state.tensors.empty()) {
+        return;
+    }
+
+    const bool all_mapped = std::all_of(state.buffers.begin(), state.buffers.end(),
+                                        [](const SessionBuffer& buffer) { return buffer.mapped; });
+    if (!state.repacked && all_mapped) {
+        // Only the warm time changes; the header is not part of any mapped image
+        profile.cold_load_ms = state.header.cold_load_ms;
+        profile.warm_load_ms = load_ms;
+        const int fd = open(sidecarPath(state.path).c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            writeAll(fd, &load_ms, sizeof(load_ms), offsetof(SidecarHeader, warm_load_ms));
+            close(fd);
+        }
+        LOGI("Mapped %llu MiB of repacked weights from %s", static_cast<unsigned long long>(profile.repacked_bytes >> 20),
+             sidecarPath(state.path).c_str());
+        return;
+    }
+
+    profile.cold_load_ms = load_ms;
+    if (writeRepackSidecar(state, load_ms)) {
+        LOGI("Wrote %llu MiB of repacked weights to %s", static_cast<unsigned long long>(profile.repacked_bytes >> 20),
+             sidecarPath(state.path).c_str());
+    }
+}
+
+void excludeRepackedRanges(std::vector<WeightRange>& ranges, const std::vector<std::string>& tensors) {
+    if (tensors.empty()) {
+        return;
+    }
+    const std::unordered_set<std::string> repacked(tensors.begin(), tensors.end());
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(), [&](const WeightRange& range) {
+        return repacked.count(range.name) > 0;
+    }), ranges.end());
+}
+
+/** Write then rename, so a crash never leaves a half-written profile behind. */
+static bool writeSidecar(const std::string& target, const std::string& contents) {
+    const std::string tmp = target + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        if (!out) {
+            LOGW("Cannot write %s", tmp.c_str());
+            return false;
+        }
+        out << contents;
+        if (!out) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp.c_str(), target.c_str()) == 0;
+}
+
+bool readAttentionProfile(const std::string& path, const std::string& key, AttentionProfile& profile) {
+    std::ifstream in(attentionSidecarPath(path));
+    if (!in || key.empty()) {
+        return false;
+    }
+
+    AttentionProfile read;
+    std::string line;
+    while (std::getline(in, line)) {
+        const size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const std::string name = line.substr(0, eq);
+        const std::string value = line.substr(eq + 1);
+        if (name == "key") {
+            read.key = value;
+        } else if (name == "flash_attn") {
+            // n_ctx:0|1 pairs
+            std::istringstream entries(value);
+            std::string entry;
+            while (std::getline(entries, entry, ',')) {
+                const size_t colon = entry.find(':');
+                const unsigned long n_ctx = std::strtoul(entry.c_str(), nullptr, 10);
+                if (colon != std::string::npos && n_ctx > 0) {
+                    read.flash_attn[static_cast<uint32_t>(n_ctx)] = entry.compare(colon + 1, std::string::npos, "1") == 0;
+                }
+            }
+        }
+    }
+    if (read.key != key) {
+        return false;
+    }
+    profile = std::move(read);
+    return true;
+}
+
+bool writeAttentionProfile(const std::string& path, const AttentionProfile& profile) {
+    std::ostringstream out;
+    out << "key=" << profile.key << '\n';
+    out << "flash_attn=";
+    for (auto it = profile.flash_attn.begin(); it != profile.flash_attn.end(); ++it) {
+        out << (it != profile.flash_attn.begin() ? "," : "") << it->first << ':' << (it->second ? 1 : 0);
+    }
+    out << '\n';
+    return writeSidecar(attentionSidecarPath(path), out.str());
+}
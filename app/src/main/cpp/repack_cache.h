@@ -0,0 +1,87 @@
+#pragma once
+
+#include "ggml.h"
+#include "weight_prefetch.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Persistent cache of the weights the CPU backend repacks into interleaved layouts
+ * (Q4_0, IQ4_NL and the other types its blocked kernels read). ggml-cpu converts them
+ * as they are uploaded, on every load; the cache keeps the repacked buffers in a
+ * sidecar next to the GGUF ("<model path>.repack", e.g. model.gguf.repack) and later
+ * loads map them from there instead. A sidecar is only used under the key it was
+ * written with: a fingerprint of the file, the CPU backend variant and features that
+ * pick the layouts and the ggml version that implements them.
+ */
+
+/**
+ * Hook the CPU backend's CPU_REPACK buffer type so that loads inside a
+ * RepackCacheSession use the cache. Call once after the CPU backend is registered and
+ * before any model is loaded. False when the backend has no repack buffer type.
+ */
+bool installRepackCache();
+
+/** What the CPU backend holds repacked for a loaded model, and how long loads took. */
+struct RepackProfile {
+    uint64_t repacked_bytes = 0;        // tensors held in CPU_REPACK buffers
+    std::vector<ggml_type> types;       // their weight types
+    std::vector<std::string> tensors;   // their names
+    int64_t cold_load_ms = -1;          // load that repacked them and wrote the sidecar
+    int64_t warm_load_ms = -1;          // latest load that mapped them from the sidecar
+};
+
+/**
+ * The repack cache for one model load on the calling thread. While the session is
+ * alive, CPU_REPACK buffers the loader allocates on this thread are mapped
+ * copy-on-write from the sidecar when it holds an image of the same size, and tensors
+ * found in the image at the same place are not repacked again. Tensors that still
+ * need repacking are converted as usual, and finish() then writes a new sidecar.
+ */
+class RepackCacheSession {
+public:
+    RepackCacheSession(const std::string& path, const std::string& key);
+    ~RepackCacheSession();
+
+    RepackCacheSession(const RepackCacheSession&) = delete;
+    RepackCacheSession& operator=(const RepackCacheSession&) = delete;
+
+    /**
+     * Once the model has loaded, and while it is alive: fill `profile`, and either
+     * record `load_ms` as the sidecar's warm load time or, when anything was repacked,
+     * write the sidecar from the loaded buffers with `load_ms` as its cold load time.
+     */
+    void finish(int64_t load_ms, RepackProfile& profile);
+
+    struct State;
+
+private:
+    std::unique_ptr<State> state_;
+};
+
+std::string repackProfileKey(const std::string& path);
+
+/**
+ * Drop the ranges of tensors held in repack buffers: their file pages are not read
+ * after load, so prefetching them only duplicates memory.
+ */
+void excludeRepackedRanges(std::vector<WeightRange>& ranges, const std::vector<std::string>& tensors);
+
+/**
+ * Which attention kernel measured faster per context size, kept in its own sidecar
+ * ("<model path>.attn") under a repackProfileKey(): the kernels depend on the same
+ * file, CPU backend and ggml version as the repacked layouts.
+ */
+struct AttentionProfile {
+    std::string key;
+    std::map<uint32_t, bool> flash_attn;  // n_ctx -> flash attention was faster
+};
+
+/** Reads the attention sidecar of `path`; false if it is missing or was written under another key. */
+bool readAttentionProfile(const std::string& path, const std::string& key, AttentionProfile& profile);
+
+bool writeAttentionProfile(const std::string& path, const AttentionProfile& profile);
@@ -0,0 +1,407 @@
+// Host tests of the engine's prompt assembly and prefix cache (engine.cpp) and of
+// TokenCache. Prompt tests need only a vocabulary, e.g. llama.cpp's vocab-only
+// models/ggml-vocab-llama-spm.gguf; the KV prefix tests decode, so they run only when
+// a full model is given as well.
+//
+//   androgpt-engine-tests vocab.gguf [model.gguf]
+//
+// Failed checks are printed to stderr; the exit status is the number of failures.
+
+#include "cpu_backend.h"
+#include "engine.h"
+
+#include "common.h"
+
+#include <unistd.h>
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            g_failures++;                                                            \
+        }                                                                            \
+    } while (0)
+
+static std::string executableDir() {
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) {
+        return ".";
+    }
+    std::string dir(path, len);
+    return dir.substr(0, dir.find_last_of('/'));
+}
+
+static const llama_vocab* vocab() {
+    return llama_model_get_vocab(g_model.get());
+}
+
+static std::vector<llama_token> tokenize(const std::string& text, bool add_special) {
+    return common_tokenize(vocab(), text, add_special);
+}
+
+static void append(std::vector<llama_token>& dst, const std::vector<llama_token>& src) {
+    dst.insert(dst.end(), src.begin(), src.end());
+}
+
+static void resetPromptState() {
+    g_window_start = -1;
+    g_history_memories.clear();
+    g_token_cache.clear();
+}
+
+static std::string messageText(int64_t id) {
+    return id % 2 ? "<|user|>Message " + std::to_string(id) + " asks about the weather in town.<|end|>\n"
+                  : "<|assistant|>Reply " + std::to_string(id) + " says it is sunny and warm.<|end|>\n";
+}
+
+/**
+ * A chat as the app sends it: an optional system prompt, history messages first_id to
+ * last_id, the pinned current message and the assistant header.
+ */
+static std::vector<PromptSegment> conversation(int64_t first_id, int64_t last_id, bool system) {
+    std::vector<PromptSegment> segments;
+    if (system) {
+        segments.push_back({"<|system|>You are a helpful assistant.<|end|>\n", -1, ROLE_SYSTEM, true});
+    }
+    for (int64_t id = first_id; id <= last_id; ++id) {
+        segments.push_back({messageText(id), id, id % 2 ? ROLE_USER : ROLE_ASSISTANT, false});
+    }
+    segments.push_back({"<|user|>And tomorrow?<|end|>\n", last_id + 1, ROLE_USER, true});
+    segments.push_back({"<|assistant|>"});
+    return segments;
+}
+
+/** Tokens of the pinned segments, the first one with BOS. */
+static size_t pinnedTokens(const std::vector<PromptSegment>& segments) {
+    size_t n = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        n += segments[i].pinned ? tokenize(segments[i].text, i == 0).size() : 0;
+    }
+    return n;
+}
+
+/** Index of the oldest history segment kept when the newest must fit in `room` tokens. */
+static size_t oldestFitting(const std::vector<PromptSegment>& segments, size_t room) {
+    size_t oldest = segments.size();
+    size_t n = 0;
+    for (size_t i = segments.size(); i-- > 0;) {
+        if (segments[i].pinned) {
+            continue;
+        }
+        n += tokenize(segments[i].text, false).size();
+        if (n > room) {
+            break;
+        }
+        oldest = i;
+    }
+    return oldest;
+}
+
+static void testCommonPrefixLength() {
+    CHECK(commonPrefixLength({}, {}) == 0);
+    CHECK(commonPrefixLength({1, 2, 3}, {}) == 0);
+    CHECK(commonPrefixLength({1, 2, 3}, {1, 2, 4}) == 2);
+    CHECK(commonPrefixLength({1, 2, 3}, {1, 2, 3}) == 3);
+    CHECK(commonPrefixLength({1, 2}, {1, 2, 3}) == 2);
+    CHECK(commonPrefixLength({5, 2, 3}, {1, 2, 3}) == 0);
+}
+
+static void testAssembleFits() {
+    resetPromptState();
+    const std::vector<PromptSegment> segments = conversation(1, 6, true);
+    const AssembledPrompt prompt = assemblePrompt(segments, 1 << 20);
+
+    std::vector<llama_token> expected;
+    CHECK(prompt.segment_ends.size() == segments.size());
+    for (size_t i = 0; i < segments.size(); ++i) {
+        append(expected, tokenize(segments[i].text, i == 0));
+        CHECK(prompt.segment_ends[i] == static_cast<int32_t>(expected.size()));
+    }
+    CHECK(prompt.tokens == expected);
+    CHECK(prompt.n_dropped == 0);
+    CHECK(prompt.n_summarized == 0);
+    CHECK(prompt.window_start == 1);
+}
+
+static void testAssembleWindow() {
+    resetPromptState();
+    const std::vector<PromptSegment> first = conversation(1, 20, true);
+    const size_t pinned = pinnedTokens(first);
+    const int budget = static_cast<int>(pinned + 10 * tokenize(messageText(1), false).size());
+
+    // A new window takes the newest history that fills half the room
+    const AssembledPrompt prompt = assemblePrompt(first, budget);
+    const size_t oldest = oldestFitting(first, (budget - pinned) / 2);
+    CHECK(oldest < first.size());
+    CHECK(prompt.window_start == first[oldest].message_id);
+    CHECK(prompt.n_dropped == oldest - 1);
+    CHECK(prompt.tokens.size() <= static_cast<size_t>(budget));
+    for (size_t i = 1; i < first.size(); ++i) {
+        CHECK((prompt.segment_ends[i] < 0) == (i < oldest));
+    }
+    std::vector<llama_token> expected = tokenize(first[0].text, true);
+    for (size_t i = oldest; i < first.size(); ++i) {
+        append(expected, tokenize(first[i].text, false));
+    }
+    CHECK(prompt.tokens == expected);
+
+    // The next turn keeps the window while it fits, so the history prefix is reused
+    g_window_start = prompt.window_start;
+    const std::vector<PromptSegment> next = conversation(1, 22, true);
+    const AssembledPrompt next_prompt = assemblePrompt(next, budget);
+    CHECK(next_prompt.window_start == prompt.window_start);
+    CHECK(commonPrefixLength(prompt.tokens, next_prompt.tokens) >=
+          static_cast<size_t>(prompt.segment_ends[first.size() - 3]));
+
+    // Once it no longer fits, the window slides to half the room again
+    g_window_start = next_prompt.window_start;
+    const std::vector<PromptSegment> later = conversation(1, 40, true);
+    const AssembledPrompt later_prompt = assemblePrompt(later, budget);
+    const size_t later_oldest = oldestFitting(later, (budget - pinnedTokens(later)) / 2);
+    CHECK(later_prompt.window_start == later[later_oldest].message_id);
+    CHECK(later_prompt.window_start > next_prompt.window_start);
+    CHECK(later_prompt.tokens.size() <= static_cast<size_t>(budget));
+}
+
+static void testAssembleMemory() {
+    resetPromptState();
+    const std::string memory = "<|system|>Summary of the earlier conversation:\nIt was sunny.<|end|>\n";
+    g_history_memories[3] = "<|system|>Summary of the earlier conversation:\nIt rained.<|end|>\n";
+    g_history_memories[5] = memory;
+
+    // The newest memory replaces its message and all history before it
+    const std::vector<PromptSegment> segments = conversation(1, 10, true);
+    const AssembledPrompt prompt = assemblePrompt(segments, 1 << 20);
+    CHECK(prompt.n_summarized == 5);
+    CHECK(prompt.n_dropped == 0);
+    CHECK(prompt.window_start == 6);
+    for (size_t i = 1; i < 5; ++i) {
+        CHECK(prompt.segment_ends[i] == -1);
+    }
+
+    std::vector<llama_token> expected = tokenize(segments[0].text, true);
+    append(expected, tokenize(memory, false));
+    CHECK(prompt.segment_ends[5] == static_cast<int32_t>(expected.size()));
+    for (size_t i = 6; i < segments.size(); ++i) {
+        append(expected, tokenize(segments[i].text, false));
+    }
+    CHECK(prompt.tokens == expected);
+}
+
+static size_t countBos(const std::vector<llama_token>& tokens) {
+    size_t n = 0;
+    for (const llama_token token : tokens) {
+        n += token == llama_vocab_bos(vocab());
+    }
+    return n;
+}
+
+static void testAssembleBos() {
+    if (!llama_vocab_get_add_bos(vocab())) {
+        fprintf(stderr, "vocabulary adds no BOS token, skipping BOS tests\n");
+        return;
+    }
+
+    // Without a system prompt the oldest kept history segment carries BOS
+    resetPromptState();
+    const std::vector<PromptSegment> segments = conversation(1, 20, false);
+    const int budget = static_cast<int>(pinnedTokens(segments) + 8 * tokenize(messageText(1), false).size());
+    const AssembledPrompt prompt = assemblePrompt(segments, budget);
+    CHECK(prompt.n_dropped > 0);
+    size_t first = 0;
+    while (first < segments.size() && prompt.segment_ends[first] < 0) {
+        first++;
+    }
+    CHECK(first < segments.size() && segments[first].message_id == prompt.window_start);
+    if (first < segments.size()) {
+        const std::vector<llama_token> head = tokenize(segments[first].text, true);
+        CHECK(prompt.tokens.size() >= head.size() &&
+              std::vector<llama_token>(prompt.tokens.begin(), prompt.tokens.begin() + head.size()) == head);
+    }
+    CHECK(countBos(prompt.tokens) == 1);
+
+    // ... and a memory that comes first carries it too
+    resetPromptState();
+    const std::string memory = "<|system|>Summary of the earlier conversation:\nIt was sunny.<|end|>\n";
+    g_history_memories[4] = memory;
+    const AssembledPrompt memory_prompt = assemblePrompt(segments, 1 << 20);
+    const std::vector<llama_token> head = tokenize(memory, true);
+    CHECK(memory_prompt.segment_ends[3] == static_cast<int32_t>(head.size()));
+    CHECK(std::vector<llama_token>(memory_prompt.tokens.begin(), memory_prompt.tokens.begin() + head.size()) == head);
+    CHECK(countBos(memory_prompt.tokens) == 1);
+}
+
+static void testTokenCacheEviction() {
+    const uint64_t hash = vocabHash(vocab());
+    const std::string texts[] = {
+        messageText(1),
+        messageText(2),
+        messageText(3),
+        messageText(4) + " It stays warm all week.",
+    };
+    size_t sizes[4];
+    for (int i = 0; i < 4; ++i) {
+        sizes[i] = tokenize(texts[i], false).size();
+    }
+
+    // Room for messages 1, 3 and 4: adding 4 drops 2, the least recently used
+    TokenCache cache(sizes[0] + sizes[2] + sizes[3]);
+    for (int i = 0; i < 3; ++i) {
+        CHECK(cache.tokenize(vocab(), hash, texts[i], i + 1, ROLE_USER, false) == tokenize(texts[i], false));
+    }
+    CHECK(cache.stats().misses == 3);
+    cache.tokenize(vocab(), hash, texts[0], 1, ROLE_USER, false);
+    CHECK(cache.stats().hits == 1);
+    cache.tokenize(vocab(), hash, texts[3], 4, ROLE_USER, false);
+    CHECK(cache.stats().entries == 3);
+    CHECK(cache.stats().tokens == sizes[0] + sizes[2] + sizes[3]);
+
+    const TokenCache::Stats before = cache.stats();
+    cache.tokenize(vocab(), hash, texts[0], 1, ROLE_USER, false);
+    cache.tokenize(vocab(), hash, texts[2], 3, ROLE_USER, false);
+    CHECK(cache.stats().hits == before.hits + 2);
+    cache.tokenize(vocab(), hash, texts[1], 2, ROLE_USER, false);
+    CHECK(cache.stats().misses == before.misses + 1);
+
+    // An edited message is tokenized again under the same id
+    const uint64_t misses = cache.stats().misses;
+    CHECK(cache.tokenize(vocab(), hash, texts[3], 1, ROLE_USER, false) == tokenize(texts[3], false));
+    CHECK(cache.stats().misses == misses + 1);
+
+    // An entry larger than the limit is kept until the next one arrives
+    TokenCache tiny(1);
+    tiny.tokenize(vocab(), hash, texts[0], 1, ROLE_USER, false);
+    CHECK(tiny.stats().entries == 1);
+    tiny.tokenize(vocab(), hash, texts[1], 2, ROLE_USER, false);
+    CHECK(tiny.stats().entries == 1);
+    CHECK(tiny.stats().tokens == sizes[1]);
+}
+
+static llama_pos mainPosMax() {
+    return llama_memory_seq_pos_max(llama_get_memory(g_ctx), SEQ_MAIN);
+}
+
+static void testReuseCachedPrefix() {
+    const std::vector<llama_token> a = tokenize("The quick brown fox jumps over the lazy dog.", true);
+    std::vector<llama_token> b(a.begin(), a.begin() + a.size() / 2);
+    append(b, tokenize(" A slow green turtle walks under the busy bridge.", false));
+    const size_t n_common = commonPrefixLength(a, b);
+    llama_batch batch = llama_batch_init(llama_n_batch(g_ctx), 0, 1);
+
+    resetSession();
+    CHECK(reuseCachedPrefix(a) == 0);
+    CHECK(decodePrompt(batch, a, 0));
+    CHECK(g_session.tokens == a);
+
+    // Only the shared prefix stays in the main sequence
+    CHECK(reuseCachedPrefix(b) == n_common);
+    CHECK(g_session.tokens.size() == n_common);
+    CHECK(mainPosMax() == static_cast<llama_pos>(n_common) - 1);
+    CHECK(decodePrompt(batch, b, n_common));
+
+    // The same prompt again still decodes its last token for the logits
+    CHECK(reuseCachedPrefix(b) == b.size() - 1);
+    CHECK(mainPosMax() == static_cast<llama_pos>(b.size()) - 2);
+    CHECK(decodePrompt(batch, b, b.size() - 1));
+
+    // Tokens decoded under other adapters match nothing
+    g_lora_key = "other.gguf=1.0";
+    CHECK(reuseCachedPrefix(b) == 0);
+    CHECK(mainPosMax() == -1);
+    g_lora_key.clear();
+
+    // The stash is restored when it matches further than the main sequence
+    resetSession();
+    reuseCachedPrefix(a);
+    CHECK(decodePrompt(batch, a, 0));
+    llama_memory_seq_cp(llama_get_memory(g_ctx), SEQ_MAIN, SEQ_STASH, -1, -1);
+    g_stash.tokens = a;
+    g_stash.lora_key = g_lora_key;
+    CHECK(reuseCachedPrefix(b) == n_common);
+
+    std::vector<llama_token> longer = a;
+    append(longer, tokenize(" Again.", false));
+    CHECK(reuseCachedPrefix(longer) == a.size());
+    CHECK(g_session.tokens == a);
+    CHECK(g_stash.tokens.empty());
+    CHECK(mainPosMax() == static_cast<llama_pos>(a.size()) - 1);
+    CHECK(llama_memory_seq_pos_max(llama_get_memory(g_ctx), SEQ_STASH) == -1);
+
+    resetSession();
+    llama_batch_free(batch);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s vocab.gguf [model.gguf]\n", argv[0]);
+        return 2;
+    }
+
+    const char* forced = getenv("ANDROGPT_CPU_VARIANT");
+    CpuBackendInfo cpu;
+    if (!loadCpuBackend(executableDir(), forced ? forced : "", cpu)) {
+        fprintf(stderr, "no CPU backend variant could be loaded\n");
+        return 1;
+    }
+    llama_backend_init();
+
+    testCommonPrefixLength();
+
+    llama_model_params vocab_params = llama_model_default_params();
+    vocab_params.vocab_only = true;
+    llama_model* vocab_model = llama_model_load_from_file(argv[1], vocab_params);
+    if (vocab_model == nullptr) {
+        fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    g_model = makeModelHandle(vocab_model);
+    testAssembleFits();
+    testAssembleWindow();
+    testAssembleMemory();
+    testAssembleBos();
+    testTokenCacheEviction();
+    resetPromptState();
+    g_model.reset();
+
+    if (argc == 3) {
+        llama_model* model = llama_model_load_from_file(argv[2], llama_model_default_params());
+        if (model == nullptr) {
+            fprintf(stderr, "failed to load %s\n", argv[2]);
+            return 1;
+        }
+        g_model = makeModelHandle(model);
+
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx = 512;
+        cparams.n_batch = 512;
+        cparams.n_seq_max = SEQ_MAX;
+        cparams.kv_unified = true;
+        g_ctx = llama_init_from_model(model, cparams);
+        if (g_ctx == nullptr) {
+            fprintf(stderr, "failed to create context\n");
+            g_model.reset();
+            return 1;
+        }
+        testReuseCachedPrefix();
+        llama_free(g_ctx);
+        g_ctx = nullptr;
+        g_model.reset();
+    } else {
+        fprintf(stderr, "no model given, skipping KV prefix tests\n");
+    }
+
+    llama_backend_free();
+    if (g_failures > 0) {
+        fprintf(stderr, "%d checks failed\n", g_failures);
+    }
+    return g_failures;
+}
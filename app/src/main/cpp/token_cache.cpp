@@ -0,0 +1,220 @@
+#include "token_cache.h"
+
+#include "common.h"
+
+#include <cstdio>
+#include <cstring>
+
+#define LOG_TAG "TokenCache"
+#include "engine_log.h"
+
+static constexpr uint32_t FILE_MAGIC = 0x43544741;  // "AGTC"
+static constexpr uint32_t FILE_VERSION = 1;
+
+// Records a sidecar may hold per live entry before save() rewrites it
+static constexpr size_t MAX_STALE_RATIO = 2;
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+uint64_t vocabHash(const llama_vocab* vocab) {
+    const int32_t n_tokens = llama_vocab_n_tokens(vocab);
+    uint64_t hash = fnv1a(&n_tokens, sizeof(n_tokens));
+    for (llama_token id = 0; id < n_tokens; ++id) {
+        const char* text = llama_vocab_get_text(vocab, id);
+        hash = fnv1a(text, strlen(text) + 1, hash);
+    }
+    return hash;
+}
+
+size_t TokenCache::KeyHash::operator()(const Key& key) const {
+    uint64_t hash = fnv1a(&key.vocab, sizeof(key.vocab));
+    hash = fnv1a(&key.message_id, sizeof(key.message_id), hash);
+    hash = fnv1a(&key.role, sizeof(key.role), hash);
+    hash = fnv1a(&key.add_special, sizeof(key.add_special), hash);
+    return static_cast<size_t>(fnv1a(&key.text_hash, sizeof(key.text_hash), hash));
+}
+
+TokenCache::TokenCache(size_t max_tokens) : max_tokens_(max_tokens) {}
+
+const std::vector<llama_token>& TokenCache::tokenize(const llama_vocab* vocab, uint64_t vocab_hash,
+                                                     const std::string& text, int64_t message_id, int32_t role,
+                                                     bool add_special) {
+    const uint64_t text_hash = fnv1a(text.data(), text.size());
+    const Key key{vocab_hash, message_id, role, add_special, message_id < 0 ? text_hash : 0};
+
+    auto found = index_.find(key);
+    if (found != index_.end() && found->second->text_hash == text_hash) {
+        hits_++;
+        lru_.splice(lru_.begin(), lru_, found->second);
+        return lru_.front().tokens;
+    }
+
+    misses_++;
+    insert(Entry{key, text_hash, common_tokenize(vocab, text, add_special), false});
+    return lru_.front().tokens;
+}
+
+void TokenCache::insert(Entry entry) {
+    auto found = index_.find(entry.key);
+    if (found != index_.end()) {
+        n_tokens_ -= found->second->tokens.size();
+        lru_.erase(found->second);
+    }
+    n_tokens_ += entry.tokens.size();
+    lru_.push_front(std::move(entry));
+    index_[lru_.front().key] = lru_.begin();
+
+    // The entry just added stays even if it alone is over the limit
+    while (n_tokens_ > max_tokens_ && lru_.size() > 1) {
+        n_tokens_ -= lru_.back().tokens.size();
+        index_.erase(lru_.back().key);
+        lru_.pop_back();
+    }
+}
+
+static bool writeRecord(FILE* file, uint64_t vocab, int64_t message_id, int32_t role, bool add_special,
+                        uint64_t text_hash, const std::vector<llama_token>& tokens) {
+    const uint8_t special = add_special ? 1 : 0;
+    const uint32_t n = static_cast<uint32_t>(tokens.size());
+    return fwrite(&vocab, sizeof(vocab), 1, file) == 1 &&
+           fwrite(&message_id, sizeof(message_id), 1, file) == 1 &&
+           fwrite(&role, sizeof(role), 1, file) == 1 &&
+           fwrite(&special, sizeof(special), 1, file) == 1 &&
+           fwrite(&text_hash, sizeof(text_hash), 1, file) == 1 &&
+           fwrite(&n, sizeof(n), 1, file) == 1 &&
+           fwrite(tokens.data(), sizeof(llama_token), n, file) == n;
+}
+
+bool TokenCache::load(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    uint32_t header[2] = {0, 0};
+    if (fread(header, sizeof(header), 1, file) != 1 || header[0] != FILE_MAGIC || header[1] != FILE_VERSION) {
+        LOGW("Ignoring token cache %s with unknown format", path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    // Records are in save order, so replaying them leaves the latest one per key and
+    // the newest entries most recently used. A torn last record is dropped.
+    size_t n_records = 0;
+    bool torn = false;
+    while (true) {
+        Entry entry{};
+        uint8_t special = 0;
+        uint32_t n = 0;
+        if (fread(&entry.key.vocab, sizeof(entry.key.vocab), 1, file) != 1) {
+            torn = !feof(file);
+            break;
+        }
+        torn = true;
+        if (fread(&entry.key.message_id, sizeof(entry.key.message_id), 1, file) != 1 ||
+            fread(&entry.key.role, sizeof(entry.key.role), 1, file) != 1 ||
+            fread(&special, sizeof(special), 1, file) != 1 ||
+            fread(&entry.text_hash, sizeof(entry.text_hash), 1, file) != 1 ||
+            fread(&n, sizeof(n), 1, file) != 1) {
+            break;
+        }
+        entry.tokens.resize(n);
+        if (fread(entry.tokens.data(), sizeof(llama_token), n, file) != n) {
+            break;
+        }
+        torn = false;
+        entry.key.add_special = special != 0;
+        entry.key.text_hash = 0;
+        entry.saved = true;
+        insert(std::move(entry));
+        n_records++;
+    }
+    fclose(file);
+
+    // Appending after a torn record would misalign every later one, rewrite instead
+    saved_path_ = torn ? "" : path;
+    file_records_ = n_records;
+    LOGI("Loaded %zu cached segments (%zu tokens) from %s", lru_.size(), n_tokens_, path.c_str());
+    return true;
+}
+
+bool TokenCache::rewrite(const std::string& path) {
+    // Write then rename, so a crash never leaves a half-written cache behind
+    const std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (file == nullptr) {
+        LOGW("Cannot write %s", tmp.c_str());
+        return false;
+    }
+    const uint32_t header[2] = {FILE_MAGIC, FILE_VERSION};
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+    size_t n_records = 0;
+    for (auto it = lru_.rbegin(); ok && it != lru_.rend(); ++it) {
+        if (it->key.message_id < 0) {
+            continue;
+        }
+        ok = writeRecord(file, it->key.vocab, it->key.message_id, it->key.role, it->key.add_special,
+                         it->text_hash, it->tokens);
+        n_records++;
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+
+    for (Entry& entry : lru_) {
+        entry.saved = true;
+    }
+    saved_path_ = path;
+    file_records_ = n_records;
+    return true;
+}
+
+bool TokenCache::save(const std::string& path) {
+    size_t n_messages = 0;
+    for (const Entry& entry : lru_) {
+        n_messages += entry.key.message_id >= 0 ? 1 : 0;
+    }
+    if (path != saved_path_ || file_records_ > MAX_STALE_RATIO * n_messages) {
+        return rewrite(path);
+    }
+
+    FILE* file = fopen(path.c_str(), "ab");
+    if (file == nullptr) {
+        LOGW("Cannot append to %s", path.c_str());
+        return false;
+    }
+    bool ok = true;
+    for (auto it = lru_.rbegin(); ok && it != lru_.rend(); ++it) {
+        if (it->saved || it->key.message_id < 0) {
+            continue;
+        }
+        ok = writeRecord(file, it->key.vocab, it->key.message_id, it->key.role, it->key.add_special,
+                         it->text_hash, it->tokens);
+        it->saved = ok;
+        file_records_ += ok ? 1 : 0;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+void TokenCache::clear() {
+    lru_.clear();
+    index_.clear();
+    n_tokens_ = 0;
+}
+
+TokenCache::Stats TokenCache::stats() const {
+    Stats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.entries = lru_.size();
+    stats.tokens = n_tokens_;
+    return stats;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Token ids of prompt segments, so history that did not change since the last turn is
+ * never tokenized again. Segments of stored messages are keyed by the vocabulary, the
+ * message id and its role, and checked against a hash of their text so an edited
+ * message is tokenized afresh. Other segments (system prompt, template text) are keyed
+ * by their text. Least recently used entries are dropped past a token limit.
+ *
+ * Message entries can be persisted to a sidecar file: save() appends the entries added
+ * since the last save and rewrites the file once it is mostly stale. Not thread safe.
+ */
+class TokenCache {
+public:
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t entries = 0;
+        size_t tokens = 0;
+    };
+
+    explicit TokenCache(size_t max_tokens);
+
+    /**
+     * Tokens of `text` (role and message id < 0 when it is not a stored message),
+     * tokenized with `add_special` on a miss. `vocab_hash` is vocabHash(vocab).
+     * The reference is valid until the next call.
+     */
+    const std::vector<llama_token>& tokenize(const llama_vocab* vocab, uint64_t vocab_hash,
+                                             const std::string& text, int64_t message_id, int32_t role,
+                                             bool add_special);
+
+    /** Read a sidecar written by save(); entries for other vocabularies load too. */
+    bool load(const std::string& path);
+
+    /** Append message entries added since the last load() or save() of `path`. */
+    bool save(const std::string& path);
+
+    void clear();
+
+    Stats stats() const;
+
+private:
+    struct Key {
+        uint64_t vocab;
+        int64_t message_id;
+        int32_t role;
+        bool add_special;
+        uint64_t text_hash;  // only for segments that are not messages
+
+        bool operator==(const Key& other) const {
+            return vocab == other.vocab && message_id == other.message_id && role == other.role &&
+                   add_special == other.add_special && text_hash == other.text_hash;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        uint64_t text_hash;
+        std::vector<llama_token> tokens;
+        bool saved;
+    };
+
+    void insert(Entry entry);
+    bool rewrite(const std::string& path);
+
+    size_t max_tokens_;
+    size_t n_tokens_ = 0;
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+    std::string saved_path_;
+    size_t file_records_ = 0;  // records in saved_path_, live or not
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+/** Fingerprint of a vocabulary's token texts, one pass over the vocab. */
+uint64_t vocabHash(const llama_vocab* vocab);
@@ -0,0 +1,273 @@
+// Latency and throughput benchmark of the app's generation path (engine.cpp) on a host
+// or device. Every prompt runs on an empty KV cache with greedy sampling; the first
+// pass over the prompt set is untimed. Results go to stdout as JSON, logs to stderr.
+//
+//   androgpt-bench -m model.gguf [-f prompts.txt] [-t threads] [-c ctx] [-n max_tokens] [-r reps]
+//
+// The prompt file holds one prompt per line. TTFT runs from the request until the first
+// token's text is available; per-token latency is the time between consecutive tokens.
+
+#include "cpu_backend.h"
+#include "engine.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+static const char* const DEFAULT_PROMPTS[] = {
+    "Explain in a few sentences why the sky is blue.",
+    "Write a Python function that returns the n-th Fibonacci number.",
+    "Summarize the plot of Romeo and Juliet for a ten year old.",
+    "List five tips for writing clear commit messages.",
+};
+
+struct BenchOptions {
+    std::string model;
+    std::string prompt_file;
+    int threads = 4;
+    int n_ctx = 2048;
+    int max_tokens = 128;
+    int reps = 1;
+};
+
+struct RunResult {
+    size_t prompt = 0;
+    size_t n_prompt = 0;
+    int n_generated = 0;
+    double ttft_ms = 0.0;
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+};
+
+static bool parseArgs(int argc, char** argv, BenchOptions& opts) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char* flag = argv[i];
+        const char* value = argv[i + 1];
+        if (strcmp(flag, "-m") == 0) {
+            opts.model = value;
+        } else if (strcmp(flag, "-f") == 0) {
+            opts.prompt_file = value;
+        } else if (strcmp(flag, "-t") == 0) {
+            opts.threads = atoi(value);
+        } else if (strcmp(flag, "-c") == 0) {
+            opts.n_ctx = atoi(value);
+        } else if (strcmp(flag, "-n") == 0) {
+            opts.max_tokens = atoi(value);
+        } else if (strcmp(flag, "-r") == 0) {
+            opts.reps = atoi(value);
+        } else {
+            return false;
+        }
+    }
+    return !opts.model.empty() && opts.threads > 0 && opts.n_ctx > 0 &&
+           opts.max_tokens > 0 && opts.reps > 0;
+}
+
+static std::string executableDir() {
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) {
+        return ".";
+    }
+    std::string dir(path, len);
+    return dir.substr(0, dir.find_last_of('/'));
+}
+
+static bool readPrompts(const std::string& path, std::vector<std::string>& prompts) {
+    if (path.empty()) {
+        prompts.assign(std::begin(DEFAULT_PROMPTS), std::end(DEFAULT_PROMPTS));
+        return true;
+    }
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            prompts.push_back(line);
+        }
+    }
+    return !prompts.empty();
+}
+
+// Nearest-rank percentile of sorted values
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t rank = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size()) + 0.5);
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+static std::string jsonString(const std::string& value) {
+    std::string out = "\"";
+    for (const char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+/**
+ * One prompt on an empty cache. Token arrival times are appended to `latencies_ms`
+ * from the second token on. Returns false when the prompt could not be decoded.
+ */
+static bool runPrompt(const GenerationRequest& request, RunResult& result, std::vector<double>& latencies_ms) {
+    resetSession();
+
+    const int64_t t_start_us = ggml_time_us();
+    int64_t t_last_us = 0;
+    GenerationStats stats;
+    const int n_decode = generate(request, nullptr, [&](const std::string& /* piece */) {
+        const int64_t now_us = ggml_time_us();
+        if (t_last_us == 0) {
+            result.ttft_ms = (now_us - t_start_us) / 1e3;
+        } else {
+            latencies_ms.push_back((now_us - t_last_us) / 1e3);
+        }
+        t_last_us = now_us;
+        return true;
+    }, &stats);
+    if (n_decode < 0) {
+        return false;
+    }
+
+    result.n_prompt = stats.n_prompt;
+    result.n_generated = stats.n_generated;
+    result.prefill_tps = 1e6 * (stats.n_prompt - stats.n_reused) / std::max<int64_t>(stats.t_prefill_us, 1);
+    result.decode_tps = 1e6 * stats.n_generated / std::max<int64_t>(stats.t_decode_us, 1);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opts;
+    std::vector<std::string> prompts;
+    if (!parseArgs(argc, argv, opts)) {
+        fprintf(stderr, "usage: %s -m model.gguf [-f prompts.txt] [-t threads] [-c ctx] "
+                        "[-n max_tokens] [-r reps]\n", argv[0]);
+        return 2;
+    }
+    if (!readPrompts(opts.prompt_file, prompts)) {
+        fprintf(stderr, "no prompts in %s\n", opts.prompt_file.c_str());
+        return 2;
+    }
+
+    const char* forced = getenv("ANDROGPT_CPU_VARIANT");
+    CpuBackendInfo cpu;
+    if (!loadCpuBackend(executableDir(), forced ? forced : "", cpu)) {
+        fprintf(stderr, "no CPU backend variant could be loaded\n");
+        return 1;
+    }
+    llama_backend_init();
+
+    llama_model* model = llama_model_load_from_file(opts.model.c_str(), llama_model_default_params());
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load %s\n", opts.model.c_str());
+        return 1;
+    }
+    g_model = makeModelHandle(model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = opts.n_ctx;
+    cparams.n_batch = std::min(opts.n_ctx, 512);
+    cparams.n_threads = opts.threads;
+    cparams.n_threads_batch = opts.threads;
+    cparams.n_seq_max = SEQ_MAX;
+    cparams.kv_unified = true;
+    g_ctx = llama_init_from_model(model, cparams);
+    if (g_ctx == nullptr) {
+        fprintf(stderr, "failed to create context\n");
+        g_model.reset();
+        return 1;
+    }
+
+    GenerationRequest request;
+    request.max_tokens = opts.max_tokens;
+    request.top_k = 1;  // greedy, so every repetition does the same work
+
+    std::vector<RunResult> runs;
+    std::vector<double> latencies_ms;
+    bool ok = true;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        // Repetition 0 pages in weights and allocates compute buffers; it is not timed
+        for (int rep = 0; ok && rep <= opts.reps; ++rep) {
+            for (size_t p = 0; ok && p < prompts.size(); ++p) {
+                request.segments = {PromptSegment{prompts[p]}};
+                RunResult result;
+                std::vector<double> run_latencies;
+                ok = runPrompt(request, result, run_latencies);
+                if (ok && rep > 0) {
+                    result.prompt = p;
+                    runs.push_back(result);
+                    latencies_ms.insert(latencies_ms.end(), run_latencies.begin(), run_latencies.end());
+                }
+            }
+        }
+        resetSession();
+    }
+
+    llama_free(g_ctx);
+    g_ctx = nullptr;
+    g_model.reset();
+    llama_backend_free();
+    if (!ok) {
+        fprintf(stderr, "failed to decode prompt\n");
+        return 1;
+    }
+
+    std::vector<double> ttft_ms;
+    size_t n_prefill = 0;
+    size_t n_decode = 0;
+    double t_prefill_s = 0.0;
+    double t_decode_s = 0.0;
+    for (const RunResult& run : runs) {
+        ttft_ms.push_back(run.ttft_ms);
+        n_prefill += run.n_prompt;
+        n_decode += run.n_generated;
+        t_prefill_s += run.n_prompt / std::max(run.prefill_tps, 1e-9);
+        t_decode_s += run.n_generated / std::max(run.decode_tps, 1e-9);
+    }
+    std::sort(ttft_ms.begin(), ttft_ms.end());
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+
+    printf("{\n");
+    printf("  \"model\": %s,\n", jsonString(opts.model).c_str());
+    printf("  \"cpu_variant\": %s,\n", jsonString(cpu.variant).c_str());
+    printf("  \"threads\": %d,\n  \"n_ctx\": %d,\n  \"max_tokens\": %d,\n  \"reps\": %d,\n",
+           opts.threads, opts.n_ctx, opts.max_tokens, opts.reps);
+    printf("  \"prefill_tps\": %.2f,\n", n_prefill / std::max(t_prefill_s, 1e-9));
+    printf("  \"decode_tps\": %.2f,\n", n_decode / std::max(t_decode_s, 1e-9));
+    printf("  \"ttft_ms\": {\"p50\": %.2f, \"p90\": %.2f, \"max\": %.2f},\n",
+           percentile(ttft_ms, 50), percentile(ttft_ms, 90), ttft_ms.empty() ? 0.0 : ttft_ms.back());
+    printf("  \"token_latency_ms\": {\"count\": %zu, \"p50\": %.2f, \"p90\": %.2f, \"p95\": %.2f, \"p99\": %.2f, \"max\": %.2f},\n",
+           latencies_ms.size(), percentile(latencies_ms, 50), percentile(latencies_ms, 90),
+           percentile(latencies_ms, 95), percentile(latencies_ms, 99),
+           latencies_ms.empty() ? 0.0 : latencies_ms.back());
+    printf("  \"runs\": [\n");
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const RunResult& run = runs[i];
+        printf("    {\"prompt\": %zu, \"n_prompt\": %zu, \"n_generated\": %d, \"ttft_ms\": %.2f, "
+               "\"prefill_tps\": %.2f, \"decode_tps\": %.2f}%s\n",
+               run.prompt, run.n_prompt, run.n_generated, run.ttft_ms, run.prefill_tps, run.decode_tps,
+               i + 1 < runs.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Host check of CPU backend dispatch: scores the libggml-cpu-*.so variants next to
+// this binary (or in argv[1]), loads the best one (or the one named in argv[2]) the
+// same way the app does, and runs a small quantized matmul through it.
+//
+//   cpu-variant-probe [dir] [variant]
+
+#include "cpu_backend.h"
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#include <unistd.h>
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static std::string executableDir() {
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) {
+        return ".";
+    }
+    std::string dir(path, len);
+    return dir.substr(0, dir.find_last_of('/'));
+}
+
+/**
+ * Q8_0 weights times F32 activations goes through the variant's vec_dot kernels
+ * (dotprod / i8mm / AVX2 / AVX-512 paths); the result is compared with a float
+ * reference, which the quantization error keeps within a few percent.
+ */
+static bool runMatmul() {
+    const int k = 256, m = 64, n = 8;
+
+    ggml_backend_dev_t dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_t backend = dev ? ggml_backend_dev_init(dev, nullptr) : nullptr;
+    if (backend == nullptr) {
+        fprintf(stderr, "CPU backend could not be initialized\n");
+        return false;
+    }
+
+    ggml_init_params params = { 4 * ggml_tensor_overhead() + ggml_graph_overhead(), nullptr, true };
+    ggml_context* ctx = ggml_init(params);
+    ggml_tensor* a = ggml_new_tensor_2d(ctx, GGML_TYPE_Q8_0, k, m);
+    ggml_tensor* b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+    ggml_tensor* c = ggml_mul_mat(ctx, a, b);
+    ggml_cgraph* graph = ggml_new_graph(ctx);
+    ggml_build_forward_expand(graph, c);
+    ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
+
+    std::vector<float> wa(k * m), wb(k * n);
+    for (size_t i = 0; i < wa.size(); ++i) {
+        wa[i] = std::sin(0.37f * i);
+    }
+    for (size_t i = 0; i < wb.size(); ++i) {
+        wb[i] = std::cos(0.11f * i);
+    }
+    std::vector<uint8_t> qa(ggml_nbytes(a));
+    ggml_quantize_chunk(GGML_TYPE_Q8_0, wa.data(), qa.data(), 0, m, k, nullptr);
+    ggml_backend_tensor_set(a, qa.data(), 0, qa.size());
+    ggml_backend_tensor_set(b, wb.data(), 0, wb.size() * sizeof(float));
+
+    const int64_t t_start_us = ggml_time_us();
+    const bool computed = ggml_backend_graph_compute(backend, graph) == GGML_STATUS_SUCCESS;
+    const int64_t t_compute_us = ggml_time_us() - t_start_us;
+
+    std::vector<float> out(m * n);
+    ggml_backend_tensor_get(c, out.data(), 0, out.size() * sizeof(float));
+    float max_err = 0.0f;
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < m; ++i) {
+            float ref = 0.0f;
+            for (int l = 0; l < k; ++l) {
+                ref += wa[i * k + l] * wb[j * k + l];
+            }
+            max_err = std::fmax(max_err, std::fabs(out[j * m + i] - ref) / (std::fabs(ref) + 1.0f));
+        }
+    }
+
+    ggml_backend_buffer_free(buffer);
+    ggml_free(ctx);
+    ggml_backend_free(backend);
+
+    printf("matmul %dx%dx%d: %s, max relative error %.4f, %lld us\n", m, n, k,
+           computed ? "computed" : "failed", max_err, (long long) t_compute_us);
+    return computed && max_err < 0.05f;
+}
+
+int main(int argc, char** argv) {
+    ggml_time_init();
+    const std::string dir = argc > 1 ? argv[1] : executableDir();
+    const std::string forced = argc > 2 ? argv[2] : "";
+
+    CpuBackendInfo info;
+    const bool loaded = loadCpuBackend(dir, forced, info);
+    for (const CpuVariant& variant : info.candidates) {
+        printf("%-24s score %d\n", variant.name.c_str(), variant.score);
+    }
+    if (!loaded) {
+        fprintf(stderr, "no CPU backend variant in %s could be loaded\n", dir.c_str());
+        return 1;
+    }
+    printf("loaded %s (%s)\n", info.variant.c_str(), cpuBackendFeatures().c_str());
+    if (!forced.empty() && forced != info.variant) {
+        printf("%s is not supported here, fell back to %s\n", forced.c_str(), info.variant.c_str());
+    }
+    return runMatmul() ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+#!/usr/bin/env bash
+# Profile-guided optimization of the native libraries.
+#
+# Builds the native code three times and runs the same fixed workload
+# (androgpt-pgo-train: prefill and greedy decode on one small GGUF) on each:
+#   baseline      the default -O3 flags
+#   instrumented  ANDROGPT_PGO=GENERATE; its raw profiles are merged into
+#                 pgo/<abi>.profdata with llvm-profdata
+#   optimized     ANDROGPT_LTO=ON ANDROGPT_PGO=USE
+# then prints prefill and decode throughput of the optimized build against the baseline.
+#
+#   tools/pgo.sh model.gguf                       # this host (clang required)
+#   tools/pgo.sh model.gguf --android arm64-v8a   # a device over adb; needs ANDROID_NDK
+#
+# Use the same pinned model for every run so profiles and numbers stay comparable.
+# THREADS, PROMPT, DECODE and REPS override the workload size; ANDROGPT_CPU_VARIANT
+# trains a specific CPU variant instead of the best one. The app uses the profile with
+#   ./gradlew assembleRelease -Pandrogpt.lto=true -Pandrogpt.pgo=true
+set -euo pipefail
+
+SRC_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+MODEL="${1:?usage: $0 model.gguf [--android <abi>]}"
+ABI=""
+if [[ "${2:-}" == "--android" ]]; then
+    ABI="${3:?--android needs an ABI, e.g. arm64-v8a}"
+fi
+
+THREADS="${THREADS:-4}"
+PROMPT="${PROMPT:-256}"
+DECODE="${DECODE:-64}"
+REPS="${REPS:-5}"
+BUILD_ROOT="${BUILD_ROOT:-$SRC_DIR/build-pgo}"
+DEVICE_DIR=/data/local/tmp/androgpt-pgo
+
+CMAKE_ARGS=(-DCMAKE_BUILD_TYPE=Release -DANDROGPT_TOOLS=ON)
+if [[ -n "$ABI" ]]; then
+    : "${ANDROID_NDK:?set ANDROID_NDK to the NDK root}"
+    TOOLCHAIN_BIN="$(echo "$ANDROID_NDK"/toolchains/llvm/prebuilt/*/bin)"
+    PROFDATA="${LLVM_PROFDATA:-$TOOLCHAIN_BIN/llvm-profdata}"
+    case "$ABI" in
+        arm64-v8a)   TRIPLE=aarch64-linux-android ;;
+        armeabi-v7a) TRIPLE=arm-linux-androideabi ;;
+        x86_64)      TRIPLE=x86_64-linux-android ;;
+        *) echo "unsupported ABI $ABI" >&2; exit 2 ;;
+    esac
+    LIBCXX="$TOOLCHAIN_BIN/../sysroot/usr/lib/$TRIPLE/libc++_shared.so"
+    CMAKE_ARGS+=(
+        -DCMAKE_TOOLCHAIN_FILE="$ANDROID_NDK/build/cmake/android.toolchain.cmake"
+        -DANDROID_ABI="$ABI"
+        -DANDROID_PLATFORM=android-29
+        -DANDROID_STL=c++_shared
+    )
+    ARCH="$ABI"
+else
+    export CC="${CC:-clang}" CXX="${CXX:-clang++}"
+    PROFDATA="${LLVM_PROFDATA:-llvm-profdata}"
+    ARCH="$(uname -m)"
+fi
+PROFILE="$SRC_DIR/pgo/$ARCH.profdata"
+
+build() {
+    local name="$1"; shift
+    cmake -S "$SRC_DIR" -B "$BUILD_ROOT/$name" "${CMAKE_ARGS[@]}" "$@" >/dev/null
+    cmake --build "$BUILD_ROOT/$name" --target androgpt-pgo-train -j"$(nproc)" >/dev/null
+}
+
+# Runs the workload from build $1 and prints its summary line; raw profiles, if the
+# build is instrumented, land in $BUILD_ROOT/$1/profraw
+run() {
+    local name="$1" dir="$BUILD_ROOT/$1"
+    local args=(-m "$MODEL" -t "$THREADS" -p "$PROMPT" -n "$DECODE" -r "$REPS")
+    local variant="${ANDROGPT_CPU_VARIANT:-}"
+    rm -rf "$dir/profraw" && mkdir -p "$dir/profraw"
+    if [[ -n "$ABI" ]]; then
+        adb shell "rm -rf $DEVICE_DIR/bin $DEVICE_DIR/profraw && mkdir -p $DEVICE_DIR/bin $DEVICE_DIR/profraw"
+        adb push "$dir"/androgpt-pgo-train "$dir"/*.so "$LIBCXX" "$DEVICE_DIR/bin/" >/dev/null
+        if ! adb shell "test -f $DEVICE_DIR/$(basename "$MODEL")"; then
+            adb push "$MODEL" "$DEVICE_DIR/" >/dev/null
+        fi
+        args[1]="$DEVICE_DIR/$(basename "$MODEL")"
+        adb shell "cd $DEVICE_DIR/bin && LD_LIBRARY_PATH=. ANDROGPT_CPU_VARIANT=$variant \
+            LLVM_PROFILE_FILE=$DEVICE_DIR/profraw/%m-%p.profraw ./androgpt-pgo-train ${args[*]}" | tail -n 1
+        adb pull "$DEVICE_DIR/profraw/." "$dir/profraw/" >/dev/null 2>&1 || true
+    else
+        (cd "$dir" && LD_LIBRARY_PATH=. ANDROGPT_CPU_VARIANT="$variant" \
+            LLVM_PROFILE_FILE="$dir/profraw/%m-%p.profraw" ./androgpt-pgo-train "${args[@]}") | tail -n 1
+    fi
+}
+
+field() {
+    sed -n "s/.*$1=\([0-9.]*\).*/\1/p" <<< "$2"
+}
+
+echo "model: $MODEL ($(sha256sum "$MODEL" | cut -c1-16))"
+echo "workload: $PROMPT prompt tokens, $DECODE decoded, $THREADS threads, median of $REPS"
+
+build baseline
+BASELINE="$(run baseline)"
+echo "baseline:  $BASELINE"
+
+build instrumented -DANDROGPT_PGO=GENERATE
+run instrumented >/dev/null
+mkdir -p "$(dirname "$PROFILE")"
+"$PROFDATA" merge -o "$PROFILE" "$BUILD_ROOT"/instrumented/profraw/*.profraw
+echo "profile:   $PROFILE"
+
+build optimized -DANDROGPT_LTO=ON -DANDROGPT_PGO=USE -DANDROGPT_PGO_PROFILE="$PROFILE"
+OPTIMIZED="$(run optimized)"
+echo "optimized: $OPTIMIZED"
+
+for metric in prefill_tps decode_tps; do
+    base="$(field "$metric" "$BASELINE")"
+    opt="$(field "$metric" "$OPTIMIZED")"
+    awk -v m="$metric" -v b="$base" -v o="$opt" \
+        'BEGIN { printf "%-12s %10.2f -> %10.2f tok/s (%+.1f%%)\n", m, b, o, (o / b - 1) * 100 }'
+done
@@ -0,0 +1,180 @@
+// Deterministic inference workload for PGO training and throughput comparison: a fixed
+// prompt prefilled in one batch, then greedy single-token decode for a fixed count,
+// repeated on a cleared KV cache. Prints the median of each phase and a summary line
+// (prefill_tps=... decode_tps=...) that tools/pgo.sh parses.
+//
+//   androgpt-pgo-train -m model.gguf [-t threads] [-p prompt_tokens] [-n decode_tokens] [-r reps]
+
+#include "cpu_backend.h"
+
+#include "llama.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Mixed prose and code, so tokenization covers words, punctuation and digits
+static const char* const TRAINING_TEXT =
+    "The quick brown fox jumps over the lazy dog while 42 engineers review a patch. "
+    "for (int i = 0; i < n; ++i) { sum += weights[i] * inputs[i]; } "
+    "Summarize the meeting notes, list three action items and suggest a follow-up date. ";
+
+struct TrainOptions {
+    std::string model;
+    int threads = 4;
+    int prompt_tokens = 256;
+    int decode_tokens = 64;
+    int reps = 3;
+};
+
+static bool parseArgs(int argc, char** argv, TrainOptions& opts) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char* flag = argv[i];
+        const char* value = argv[i + 1];
+        if (strcmp(flag, "-m") == 0) {
+            opts.model = value;
+        } else if (strcmp(flag, "-t") == 0) {
+            opts.threads = atoi(value);
+        } else if (strcmp(flag, "-p") == 0) {
+            opts.prompt_tokens = atoi(value);
+        } else if (strcmp(flag, "-n") == 0) {
+            opts.decode_tokens = atoi(value);
+        } else if (strcmp(flag, "-r") == 0) {
+            opts.reps = atoi(value);
+        } else {
+            return false;
+        }
+    }
+    return !opts.model.empty() && opts.threads > 0 && opts.prompt_tokens > 0 &&
+           opts.decode_tokens > 0 && opts.reps > 0;
+}
+
+static std::string executableDir() {
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) {
+        return ".";
+    }
+    std::string dir(path, len);
+    return dir.substr(0, dir.find_last_of('/'));
+}
+
+// The training text repeated and cut to exactly `n` tokens
+static std::vector<llama_token> promptTokens(const llama_vocab* vocab, int n) {
+    std::vector<llama_token> chunk(strlen(TRAINING_TEXT) + 8);
+    const int n_chunk = llama_tokenize(vocab, TRAINING_TEXT, strlen(TRAINING_TEXT),
+                                       chunk.data(), chunk.size(), false, false);
+    chunk.resize(std::max(n_chunk, 0));
+
+    std::vector<llama_token> tokens;
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) {
+        tokens.push_back(llama_vocab_bos(vocab));
+    }
+    while (!chunk.empty() && static_cast<int>(tokens.size()) < n) {
+        tokens.insert(tokens.end(), chunk.begin(), chunk.end());
+    }
+    tokens.resize(n, 0);
+    return tokens;
+}
+
+static double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    const size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2.0;
+}
+
+int main(int argc, char** argv) {
+    TrainOptions opts;
+    if (!parseArgs(argc, argv, opts)) {
+        fprintf(stderr, "usage: %s -m model.gguf [-t threads] [-p prompt_tokens] "
+                        "[-n decode_tokens] [-r reps]\n", argv[0]);
+        return 2;
+    }
+
+    const char* forced = getenv("ANDROGPT_CPU_VARIANT");
+    CpuBackendInfo cpu;
+    if (!loadCpuBackend(executableDir(), forced ? forced : "", cpu)) {
+        fprintf(stderr, "no CPU backend variant could be loaded\n");
+        return 1;
+    }
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model* model = llama_model_load_from_file(opts.model.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load %s\n", opts.model.c_str());
+        return 1;
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = opts.prompt_tokens + opts.decode_tokens + 8;
+    cparams.n_batch = opts.prompt_tokens;
+    cparams.n_ubatch = std::min(opts.prompt_tokens, 512);
+    cparams.n_threads = opts.threads;
+    cparams.n_threads_batch = opts.threads;
+    cparams.no_perf = true;
+    llama_context* ctx = llama_init_from_model(model, cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "failed to create context\n");
+        llama_model_free(model);
+        return 1;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const std::vector<llama_token> prompt = promptTokens(vocab, opts.prompt_tokens);
+    llama_sampler* greedy = llama_sampler_init_greedy();
+
+    std::vector<double> prefill_tps;
+    std::vector<double> decode_tps;
+    // Repetition 0 pages in weights and allocates compute buffers; it is not timed
+    for (int rep = 0; rep <= opts.reps; ++rep) {
+        llama_memory_clear(llama_get_memory(ctx), true);
+        llama_sampler_reset(greedy);
+
+        std::vector<llama_token> batch = prompt;
+        const int64_t t_prefill_us = ggml_time_us();
+        if (llama_decode(ctx, llama_batch_get_one(batch.data(), batch.size())) != 0) {
+            fprintf(stderr, "prefill failed\n");
+            break;
+        }
+        const int64_t t_decode_us = ggml_time_us();
+
+        // Greedy and never stopped at end-of-generation, so every run does the same work
+        llama_token token = llama_sampler_sample(greedy, ctx, -1);
+        bool decoded = true;
+        for (int i = 0; i < opts.decode_tokens && decoded; ++i) {
+            decoded = llama_decode(ctx, llama_batch_get_one(&token, 1)) == 0;
+            token = llama_sampler_sample(greedy, ctx, -1);
+        }
+        const int64_t t_end_us = ggml_time_us();
+        if (!decoded) {
+            fprintf(stderr, "decode failed\n");
+            break;
+        }
+
+        if (rep > 0) {
+            prefill_tps.push_back(1e6 * opts.prompt_tokens / std::max<int64_t>(t_decode_us - t_prefill_us, 1));
+            decode_tps.push_back(1e6 * opts.decode_tokens / std::max<int64_t>(t_end_us - t_decode_us, 1));
+            printf("rep %d: prefill %.2f tok/s, decode %.2f tok/s\n", rep, prefill_tps.back(), decode_tps.back());
+        }
+    }
+
+    llama_sampler_free(greedy);
+    llama_free(ctx);
+    llama_model_free(model);
+    llama_backend_free();
+
+    if (static_cast<int>(prefill_tps.size()) != opts.reps) {
+        return 1;
+    }
+    printf("variant=%s threads=%d prompt=%d decode=%d prefill_tps=%.2f decode_tps=%.2f\n",
+           cpu.variant.c_str(), opts.threads, opts.prompt_tokens, opts.decode_tokens,
+           median(prefill_tps), median(decode_tps));
+    return 0;
+}
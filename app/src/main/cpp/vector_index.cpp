@@ -0,0 +1,546 @@
+#include "vector_index.h"
+
+#include <android/log.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <queue>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+#define LOG_TAG "VectorIndex"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+static constexpr char INDEX_MAGIC[4] = {'A', 'G', 'V', 'I'};
+static constexpr uint32_t INDEX_VERSION = 1;
+static constexpr size_t PAGE_BYTES = 4096;
+static constexpr uint64_t BLOCK_RECORDS = 256;
+static constexpr uint32_t MAX_LISTS = 64;
+static constexpr uint32_t MIN_LISTS = 8;
+static constexpr uint32_t MIN_PROBES = 4;
+static constexpr uint64_t TRAIN_MIN_RECORDS = 1024;
+static constexpr int KMEANS_ITERATIONS = 8;
+static constexpr uint32_t FLAG_DELETED = 1;
+
+struct VectorIndex::Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t n_lists;        // 0 while the index is scanned exhaustively
+    uint64_t count;          // records written, tombstones included
+    uint64_t capacity;       // records the file has room for
+    uint64_t trained_count;  // count when the lists were last trained
+};
+
+struct VectorIndex::RecordMeta {
+    int64_t id;
+    int64_t group;
+    float scale;
+    uint32_t list;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+static size_t roundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+/**
+ * int8 dot product; n is a multiple of 64.
+ */
+static int32_t dotI8(const int8_t* a, const int8_t* b, size_t n) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    int32x4_t acc0 = vdupq_n_s32(0);
+    int32x4_t acc1 = vdupq_n_s32(0);
+    for (size_t i = 0; i < n; i += 32) {
+        acc0 = vdotq_s32(acc0, vld1q_s8(a + i), vld1q_s8(b + i));
+        acc1 = vdotq_s32(acc1, vld1q_s8(a + i + 16), vld1q_s8(b + i + 16));
+    }
+    const int32x4_t acc = vaddq_s32(acc0, acc1);
+    const int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    return vget_lane_s32(vpadd_s32(sum, sum), 0);
+#elif defined(__ARM_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (size_t i = 0; i < n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+    }
+    const int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    return vget_lane_s32(vpadd_s32(sum, sum), 0);
+#elif defined(__AVX2__)
+    // maddubs needs unsigned x signed: move the sign of a onto b
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 32) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m256i prod = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(prod, ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    sum = _mm_hadd_epi32(sum, sum);
+    return _mm_cvtsi128_si32(sum);
+#elif defined(__SSSE3__)
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < n; i += 16) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i prod = _mm_maddubs_epi16(_mm_sign_epi8(va, va), _mm_sign_epi8(vb, va));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(prod, ones));
+    }
+    acc = _mm_hadd_epi32(acc, acc);
+    acc = _mm_hadd_epi32(acc, acc);
+    return _mm_cvtsi128_si32(acc);
+#else
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += static_cast<int32_t>(a[i]) * b[i];
+    }
+    return sum;
+#endif
+}
+
+static float dotF32(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+VectorIndex::VectorIndex(const std::string& path, int dim)
+    : path_(path),
+      dim_(dim),
+      dim_padded_(roundUp(static_cast<size_t>(dim), 64)) {}
+
+VectorIndex::~VectorIndex() {
+    sync();
+    if (base_) {
+        munmap(base_, mapped_bytes_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+std::unique_ptr<VectorIndex> VectorIndex::open(const std::string& path, int dim) {
+    if (dim <= 0) {
+        LOGE("Invalid dimension %d", dim);
+        return nullptr;
+    }
+
+    std::unique_ptr<VectorIndex> index(new VectorIndex(path, dim));
+    index->fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index->fd_ < 0) {
+        LOGE("Cannot open %s: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    struct stat st {};
+    fstat(index->fd_, &st);
+
+    Header existing {};
+    const bool readable = static_cast<size_t>(st.st_size) >= PAGE_BYTES &&
+                          pread(index->fd_, &existing, sizeof(existing), 0) == sizeof(existing);
+    // Everything below is read back from the mapping, so the header must describe
+    // a file that actually holds its blocks. Record indices are kept as uint32_t.
+    const uint64_t n_blocks = existing.capacity / BLOCK_RECORDS;
+    const bool valid = readable &&
+                       std::memcmp(existing.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+                       existing.version == INDEX_VERSION &&
+                       existing.dim == static_cast<uint32_t>(dim) &&
+                       existing.n_lists <= MAX_LISTS &&
+                       existing.capacity % BLOCK_RECORDS == 0 &&
+                       existing.capacity <= UINT32_MAX &&
+                       existing.count <= existing.capacity &&
+                       existing.trained_count <= existing.count &&
+                       static_cast<uint64_t>(st.st_size) >= index->dataOffset() &&
+                       n_blocks <= (static_cast<uint64_t>(st.st_size) - index->dataOffset()) / index->blockBytes();
+
+    if (valid) {
+        if (!index->map(existing.capacity)) {
+            return nullptr;
+        }
+        if (index->rebuildLists()) {
+            LOGI("Opened %s: %llu records, %u lists", path.c_str(),
+                 static_cast<unsigned long long>(existing.count), existing.n_lists);
+            return index;
+        }
+        LOGW("Recreating %s (record metadata is corrupt)", path.c_str());
+    } else if (readable) {
+        LOGW("Recreating %s (format or dimension changed)", path.c_str());
+    }
+    if (!index->init()) {
+        return nullptr;
+    }
+    return index;
+}
+
+bool VectorIndex::init() {
+    if (ftruncate(fd_, 0) != 0 || !map(BLOCK_RECORDS)) {
+        return false;
+    }
+    Header* h = header();
+    std::memcpy(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h->version = INDEX_VERSION;
+    h->dim = static_cast<uint32_t>(dim_);
+    h->n_lists = 0;
+    h->count = 0;
+    h->capacity = BLOCK_RECORDS;
+    h->trained_count = 0;
+    rebuildLists();
+    return true;
+}
+
+size_t VectorIndex::dataOffset() const {
+    return PAGE_BYTES + roundUp(sizeof(float) * MAX_LISTS * dim_, PAGE_BYTES);
+}
+
+size_t VectorIndex::blockBytes() const {
+    return BLOCK_RECORDS * (sizeof(RecordMeta) + dim_padded_);
+}
+
+bool VectorIndex::map(uint64_t capacity) {
+    if (base_) {
+        munmap(base_, mapped_bytes_);
+        base_ = nullptr;
+    }
+
+    const size_t bytes = dataOffset() + capacity / BLOCK_RECORDS * blockBytes();
+    struct stat st {};
+    fstat(fd_, &st);
+    if (static_cast<size_t>(st.st_size) < bytes && ftruncate(fd_, static_cast<off_t>(bytes)) != 0) {
+        LOGE("Cannot grow %s to %zu bytes: %s", path_.c_str(), bytes, strerror(errno));
+        return false;
+    }
+
+    void* addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) {
+        LOGE("Cannot map %s: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    base_ = static_cast<uint8_t*>(addr);
+    mapped_bytes_ = bytes;
+    return true;
+}
+
+bool VectorIndex::grow(uint64_t min_capacity) {
+    const uint64_t capacity = header()->capacity;
+    if (min_capacity <= capacity) {
+        return true;
+    }
+    const uint64_t new_capacity = roundUp(std::max(capacity * 2, min_capacity), BLOCK_RECORDS);
+    sync();
+    if (!map(new_capacity)) {
+        return false;
+    }
+    header()->capacity = new_capacity;
+    return true;
+}
+
+void VectorIndex::sync() {
+    if (base_) {
+        msync(base_, mapped_bytes_, MS_ASYNC);
+    }
+}
+
+VectorIndex::Header* VectorIndex::header() const {
+    return reinterpret_cast<Header*>(base_);
+}
+
+float* VectorIndex::centroids() const {
+    return reinterpret_cast<float*>(base_ + PAGE_BYTES);
+}
+
+VectorIndex::RecordMeta* VectorIndex::meta(uint64_t index) const {
+    uint8_t* block = base_ + dataOffset() + (index / BLOCK_RECORDS) * blockBytes();
+    return reinterpret_cast<RecordMeta*>(block) + index % BLOCK_RECORDS;
+}
+
+int8_t* VectorIndex::vector(uint64_t index) const {
+    uint8_t* block = base_ + dataOffset() + (index / BLOCK_RECORDS) * blockBytes();
+    return reinterpret_cast<int8_t*>(block + BLOCK_RECORDS * sizeof(RecordMeta)) +
+           (index % BLOCK_RECORDS) * dim_padded_;
+}
+
+void VectorIndex::quantize(const float* src, int8_t* dst, float* scale) const {
+    float max_abs = 0.0f;
+    for (int i = 0; i < dim_; ++i) {
+        max_abs = std::max(max_abs, std::fabs(src[i]));
+    }
+    *scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    const float inv = 1.0f / *scale;
+    for (int i = 0; i < dim_; ++i) {
+        dst[i] = static_cast<int8_t>(std::max(-127L, std::min(127L, std::lround(src[i] * inv))));
+    }
+    std::memset(dst + dim_, 0, dim_padded_ - dim_);
+}
+
+uint32_t VectorIndex::nearestList(const float* vec) const {
+    const uint32_t n_lists = header()->n_lists;
+    uint32_t best = 0;
+    float best_score = -INFINITY;
+    for (uint32_t l = 0; l < n_lists; ++l) {
+        const float score = dotF32(vec, centroids() + static_cast<size_t>(l) * dim_, dim_);
+        if (score > best_score) {
+            best_score = score;
+            best = l;
+        }
+    }
+    return best;
+}
+
+bool VectorIndex::rebuildLists() {
+    const Header* h = header();
+    lists_.assign(std::max<uint32_t>(h->n_lists, 1), {});
+    for (uint64_t i = 0; i < h->count; ++i) {
+        const RecordMeta* m = meta(i);
+        if (m->flags & FLAG_DELETED) {
+            continue;
+        }
+        const uint32_t list = h->n_lists ? m->list : 0;
+        if (list >= lists_.size()) {
+            lists_.assign(1, {});
+            return false;
+        }
+        lists_[list].push_back(static_cast<uint32_t>(i));
+    }
+    return true;
+}
+
+/**
+ * Spherical k-means over a sample of the stored vectors, then reassign every record.
+ */
+void VectorIndex::trainLists() {
+    Header* h = header();
+
+    std::vector<uint64_t> live;
+    live.reserve(h->count);
+    for (uint64_t i = 0; i < h->count; ++i) {
+        if (!(meta(i)->flags & FLAG_DELETED)) {
+            live.push_back(i);
+        }
+    }
+
+    const uint32_t n_lists = std::min<uint32_t>(
+            MAX_LISTS, std::max<uint32_t>(MIN_LISTS, static_cast<uint32_t>(std::sqrt(live.size()))));
+    const size_t n_sample = std::min<size_t>(live.size(), static_cast<size_t>(n_lists) * 64);
+    if (n_sample < n_lists) {
+        return;
+    }
+
+    auto dequantize = [this](uint64_t index, float* out) {
+        const float scale = meta(index)->scale;
+        const int8_t* q = vector(index);
+        for (int d = 0; d < dim_; ++d) {
+            out[d] = q[d] * scale;
+        }
+    };
+
+    std::vector<float> sample(n_sample * dim_);
+    const size_t step = live.size() / n_sample;
+    for (size_t s = 0; s < n_sample; ++s) {
+        dequantize(live[s * step], sample.data() + s * dim_);
+    }
+
+    std::vector<float> cents(static_cast<size_t>(n_lists) * dim_);
+    for (uint32_t l = 0; l < n_lists; ++l) {
+        std::memcpy(cents.data() + static_cast<size_t>(l) * dim_,
+                    sample.data() + (static_cast<size_t>(l) * n_sample / n_lists) * dim_,
+                    sizeof(float) * dim_);
+    }
+
+    std::vector<float> sums(cents.size());
+    std::vector<uint32_t> counts(n_lists);
+    for (int iter = 0; iter < KMEANS_ITERATIONS; ++iter) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t s = 0; s < n_sample; ++s) {
+            const float* v = sample.data() + s * dim_;
+            uint32_t best = 0;
+            float best_score = -INFINITY;
+            for (uint32_t l = 0; l < n_lists; ++l) {
+                const float score = dotF32(v, cents.data() + static_cast<size_t>(l) * dim_, dim_);
+                if (score > best_score) {
+                    best_score = score;
+                    best = l;
+                }
+            }
+            float* sum = sums.data() + static_cast<size_t>(best) * dim_;
+            for (int d = 0; d < dim_; ++d) {
+                sum[d] += v[d];
+            }
+            counts[best]++;
+        }
+        for (uint32_t l = 0; l < n_lists; ++l) {
+            if (counts[l] == 0) {
+                continue;  // keep the previous centroid for empty clusters
+            }
+            float* c = cents.data() + static_cast<size_t>(l) * dim_;
+            const float* sum = sums.data() + static_cast<size_t>(l) * dim_;
+            const float norm = std::sqrt(dotF32(sum, sum, dim_));
+            for (int d = 0; d < dim_; ++d) {
+                c[d] = norm > 0.0f ? sum[d] / norm : 0.0f;
+            }
+        }
+    }
+
+    std::memcpy(centroids(), cents.data(), sizeof(float) * cents.size());
+    h->n_lists = n_lists;
+    h->trained_count = h->count;
+
+    std::vector<float> buf(dim_);
+    for (uint64_t i : live) {
+        dequantize(i, buf.data());
+        meta(i)->list = nearestList(buf.data());
+    }
+    rebuildLists();
+    LOGI("Trained %u lists over %zu records (%zu sampled)", n_lists, live.size(), n_sample);
+}
+
+bool VectorIndex::add(const int64_t* ids, int64_t group, const float* vectors, size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!grow(header()->count + n)) {
+        return false;
+    }
+
+    Header* h = header();
+    for (size_t k = 0; k < n; ++k) {
+        const float* vec = vectors + k * dim_;
+        const uint64_t index = h->count;
+
+        RecordMeta* m = meta(index);
+        quantize(vec, vector(index), &m->scale);
+        m->id = ids[k];
+        m->group = group;
+        m->list = h->n_lists ? nearestList(vec) : 0;
+        m->flags = 0;
+        m->reserved = 0;
+
+        lists_[m->list].push_back(static_cast<uint32_t>(index));
+        h->count = index + 1;
+    }
+
+    // Retrain once the index outgrows the lists it was trained with
+    if (h->count >= TRAIN_MIN_RECORDS && h->count >= 4 * std::max<uint64_t>(h->trained_count, 1)) {
+        trainLists();
+    }
+    return true;
+}
+
+std::vector<VectorIndex::Hit> VectorIndex::search(const float* query, int64_t group, int k) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Hit> hits;
+    if (k <= 0) {
+        return hits;
+    }
+
+    const Header* h = header();
+    std::vector<int8_t> q(dim_padded_);
+    float q_scale = 1.0f;
+    quantize(query, q.data(), &q_scale);
+
+    // Lists by how close their centroids are to the query
+    std::vector<uint32_t> probes;
+    uint32_t n_probe = 1;
+    if (h->n_lists == 0) {
+        probes.push_back(0);
+    } else {
+        std::vector<std::pair<float, uint32_t>> ranked(h->n_lists);
+        for (uint32_t l = 0; l < h->n_lists; ++l) {
+            ranked[l] = {dotF32(query, centroids() + static_cast<size_t>(l) * dim_, dim_), l};
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (const auto& entry : ranked) {
+            probes.push_back(entry.second);
+        }
+        n_probe = std::min(h->n_lists, std::max(MIN_PROBES, h->n_lists / 4));
+    }
+
+    auto worse = [](const Hit& a, const Hit& b) { return a.score > b.score; };
+    std::priority_queue<Hit, std::vector<Hit>, decltype(worse)> top(worse);
+
+    // The closest lists are enough for the whole index. One group's records are spread
+    // over all of them, so a group search keeps going until it has k hits
+    for (size_t p = 0; p < probes.size(); ++p) {
+        if (p >= n_probe && (group < 0 || static_cast<int>(top.size()) >= k)) {
+            break;
+        }
+        for (uint32_t index : lists_[probes[p]]) {
+            const RecordMeta* m = meta(index);
+            if ((m->flags & FLAG_DELETED) || (group >= 0 && m->group != group)) {
+                continue;
+            }
+            const float score = dotI8(q.data(), vector(index), dim_padded_) * q_scale * m->scale;
+            if (static_cast<int>(top.size()) < k) {
+                top.push({m->id, score});
+            } else if (score > top.top().score) {
+                top.pop();
+                top.push({m->id, score});
+            }
+        }
+    }
+
+    hits.resize(top.size());
+    for (size_t i = hits.size(); i-- > 0;) {
+        hits[i] = top.top();
+        top.pop();
+    }
+    return hits;
+}
+
+int64_t VectorIndex::maxId(int64_t group) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t max_id = -1;
+    const uint64_t count = header()->count;
+    for (uint64_t i = 0; i < count; ++i) {
+        const RecordMeta* m = meta(i);
+        if (!(m->flags & FLAG_DELETED) && m->group == group) {
+            max_id = std::max(max_id, m->id);
+        }
+    }
+    return max_id;
+}
+
+size_t VectorIndex::removeGroup(int64_t group) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t removed = 0;
+    const uint64_t count = header()->count;
+    for (uint64_t i = 0; i < count; ++i) {
+        RecordMeta* m = meta(i);
+        if (!(m->flags & FLAG_DELETED) && m->group == group) {
+            m->flags |= FLAG_DELETED;
+            removed++;
+        }
+    }
+    if (removed > 0) {
+        rebuildLists();
+    }
+    return removed;
+}
+
+size_t VectorIndex::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t live = 0;
+    for (const auto& list : lists_) {
+        live += list.size();
+    }
+    return live;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Approximate nearest neighbour index over int8-quantized, L2-normalized vectors,
+ * stored in one memory-mapped file. Vectors are never copied out of the mapping:
+ * opening an index only reads the small per-record metadata.
+ *
+ * Records are appended in blocks; each block keeps its metadata apart from its
+ * vectors so list assignment scans do not fault in vector pages. Small indexes
+ * are scanned exhaustively, larger ones use IVF lists trained with k-means.
+ */
+class VectorIndex {
+public:
+    struct Hit {
+        int64_t id;
+        float score;
+    };
+
+    /**
+     * Open or create the index file at `path`. An existing file with another
+     * dimension or format, or with inconsistent metadata, is recreated empty.
+     */
+    static std::unique_ptr<VectorIndex> open(const std::string& path, int dim);
+
+    ~VectorIndex();
+
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    /** Append L2-normalized vectors; `vectors` holds n * dim floats. */
+    bool add(const int64_t* ids, int64_t group, const float* vectors, size_t n);
+
+    /**
+     * Top-k by cosine similarity within `group` (or all groups when group < 0). Once
+     * trained, the lists closest to the query are probed, and a group search probes
+     * further lists until it has k hits or has seen every list.
+     */
+    std::vector<Hit> search(const float* query, int64_t group, int k) const;
+
+    /** Highest id stored for `group`, or -1. */
+    int64_t maxId(int64_t group) const;
+
+    /** Tombstone every record of `group`. */
+    size_t removeGroup(int64_t group);
+
+    size_t size() const;
+    int dim() const { return dim_; }
+
+private:
+    struct Header;
+    struct RecordMeta;
+
+    VectorIndex(const std::string& path, int dim);
+
+    bool init();
+    bool map(uint64_t capacity);
+    bool grow(uint64_t min_capacity);
+    void sync();
+
+    size_t dataOffset() const;
+    size_t blockBytes() const;
+    Header* header() const;
+    RecordMeta* meta(uint64_t index) const;
+    int8_t* vector(uint64_t index) const;
+    float* centroids() const;
+
+    void quantize(const float* src, int8_t* dst, float* scale) const;
+    uint32_t nearestList(const float* vec) const;
+    void trainLists();
+    /** Returns false when a record names a list that does not exist. */
+    bool rebuildLists();
+
+    std::string path_;
+    int dim_;
+    size_t dim_padded_;
+    int fd_ = -1;
+    uint8_t* base_ = nullptr;
+    size_t mapped_bytes_ = 0;
+
+    // Record indices per IVF list, rebuilt from metadata on open and after training
+    std::vector<std::vector<uint32_t>> lists_;
+
+    mutable std::mutex mutex_;
+};
@@ -0,0 +1,175 @@
+#include "weight_prefetch.h"
+
+#include "gguf.h"
+
+#include <android/log.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+#define LOG_TAG "WeightPrefetch"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGW(...) __android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__)
+
+// Readahead granularity; small enough for stop() to take effect promptly
+static constexpr uint64_t PREFETCH_CHUNK_BYTES = 4ull << 20;
+
+static int32_t layerOf(const char* name) {
+    if (std::strncmp(name, "blk.", 4) == 0) {
+        return static_cast<int32_t>(std::strtol(name + 4, nullptr, 10));
+    }
+    // output / output_norm run after the last block, everything else before the first
+    return std::strncmp(name, "output", 6) == 0 ? INT32_MAX : -1;
+}
+
+bool readWeightRanges(const std::string& path, std::vector<WeightRange>& ranges) {
+    gguf_init_params params = {true, nullptr};
+    gguf_context* ctx = gguf_init_from_file(path.c_str(), params);
+    if (ctx == nullptr) {
+        LOGW("Failed to read GGUF metadata of %s", path.c_str());
+        return false;
+    }
+
+    const uint64_t data_offset = gguf_get_data_offset(ctx);
+    const int64_t n_tensors = gguf_get_n_tensors(ctx);
+    ranges.clear();
+    ranges.reserve(n_tensors);
+
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        const char* name = gguf_get_tensor_name(ctx, i);
+        ranges.push_back({data_offset + gguf_get_tensor_offset(ctx, i), gguf_get_tensor_size(ctx, i),
+                          layerOf(name), gguf_get_tensor_type(ctx, i), name});
+    }
+    gguf_free(ctx);
+
+    // Converters do not agree on file order, so sort by layer (stable within a layer)
+    std::stable_sort(ranges.begin(), ranges.end(), [](const WeightRange& a, const WeightRange& b) {
+        return a.layer < b.layer;
+    });
+    return true;
+}
+
+bool weightResidency(const std::string& path, const std::vector<WeightRange>& ranges,
+                     uint64_t& resident_bytes, uint64_t& total_bytes) {
+    resident_bytes = 0;
+    total_bytes = 0;
+
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    const size_t file_size = static_cast<size_t>(st.st_size);
+    void* base = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    std::vector<unsigned char> vec;
+    bool ok = true;
+
+    for (const WeightRange& range : ranges) {
+        if (range.size == 0 || range.offset + range.size > file_size) {
+            continue;
+        }
+        const uint64_t first = range.offset / page * page;
+        const uint64_t last = range.offset + range.size;
+        const uint64_t n_pages = (last - first + page - 1) / page;
+        vec.resize(n_pages);
+        if (mincore(static_cast<uint8_t*>(base) + first, last - first, vec.data()) != 0) {
+            ok = false;
+            break;
+        }
+
+        uint64_t resident_pages = 0;
+        for (unsigned char v : vec) {
+            resident_pages += v & 1;
+        }
+        total_bytes += range.size;
+        resident_bytes += std::min(range.size, resident_pages * page);
+    }
+
+    munmap(base, file_size);
+    return ok;
+}
+
+WeightPrefetcher::~WeightPrefetcher() {
+    stop();
+}
+
+void WeightPrefetcher::start(const std::string& path, std::vector<WeightRange> ranges) {
+    stop();
+    stop_.store(false);
+    running_.store(true);
+    thread_ = std::thread(&WeightPrefetcher::run, this, path, std::move(ranges));
+}
+
+void WeightPrefetcher::stop() {
+    stop_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    running_.store(false);
+}
+
+void WeightPrefetcher::run(std::string path, std::vector<WeightRange> ranges) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st {};
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LOGW("Prefetch: cannot open %s", path.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        running_.store(false);
+        return;
+    }
+
+    // Only used when readahead() is not supported by the filesystem
+    const size_t file_size = static_cast<size_t>(st.st_size);
+    void* base = nullptr;
+    const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+
+    uint64_t issued = 0;
+    for (const WeightRange& range : ranges) {
+        for (uint64_t off = 0; off < range.size && !stop_.load(); off += PREFETCH_CHUNK_BYTES) {
+            const uint64_t start = range.offset + off;
+            const uint64_t len = std::min(PREFETCH_CHUNK_BYTES, range.size - off);
+            if (readahead(fd, static_cast<off64_t>(start), static_cast<size_t>(len)) != 0) {
+                if (base == nullptr) {
+                    base = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+                    if (base == MAP_FAILED) {
+                        base = nullptr;
+                        break;
+                    }
+                }
+                const uint64_t aligned = start / page * page;
+                madvise(static_cast<uint8_t*>(base) + aligned, len + (start - aligned), MADV_WILLNEED);
+            }
+            issued += len;
+        }
+        if (stop_.load()) {
+            break;
+        }
+    }
+
+    if (base != nullptr) {
+        munmap(base, file_size);
+    }
+    close(fd);
+    LOGI("Prefetch %s after %llu MiB", stop_.load() ? "stopped" : "finished",
+         static_cast<unsigned long long>(issued >> 20));
+    running_.store(false);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Byte range of one tensor's data inside a GGUF file. `layer` is the block index
+ * parsed from "blk.N.", INT32_MAX for the output head and -1 for everything else
+ * (token embeddings and other tensors used before the first block).
+ */
+struct WeightRange {
+    uint64_t offset;
+    uint64_t size;
+    int32_t layer;
+    ggml_type type;
+    std::string name;
+};
+
+/**
+ * Read the tensor data ranges of a GGUF file in the order inference touches them:
+ * embeddings, then each block, then the output head. Only metadata is read.
+ */
+bool readWeightRanges(const std::string& path, std::vector<WeightRange>& ranges);
+
+/**
+ * Bytes of `ranges` currently in the page cache, measured with mincore over a
+ * read-only mapping of the file. Because file pages are shared, this is also what
+ * llama.cpp's own mapping has resident.
+ */
+bool weightResidency(const std::string& path, const std::vector<WeightRange>& ranges,
+                     uint64_t& resident_bytes, uint64_t& total_bytes);
+
+/**
+ * Background thread that asks the kernel to read weight ranges ahead of use, in
+ * layer order, with readahead() and madvise(MADV_WILLNEED) as a fallback.
+ */
+class WeightPrefetcher {
+public:
+    ~WeightPrefetcher();
+
+    /** Stop any running pass and start a new one over `ranges`. */
+    void start(const std::string& path, std::vector<WeightRange> ranges);
+
+    /** Stop the running pass and wait for the thread to exit. */
+    void stop();
+
+    bool running() const { return running_.load(); }
+
+private:
+    void run(std::string path, std::vector<WeightRange> ranges);
+
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> running_{false};
+};
@@ -0,0 +1,111 @@
+package com.androgpt.yaser.data.inference
+
+import android.content.Context
+import android.util.Log
+import com.androgpt.yaser.domain.model.GgufMetadata
+import com.google.gson.Gson
+import com.google.gson.JsonParseException
+import com.google.gson.reflect.TypeToken
+import dagger.hilt.android.qualifiers.ApplicationContext
+import java.io.File
+import java.io.IOException
+import javax.inject.Inject
+import javax.inject.Singleton
+
+/**
+ * On-disk cache of GGUF header metadata keyed by path. An entry is reused while the
+ * file keeps its size and modification time, so listing models reads no headers
+ * after the first time each file is seen.
+ */
+@Singleton
+class GgufIndex @Inject constructor(
+    @ApplicationContext private val context: Context,
+    private val llamaEngine: LlamaEngine
+) {
+
+    companion object {
+        private const val TAG = "GgufIndex"
+        private const val INDEX_FILE = "gguf_index.json"
+    }
+
+    private data class Entry(
+        val size: Long,
+        val lastModified: Long,
+        val metadata: GgufMetadata
+    )
+
+    private val gson = Gson()
+    private val indexFile: File by lazy { File(context.filesDir, INDEX_FILE) }
+    private var entries: MutableMap<String, Entry>? = null
+
+    /** Metadata of each file, read from the header only for new or changed files. */
+    @Synchronized
+    fun lookup(files: List<File>): Map<String, GgufMetadata?> {
+        val index = loadEntries()
+        var changed = false
+        val result = files.associate { file ->
+            val path = file.absolutePath
+            val size = file.length()
+            val lastModified = file.lastModified()
+            val cached = index[path]
+            val metadata = if (cached != null && cached.size == size && cached.lastModified == lastModified) {
+                cached.metadata
+            } else {
+                llamaEngine.inspectGguf(path)?.also {
+                    index[path] = Entry(size, lastModified, it)
+                    changed = true
+                }
+            }
+            path to metadata
+        }
+
+        // Forget files that are gone, so the index does not outgrow the models directory
+        if (index.keys.retainAll { File(it).exists() } || changed) {
+            saveEntries(index)
+        }
+        return result
+    }
+
+    fun lookup(file: File): GgufMetadata? = lookup(listOf(file))[file.absolutePath]
+
+    @Synchronized
+    fun remove(path: String) {
+        val index = loadEntries()
+        if (index.remove(path) != null) {
+            saveEntries(index)
+        }
+    }
+
+    private fun loadEntries(): MutableMap<String, Entry> {
+        entries?.let { return it }
+        val loaded: MutableMap<String, Entry> = try {
+            if (indexFile.exists()) {
+                val type = object : TypeToken<HashMap<String, Entry>>() {}.type
+                gson.fromJson<HashMap<String, Entry>>(indexFile.readText(), type) ?: HashMap()
+            } else {
+                HashMap()
+            }
+        } catch (e: IOException) {
+            Log.w(TAG, "Failed to read GGUF index, rebuilding", e)
+            HashMap()
+        } catch (e: JsonParseException) {
+            Log.w(TAG, "Corrupt GGUF index, rebuilding", e)
+            HashMap()
+        }
+        entries = loaded
+        return loaded
+    }
+
+    private fun saveEntries(index: Map<String, Entry>) {
+        try {
+            // Write then rename, so a crash never leaves a truncated index
+            val tmp = File(indexFile.path + ".tmp")
+            tmp.writeText(gson.toJson(index))
+            if (!tmp.renameTo(indexFile)) {
+                Log.w(TAG, "Failed to replace GGUF index")
+            }
+        } catch (e: IOException) {
+            Log.w(TAG, "Failed to write GGUF index", e)
+        }
+    }
+}
@@ -1,17 +1,56 @@
 package com.androgpt.yaser.data.inference
 
+import android.content.Context
 import android.util.Log
+import com.androgpt.yaser.domain.model.CandidateScore
+import com.androgpt.yaser.domain.model.FlashAttentionMode
+import com.androgpt.yaser.domain.model.GgufMetadata
+import com.androgpt.yaser.domain.model.ModelLoadProgress
+import com.androgpt.yaser.domain.model.PromptSegment
+import com.androgpt.yaser.domain.model.QuantizationType
+import com.androgpt.yaser.domain.model.TokenAlternative
+import com.androgpt.yaser.domain.model.TokenLogprobs
+import com.google.gson.Gson
+import com.google.gson.JsonSyntaxException
+import dagger.hilt.android.qualifiers.ApplicationContext
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.Job
+import kotlinx.coroutines.SupervisorJob
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.StateFlow
+import kotlinx.coroutines.flow.asStateFlow
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import java.io.File
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.util.concurrent.atomic.AtomicBoolean
 import javax.inject.Inject
 import javax.inject.Singleton
 
 @Singleton
-class LlamaEngine @Inject constructor() {
+class LlamaEngine @Inject constructor(
+    @ApplicationContext private val context: Context
+) {
     
     companion object {
         private const val TAG = "LlamaEngine"
+        private const val MAX_TOP_LOGPROBS = 20
+        private const val LOGPROB_RECORD_BYTES = 4096
+        private const val TOKEN_CACHE_FILE = "token_cache.bin"
+        
+        // nativeLoadModel results
+        private const val LOAD_FAILED = 0
+        private const val LOAD_COLD = 1
+        private const val LOAD_SWAPPED = 2
+        private const val LOAD_FAILED_KEPT = 3
+        
+        // nativeQuantize results
+        private const val QUANTIZE_OK = 0
+        private const val QUANTIZE_CANCELLED = 2
+        private const val QUANTIZE_BUSY = 3
         
         init {
             try {
@@ -29,50 +68,238 @@ class LlamaEngine @Inject constructor() {
     @Volatile
     private var isGenerating = false
     
+    // Cancellation flag of the most recent loadModel call
+    @Volatile
+    private var activeLoadCancelled: AtomicBoolean? = null
+    
+    @Volatile
+    private var activeQuantizeCancelled: AtomicBoolean? = null
+    
+    private val gson = Gson()
+    
+    private val backgroundScope = CoroutineScope(SupervisorJob() + Dispatchers.IO)
+    private var warmupJob: Job? = null
+    private var compactionJob: Job? = null
+    
+    private val _loadStats = MutableStateFlow<LoadStats?>(null)
+    
+    /** Timings of the current model's load and warmup. */
+    val loadStats: StateFlow<LoadStats?> = _loadStats.asStateFlow()
+    
     // Native method declarations
-    private external fun nativeInit(): Boolean
+    private external fun nativeInit(nativeLibDir: String): Boolean
     
     private external fun nativeLoadModel(
         modelPath: String,
         nThreads: Int,
+        nThreadsBatch: Int,
         nGpuLayers: Int,
-        contextSize: Int
-    ): Boolean
+        contextSize: Int,
+        nBatch: Int,
+        kvType: Int,
+        flashAttn: Int,
+        useMmap: Boolean,
+        useMlock: Boolean,
+        memoryBudget: Long,
+        progressCallback: LoadProgressCallback?
+    ): Int
+    
+    private external fun nativeCancelLoad()
+    
+    private external fun nativeSetModelCacheLimit(bytes: Long)
+    
+    private external fun nativePlanMemory(modelPath: String, available: Long, maxContext: Int): LongArray?
+    
+    private external fun nativeInspectGguf(modelPath: String): String?
+    
+    private external fun nativeQuantize(
+        srcPath: String,
+        dstPath: String,
+        ftype: Int,
+        nThreads: Int,
+        progressCallback: QuantizeProgressCallback?
+    ): Int
+    
+    private external fun nativeCancelQuantize()
     
     private external fun nativeUnloadModel()
     
+    private external fun nativePrefetchWeights(): Boolean
+    
+    private external fun nativeGetWeightResidency(): LongArray?
+    
+    private external fun nativeWarmup(): Long
+    
+    private external fun nativeCancelWarmup()
+    
+    private external fun nativeCompactHistory(
+        instruction: String,
+        memoryPrefix: String,
+        memorySuffix: String
+    ): Int
+    
     private external fun nativeGenerate(
         prompt: String,
         maxTokens: Int,
         temperature: Float,
         topP: Float,
-        topK: Int
+        topK: Int,
+        modelPath: String?,
+        loraPaths: Array<String>?,
+        loraScales: FloatArray?
     ): String
     
     private external fun nativeGenerateStream(
-        prompt: String,
+        promptSegments: Array<String>,
+        segmentMessageIds: LongArray?,
+        segmentRoles: IntArray?,
+        segmentPinned: BooleanArray?,
         maxTokens: Int,
         temperature: Float,
         topP: Float,
         topK: Int,
+        topLogprobs: Int,
+        logprobBuffer: ByteBuffer?,
+        modelPath: String?,
+        loraPaths: Array<String>?,
+        loraScales: FloatArray?,
         callback: StreamCallback
     )
     
+    private external fun nativeFitPrompt(
+        promptSegments: Array<String>,
+        segmentMessageIds: LongArray?,
+        segmentRoles: IntArray?,
+        segmentPinned: BooleanArray?,
+        maxTokens: Int,
+        reserveTokens: Int
+    ): Int
+    
+    private external fun nativeSetTokenCacheFile(path: String?)
+    
+    private external fun nativeForkAt(messageIndex: Int): Int
+    
+    private external fun nativeScore(
+        prompt: String,
+        candidates: Array<String>,
+        modelPath: String?,
+        loraPaths: Array<String>?,
+        loraScales: FloatArray?
+    ): FloatArray?
+    
+    private external fun nativeLoadLora(loraPath: String): Boolean
+    
+    private external fun nativeUnloadLora(loraPath: String)
+    
+    private external fun nativeLoadEmbeddingModel(
+        modelPath: String?,
+        poolingType: Int,
+        nThreads: Int,
+        batchSize: Int,
+        maxSequences: Int
+    ): Boolean
+    
+    private external fun nativeUnloadEmbeddingModel()
+    
+    private external fun nativeGetEmbeddingDim(): Int
+    
+    private external fun nativeEmbed(
+        texts: Array<String>,
+        normalize: Boolean,
+        int8: Boolean,
+        outBuffer: ByteBuffer
+    ): Int
+    
+    private external fun nativeIndexOpen(indexPath: String, dim: Int): Long
+    
+    private external fun nativeIndexClose(handle: Long)
+    
+    private external fun nativeIndexAddTexts(
+        handle: Long,
+        ids: LongArray,
+        group: Long,
+        texts: Array<String>
+    ): Boolean
+    
+    private external fun nativeIndexSearchText(
+        handle: Long,
+        group: Long,
+        query: String,
+        k: Int,
+        outIds: LongArray,
+        outScores: FloatArray
+    ): Int
+    
+    private external fun nativeIndexMaxId(handle: Long, group: Long): Long
+    
+    private external fun nativeIndexRemoveGroup(handle: Long, group: Long): Int
+    
+    private external fun nativeBenchmarkThreads(
+        threadCounts: IntArray,
+        promptTokens: Int,
+        genTokens: Int,
+        pinned: Boolean
+    ): FloatArray?
+    
+    private external fun nativeSetThreads(nThreads: Int, nThreadsBatch: Int)
+    
+    private external fun nativeConfigureThreadpools(
+        pinned: Boolean,
+        decodeCpus: IntArray?,
+        batchCpus: IntArray?,
+        priority: Int,
+        poll: Int
+    ): Boolean
+    
+    private external fun nativeGetCpuCapacities(): IntArray
+    
     private external fun nativeStopGeneration()
     
     private external fun nativeGetModelInfo(): String
     
+    private external fun nativeGetCpuBackend(): String
+    
     private external fun nativeCleanup()
     
     init {
-        nativeInit()
+        // Loads the CPU backend variant that matches this device before any model
+        if (!nativeInit(context.applicationInfo.nativeLibraryDir)) {
+            Log.e(TAG, "No usable CPU backend found in ${context.applicationInfo.nativeLibraryDir}")
+        }
+        // Message token ids outlive the process, so restored chats skip tokenization too
+        backgroundScope.launch {
+            nativeSetTokenCacheFile(File(context.filesDir, TOKEN_CACHE_FILE).absolutePath)
+        }
     }
     
+    /**
+     * [nThreads] runs single-token decode, [nThreadsBatch] runs prompt prefill;
+     * 0 for the latter uses every available core. A [contextSize] of 0 lets the native
+     * memory planner pick the context, batch and KV cache type for the memory budget;
+     * otherwise [nBatch] (0 for llama.cpp's default) and [kvCacheType] apply as given.
+     * [flashAttention] AUTO times both attention kernels on the first load at a given
+     * context size and reuses the faster one afterwards. [useMlock] pins the weights in RAM
+     * where the memlock limit allows it. [onProgress] is called on the loading thread;
+     * returning false from it, or calling [cancelLoad], aborts the load with a
+     * [CancellationException].
+     *
+     * A loaded model keeps serving while the new one loads and warms up beside it, then
+     * the two are swapped once in-flight requests finish. If both would not fit in
+     * [memoryBudgetBytes] (0 for no limit) the current model is unloaded first.
+     */
     suspend fun loadModel(
         modelPath: String,
         nThreads: Int = 4,
+        nThreadsBatch: Int = 0,
         nGpuLayers: Int = 0,
-        contextSize: Int = 2048
+        contextSize: Int = 2048,
+        nBatch: Int = 0,
+        kvCacheType: KvCacheType = KvCacheType.F16,
+        flashAttention: FlashAttentionMode = FlashAttentionMode.AUTO,
+        useMmap: Boolean = true,
+        useMlock: Boolean = false,
+        memoryBudgetBytes: Long = 0,
+        onProgress: ((ModelLoadProgress) -> Boolean)? = null
     ): Result<Unit> = withContext(Dispatchers.IO) {
         try {
             val file = File(modelPath)
@@ -80,18 +307,49 @@ class LlamaEngine @Inject constructor() {
                 return@withContext Result.failure(Exception("Model file not found: $modelPath"))
             }
             
-            if (isModelLoaded) {
-                unloadModel()
+            val batchThreads = if (nThreadsBatch > 0) nThreadsBatch else availableCores()
+            val cancelled = AtomicBoolean(false)
+            val progressCallback = object : LoadProgressCallback {
+                override fun onProgress(stage: Int, progress: Float): Boolean {
+                    val keepGoing = onProgress?.invoke(
+                        ModelLoadProgress(ModelLoadProgress.Stage.fromNative(stage), progress)
+                    ) ?: true
+                    if (!keepGoing) {
+                        cancelled.set(true)
+                    }
+                    return keepGoing
+                }
             }
             
-            val success = nativeLoadModel(modelPath, nThreads, nGpuLayers, contextSize)
+            activeLoadCancelled = cancelled
+            val startMs = System.currentTimeMillis()
+            val status = nativeLoadModel(
+                modelPath, nThreads, batchThreads, nGpuLayers, contextSize, nBatch,
+                kvCacheType.nativeValue, flashAttention.nativeValue, useMmap, useMlock, memoryBudgetBytes,
+                progressCallback
+            )
             
-            if (success) {
-                isModelLoaded = true
-                Log.i(TAG, "Model loaded successfully: $modelPath")
-                Result.success(Unit)
-            } else {
-                Result.failure(Exception("Failed to load model"))
+            when (status) {
+                LOAD_COLD, LOAD_SWAPPED -> {
+                    isModelLoaded = true
+                    val loadMs = System.currentTimeMillis() - startMs
+                    _loadStats.value = LoadStats(loadMs = loadMs, hotSwapped = status == LOAD_SWAPPED)
+                    Log.i(TAG, "Model loaded in $loadMs ms (hot swap: ${status == LOAD_SWAPPED}): $modelPath")
+                    Result.success(Unit)
+                }
+                else -> {
+                    // LOAD_FAILED_KEPT leaves the previous model serving
+                    if (status == LOAD_FAILED) {
+                        isModelLoaded = false
+                        _loadStats.value = null
+                    }
+                    if (cancelled.get()) {
+                        Log.i(TAG, "Model load cancelled: $modelPath")
+                        Result.failure(CancellationException("Model load cancelled"))
+                    } else {
+                        Result.failure(Exception("Failed to load model"))
+                    }
+                }
             }
         } catch (e: Exception) {
             Log.e(TAG, "Error loading model", e)
@@ -99,20 +357,197 @@ class LlamaEngine @Inject constructor() {
         }
     }
     
+    /**
+     * Runs a short dummy decode in the background so the first real message does not
+     * pay for page faults and buffer allocation. Any request on the engine (or
+     * [cancelWarmup]) aborts it. [onFinished] receives the warmup time in ms, or null
+     * if it was cancelled.
+     */
+    fun startWarmup(onFinished: (suspend (Long?) -> Unit)? = null): Job {
+        warmupJob?.cancel()
+        return backgroundScope.launch {
+            val warmupMs = nativeWarmup().takeIf { it >= 0 }
+            _loadStats.value = _loadStats.value?.copy(warmupMs = warmupMs)
+            if (warmupMs != null) {
+                Log.i(TAG, "Warmup finished in $warmupMs ms")
+            } else {
+                Log.i(TAG, "Warmup cancelled")
+            }
+            onFinished?.invoke(warmupMs)
+        }.also { warmupJob = it }
+    }
+    
+    fun cancelWarmup() {
+        nativeCancelWarmup()
+    }
+    
+    /**
+     * Schedules a background pass that, once the last conversation fills most of the
+     * context, summarizes its oldest history into a memory segment the engine uses in
+     * place of those messages from then on. The summary is generated on a scratch
+     * sequence and the shortened prompt is prefilled so the next turn finds it cached.
+     * Any request on the engine preempts it. [instruction] asks for the summary in the
+     * chat template; [memoryPrefix] and [memorySuffix] wrap it into a prompt segment.
+     */
+    fun scheduleCompaction(instruction: String, memoryPrefix: String, memorySuffix: String) {
+        if (!isModelLoaded || compactionJob?.isActive == true) {
+            return
+        }
+        compactionJob = backgroundScope.launch {
+            val compacted = nativeCompactHistory(instruction, memoryPrefix, memorySuffix)
+            when {
+                compacted > 0 -> Log.i(TAG, "Summarized $compacted history messages into a memory")
+                compacted < 0 -> Log.i(TAG, "History compaction preempted")
+            }
+        }
+    }
+    
+    /**
+     * What loading [modelPath] would take: the largest context that fits in
+     * [availableBytes] (0 for the device's available RAM), at most [maxContext]
+     * (0 for the model's training context). Null if the file is unreadable or
+     * the model does not fit at all.
+     */
+    suspend fun planMemory(
+        modelPath: String,
+        availableBytes: Long = 0,
+        maxContext: Int = 0
+    ): MemoryPlan? = withContext(Dispatchers.IO) {
+        val values = nativePlanMemory(modelPath, availableBytes, maxContext) ?: return@withContext null
+        MemoryPlan(
+            contextSize = values[0].toInt(),
+            nBatch = values[1].toInt(),
+            kvCacheType = KvCacheType.fromNative(values[2].toInt()),
+            weightBytes = values[3],
+            kvCacheBytes = values[4],
+            computeBytes = values[5],
+            overheadBytes = values[6]
+        )
+    }
+    
+    /**
+     * Header metadata of a GGUF file, read without loading weights or touching the
+     * serving model. Null if the file is not a readable GGUF.
+     */
+    fun inspectGguf(modelPath: String): GgufMetadata? {
+        val json = nativeInspectGguf(modelPath) ?: return null
+        return try {
+            gson.fromJson(json, GgufMetadata::class.java)
+        } catch (e: JsonSyntaxException) {
+            Log.e(TAG, "Malformed GGUF summary for $modelPath", e)
+            null
+        }
+    }
+    
+    /**
+     * Writes [srcPath] requantized to [type] at [dstPath], one tensor at a time so
+     * memory stays near the largest tensor. Runs beside the serving model; with
+     * [nThreads] 0 every core is used. [onProgress] gets tensors done and the
+     * total before each tensor, and returning false cancels with a
+     * CancellationException before the next one. Fails with an
+     * IllegalStateException while another quantization is running.
+     */
+    suspend fun quantizeModel(
+        srcPath: String,
+        dstPath: String,
+        type: QuantizationType,
+        nThreads: Int = 0,
+        onProgress: ((done: Int, total: Int) -> Boolean)? = null
+    ): Result<Unit> = withContext(Dispatchers.IO) {
+        if (!File(srcPath).exists()) {
+            return@withContext Result.failure(Exception("Model file not found: $srcPath"))
+        }
+        
+        val cancelled = AtomicBoolean(false)
+        val progressCallback = object : QuantizeProgressCallback {
+            override fun onProgress(done: Int, total: Int): Boolean {
+                val keepGoing = !cancelled.get() && (onProgress?.invoke(done, total) ?: true)
+                if (!keepGoing) {
+                    cancelled.set(true)
+                }
+                return keepGoing
+            }
+        }
+        
+        activeQuantizeCancelled = cancelled
+        val threads = if (nThreads > 0) nThreads else availableCores()
+        when (nativeQuantize(srcPath, dstPath, type.nativeValue, threads, progressCallback)) {
+            QUANTIZE_OK -> Result.success(Unit)
+            QUANTIZE_CANCELLED -> Result.failure(CancellationException("Quantization cancelled"))
+            QUANTIZE_BUSY -> Result.failure(IllegalStateException("Another quantization is running"))
+            else -> Result.failure(Exception("Failed to quantize model"))
+        }
+    }
+    
+    /** Cancels a [quantizeModel] in progress; it returns once the current tensor is written. */
+    fun cancelQuantize() {
+        activeQuantizeCancelled?.set(true)
+        nativeCancelQuantize()
+    }
+    
+    /** Aborts a [loadModel] in progress; a no-op when nothing is loading. */
+    fun cancelLoad() {
+        activeLoadCancelled?.set(true)
+        nativeCancelLoad()
+    }
+    
+    /**
+     * Loads a LoRA adapter GGUF on the serving model so the first request using it
+     * does not pay for the load. Adapters stay loaded until [unloadLoraAdapter] or
+     * the model is freed; switching between them per request costs no reload.
+     */
+    suspend fun loadLoraAdapter(loraPath: String): Boolean = withContext(Dispatchers.IO) {
+        isModelLoaded && File(loraPath).exists() && nativeLoadLora(loraPath)
+    }
+    
+    suspend fun unloadLoraAdapter(loraPath: String) = withContext(Dispatchers.IO) {
+        if (isModelLoaded) {
+            nativeUnloadLora(loraPath)
+        }
+    }
+    
+    /**
+     * Bytes the serving model and recently used ones may take together. A model
+     * replaced by [loadModel] stays parked while it fits, so loading it again or
+     * passing its path to a request swaps it back without reading the file.
+     */
+    fun setModelCacheLimit(bytes: Long) {
+        nativeSetModelCacheLimit(bytes.coerceAtLeast(0))
+    }
+    
+    /**
+     * Starts reading the weights into the page cache in layer order on a native
+     * background thread. Returns false if the model is not memory-mapped.
+     */
+    fun prefetchWeights(): Boolean = isModelLoaded && nativePrefetchWeights()
+    
+    /** How much of the memory-mapped weights is resident, or null if unknown. */
+    fun getWeightResidency(): WeightResidency? {
+        val values = nativeGetWeightResidency() ?: return null
+        return WeightResidency(residentBytes = values[0], totalBytes = values[1])
+    }
+    
     fun unloadModel() {
         if (isModelLoaded) {
             nativeUnloadModel()
             isModelLoaded = false
+            _loadStats.value = null
             Log.i(TAG, "Model unloaded")
         }
     }
     
+    /**
+     * With [modelPath] set to a parked model, that model is swapped in to serve the request.
+     * [loraAdapters] maps LoRA GGUF paths to scales for this request only.
+     */
     suspend fun generate(
         prompt: String,
         maxTokens: Int = 512,
         temperature: Float = 0.7f,
         topP: Float = 0.9f,
-        topK: Int = 40
+        topK: Int = 40,
+        modelPath: String? = null,
+        loraAdapters: Map<String, Float> = emptyMap()
     ): Result<String> = withContext(Dispatchers.IO) {
         try {
             if (!isModelLoaded) {
@@ -120,7 +555,10 @@ class LlamaEngine @Inject constructor() {
             }
             
             isGenerating = true
-            val response = nativeGenerate(prompt, maxTokens, temperature, topP, topK)
+            val response = nativeGenerate(
+                prompt, maxTokens, temperature, topP, topK, modelPath,
+                loraAdapters.keys.toTypedArray(), loraAdapters.values.toFloatArray()
+            )
             isGenerating = false
             
             Result.success(response)
@@ -131,12 +569,28 @@ class LlamaEngine @Inject constructor() {
         }
     }
     
+    /**
+     * Streams a completion for a prompt given as one segment per message.
+     * The engine checkpoints every segment boundary and reuses the KV cache for the
+     * unchanged prefix of the previous prompt, so only new messages are prefilled.
+     * Segments with a message id are tokenized once and cached by id and role.
+     * Unpinned history segments that do not fit beside [maxTokens] are left out, oldest first.
+     *
+     * With [onTokenLogprobs] set, each token is preceded by its log-probability and up
+     * to [topLogprobs] alternatives, computed during sampling at no extra vocab pass.
+     * A [modelPath] naming a parked model swaps it in first. [loraAdapters] maps LoRA
+     * GGUF paths to scales; cached prefixes are only reused under the same adapters.
+     */
     suspend fun generateStream(
-        prompt: String,
+        promptSegments: List<PromptSegment>,
         maxTokens: Int = 512,
         temperature: Float = 0.7f,
         topP: Float = 0.9f,
         topK: Int = 40,
+        topLogprobs: Int = 0,
+        onTokenLogprobs: ((TokenLogprobs) -> Unit)? = null,
+        modelPath: String? = null,
+        loraAdapters: Map<String, Float> = emptyMap(),
         onToken: (String) -> Unit,
         onComplete: () -> Unit
     ) = withContext(Dispatchers.IO) {
@@ -145,7 +599,7 @@ class LlamaEngine @Inject constructor() {
             Log.d(TAG, "isModelLoaded: $isModelLoaded")
             Log.d(TAG, "isGenerating (before): $isGenerating")
             Log.d(TAG, "maxTokens: $maxTokens, temperature: $temperature")
-            Log.d(TAG, "Prompt length: ${prompt.length} chars")
+            Log.d(TAG, "Prompt: ${promptSegments.size} segments, ${promptSegments.sumOf { it.text.length }} chars")
             
             if (!isModelLoaded) {
                 Log.e(TAG, "BLOCKED: No model loaded")
@@ -161,12 +615,22 @@ class LlamaEngine @Inject constructor() {
             isGenerating = true
             Log.d(TAG, "Set isGenerating = true, starting native generation")
             
+            val logprobBuffer = onTokenLogprobs?.let {
+                ByteBuffer.allocateDirect(LOGPROB_RECORD_BYTES).order(ByteOrder.nativeOrder())
+            }
+            
             val callback = object : StreamCallback {
                 override fun onToken(token: String) {
                     Log.v(TAG, "Token callback: '$token'")
                     onToken(token)
                 }
                 
+                override fun onTokenLogprobs(length: Int) {
+                    if (onTokenLogprobs != null && logprobBuffer != null && length > 0) {
+                        onTokenLogprobs(readLogprobRecord(logprobBuffer, length))
+                    }
+                }
+                
                 override fun onComplete() {
                     Log.d(TAG, "Complete callback received, resetting isGenerating flag")
                     isGenerating = false
@@ -176,7 +640,22 @@ class LlamaEngine @Inject constructor() {
             
             try {
                 Log.d(TAG, "Calling nativeGenerateStream...")
-                nativeGenerateStream(prompt, maxTokens, temperature, topP, topK, callback)
+                nativeGenerateStream(
+                    promptSegments.map { it.text }.toTypedArray(),
+                    promptSegments.map { it.messageId }.toLongArray(),
+                    promptSegments.map { it.role.nativeValue }.toIntArray(),
+                    promptSegments.map { it.pinned }.toBooleanArray(),
+                    maxTokens,
+                    temperature,
+                    topP,
+                    topK,
+                    topLogprobs.coerceIn(0, MAX_TOP_LOGPROBS),
+                    logprobBuffer,
+                    modelPath,
+                    loraAdapters.keys.toTypedArray(),
+                    loraAdapters.values.toFloatArray(),
+                    callback
+                )
                 Log.d(TAG, "nativeGenerateStream returned")
             } catch (e: Exception) {
                 Log.e(TAG, "Native generation threw exception", e)
@@ -192,6 +671,288 @@ class LlamaEngine @Inject constructor() {
         }
     }
     
+    /**
+     * Number of unpinned history segments, oldest first, that [generateStream] would not
+     * put in [promptSegments] verbatim (summarized into a memory or left out) if
+     * [reserveTokens] more were added to the prompt. Counts exact tokens, which stay
+     * cached for the generation. Returns -1 without a model.
+     */
+    suspend fun fitPrompt(
+        promptSegments: List<PromptSegment>,
+        maxTokens: Int,
+        reserveTokens: Int = 0
+    ): Int = withContext(Dispatchers.IO) {
+        if (!isModelLoaded) {
+            return@withContext -1
+        }
+        nativeFitPrompt(
+            promptSegments.map { it.text }.toTypedArray(),
+            promptSegments.map { it.messageId }.toLongArray(),
+            promptSegments.map { it.role.nativeValue }.toIntArray(),
+            promptSegments.map { it.pinned }.toBooleanArray(),
+            maxTokens,
+            reserveTokens
+        )
+    }
+    
+    /** Decodes one record written by the native sampler (layout in llama_jni.cpp). */
+    private fun readLogprobRecord(buffer: ByteBuffer, length: Int): TokenLogprobs {
+        val record = buffer.duplicate().order(ByteOrder.nativeOrder())
+        record.limit(length)
+        val tokenId = record.int
+        val logprob = record.float
+        val count = record.int
+        val alternatives = List(count) {
+            val id = record.int
+            val altLogprob = record.float
+            val bytes = ByteArray(record.short.toInt() and 0xFFFF)
+            record.get(bytes)
+            TokenAlternative(id, String(bytes, Charsets.UTF_8), altLogprob)
+        }
+        return TokenLogprobs(tokenId, logprob, alternatives)
+    }
+    
+    /**
+     * Log-probability of each candidate as a continuation of [prompt], computed with one
+     * prompt prefill and batched candidate decodes instead of generating. The chat KV
+     * cache is left as it was, and a prompt sharing its prefix reuses it.
+     */
+    suspend fun score(
+        prompt: String,
+        candidates: List<String>,
+        modelPath: String? = null,
+        loraAdapters: Map<String, Float> = emptyMap()
+    ): Result<List<CandidateScore>> = withContext(Dispatchers.IO) {
+        if (!isModelLoaded) {
+            return@withContext Result.failure(Exception("No model loaded"))
+        }
+        
+        try {
+            val packed = nativeScore(
+                prompt, candidates.toTypedArray(), modelPath,
+                loraAdapters.keys.toTypedArray(), loraAdapters.values.toFloatArray()
+            ) ?: return@withContext Result.failure(Exception("Scoring failed"))
+            
+            // Layout per candidate: total, token count, token log-probs
+            var offset = 0
+            val scores = candidates.map { candidate ->
+                val total = packed[offset]
+                val count = packed[offset + 1].toInt()
+                val tokens = packed.copyOfRange(offset + 2, offset + 2 + count).toList()
+                offset += 2 + count
+                CandidateScore(candidate, total, tokens)
+            }
+            Result.success(scores)
+        } catch (e: Exception) {
+            Log.e(TAG, "Scoring error", e)
+            Result.failure(e)
+        }
+    }
+    
+    /**
+     * Rewinds the KV cache to the checkpoint before segment [messageIndex] of the last
+     * streamed prompt (0 is the system prompt). The dropped branch stays stashed, so
+     * regenerating costs no prefill and editing a message only prefills from the edit.
+     * Returns the number of cached tokens kept, or -1 if the checkpoint is unknown.
+     */
+    suspend fun forkAt(messageIndex: Int): Int = withContext(Dispatchers.IO) {
+        if (!isModelLoaded) {
+            return@withContext -1
+        }
+        val kept = nativeForkAt(messageIndex)
+        Log.d(TAG, "forkAt($messageIndex) kept $kept tokens")
+        kept
+    }
+    
+    /**
+     * Creates the embedding context. Without [modelPath] it runs on the loaded chat model
+     * (mean pooling by default); otherwise a dedicated embedding GGUF is loaded for it.
+     * Up to [maxSequences] texts totalling [batchSize] tokens are embedded per batch.
+     */
+    suspend fun loadEmbeddingModel(
+        modelPath: String? = null,
+        pooling: EmbeddingPooling = EmbeddingPooling.MODEL_DEFAULT,
+        nThreads: Int = 4,
+        batchSize: Int = 2048,
+        maxSequences: Int = 16
+    ): Result<Unit> = withContext(Dispatchers.IO) {
+        try {
+            if (modelPath == null && !isModelLoaded) {
+                return@withContext Result.failure(Exception("No model loaded"))
+            }
+            if (modelPath != null && !File(modelPath).exists()) {
+                return@withContext Result.failure(Exception("Embedding model not found: $modelPath"))
+            }
+            
+            val success = nativeLoadEmbeddingModel(
+                modelPath, pooling.nativeValue, nThreads, batchSize, maxSequences
+            )
+            if (success) {
+                Log.i(TAG, "Embedding context ready (dim ${nativeGetEmbeddingDim()})")
+                Result.success(Unit)
+            } else {
+                Result.failure(Exception("Failed to create embedding context"))
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Error loading embedding model", e)
+            Result.failure(e)
+        }
+    }
+    
+    fun unloadEmbeddingModel() {
+        nativeUnloadEmbeddingModel()
+    }
+    
+    /** Embedding dimension, or 0 when no embedding context is loaded. */
+    fun getEmbeddingDim(): Int = nativeGetEmbeddingDim()
+    
+    /** Bytes per row written by [embedInto]: float32 values, or a float scale plus int8 values. */
+    fun embeddingRowBytes(int8: Boolean): Int {
+        val dim = getEmbeddingDim()
+        return if (int8) Float.SIZE_BYTES + dim else Float.SIZE_BYTES * dim
+    }
+    
+    /**
+     * Embeds [texts] straight into a direct [out] buffer (native byte order), one row
+     * per text. Returns the number of rows written, or -1 on failure.
+     */
+    suspend fun embedInto(
+        texts: List<String>,
+        out: ByteBuffer,
+        int8: Boolean = false,
+        normalize: Boolean = true
+    ): Int = withContext(Dispatchers.IO) {
+        require(out.isDirect) { "Embedding output buffer must be direct" }
+        nativeEmbed(texts.toTypedArray(), normalize, int8, out)
+    }
+    
+    suspend fun embed(
+        texts: List<String>,
+        normalize: Boolean = true
+    ): Result<List<FloatArray>> = withContext(Dispatchers.IO) {
+        try {
+            val dim = getEmbeddingDim()
+            if (dim == 0) {
+                return@withContext Result.failure(Exception("No embedding model loaded"))
+            }
+            
+            val buffer = ByteBuffer.allocateDirect(texts.size * embeddingRowBytes(int8 = false))
+                .order(ByteOrder.nativeOrder())
+            val rows = nativeEmbed(texts.toTypedArray(), normalize, false, buffer)
+            if (rows < 0) {
+                return@withContext Result.failure(Exception("Embedding failed"))
+            }
+            
+            val floats = buffer.asFloatBuffer()
+            Result.success(List(rows) { FloatArray(dim).also { floats.get(it) } })
+        } catch (e: Exception) {
+            Log.e(TAG, "Embedding error", e)
+            Result.failure(e)
+        }
+    }
+    
+    /**
+     * Opens the memory-mapped vector index at [indexPath] for the current embedding
+     * dimension. Returns a handle for the index calls below, or 0 on failure.
+     */
+    suspend fun openIndex(indexPath: String): Long = withContext(Dispatchers.IO) {
+        val dim = getEmbeddingDim()
+        if (dim == 0) 0L else nativeIndexOpen(indexPath, dim)
+    }
+    
+    fun closeIndex(handle: Long) {
+        nativeIndexClose(handle)
+    }
+    
+    /** Embeds [texts] and stores them under [ids] in [group]. */
+    suspend fun indexTexts(
+        handle: Long,
+        group: Long,
+        ids: List<Long>,
+        texts: List<String>
+    ): Boolean = withContext(Dispatchers.IO) {
+        nativeIndexAddTexts(handle, ids.toLongArray(), group, texts.toTypedArray())
+    }
+    
+    /** Ids of the [k] stored texts closest to [query] within [group], best first. */
+    suspend fun searchIndex(
+        handle: Long,
+        group: Long,
+        query: String,
+        k: Int
+    ): Result<List<Pair<Long, Float>>> = withContext(Dispatchers.IO) {
+        val ids = LongArray(k)
+        val scores = FloatArray(k)
+        val hits = nativeIndexSearchText(handle, group, query, k, ids, scores)
+        if (hits < 0) {
+            Result.failure(Exception("Index search failed"))
+        } else {
+            Result.success(List(hits) { ids[it] to scores[it] })
+        }
+    }
+    
+    /** Highest id indexed in [group], or -1 when it has none. */
+    fun indexMaxId(handle: Long, group: Long): Long = nativeIndexMaxId(handle, group)
+    
+    fun removeIndexGroup(handle: Long, group: Long): Int = nativeIndexRemoveGroup(handle, group)
+    
+    /**
+     * Times a short prefill and decode at each thread count on the loaded model, either
+     * on pinned threadpools or on ggml's default threads. The thread settings in effect
+     * before the call are kept.
+     */
+    suspend fun benchmarkThreads(
+        threadCounts: List<Int>,
+        pinned: Boolean = false,
+        promptTokens: Int = 64,
+        genTokens: Int = 16
+    ): Result<List<ThreadBenchmark>> = withContext(Dispatchers.IO) {
+        if (!isModelLoaded) {
+            return@withContext Result.failure(Exception("No model loaded"))
+        }
+        
+        val packed = nativeBenchmarkThreads(threadCounts.toIntArray(), promptTokens, genTokens, pinned)
+            ?: return@withContext Result.failure(Exception("Thread benchmark failed"))
+        
+        Result.success(packed.toList().chunked(3).map { (threads, prefill, decode) ->
+            ThreadBenchmark(threads.toInt(), pinned, prefill, decode)
+        })
+    }
+    
+    /**
+     * Runs inference on explicit threadpools restricted to [decodeCpus] / [batchCpus]
+     * (null picks the fastest cores) when [pinned], or on ggml's default threads.
+     * Applies to the loaded model and to later loads. [poll] ranges from 0 (sleep
+     * between graphs) to 100 (spin). Returns true if pinned threadpools are active.
+     */
+    suspend fun configureThreadpools(
+        pinned: Boolean,
+        decodeCpus: List<Int>? = null,
+        batchCpus: List<Int>? = null,
+        priority: ThreadPriority = ThreadPriority.NORMAL,
+        poll: Int = 50
+    ): Boolean = withContext(Dispatchers.IO) {
+        nativeConfigureThreadpools(
+            pinned,
+            decodeCpus?.toIntArray(),
+            batchCpus?.toIntArray(),
+            priority.nativeValue,
+            poll
+        )
+    }
+    
+    /** Online CPU ids with their relative capacity, fastest first. */
+    fun getCpuCapacities(): List<Pair<Int, Int>> =
+        nativeGetCpuCapacities().toList().chunked(2).map { (cpu, capacity) -> cpu to capacity }
+    
+    fun setThreads(nThreads: Int, nThreadsBatch: Int) {
+        if (isModelLoaded) {
+            nativeSetThreads(nThreads, nThreadsBatch)
+        }
+    }
+    
+    fun availableCores(): Int = Runtime.getRuntime().availableProcessors().coerceAtLeast(1)
+    
     fun stopGeneration() {
         Log.d(TAG, "stopGeneration called, resetting flag")
         if (isGenerating) {
@@ -209,6 +970,12 @@ class LlamaEngine @Inject constructor() {
         }
     }
     
+    /**
+     * CPU backend build picked for this device at startup, e.g.
+     * "armv8.2_dotprod_i8mm (NEON ARM_FMA DOTPROD MATMUL_INT8 ...)"; empty if none loaded.
+     */
+    fun getCpuBackend(): String = nativeGetCpuBackend()
+    
     fun isLoaded(): Boolean = isModelLoaded
     
     fun cleanup() {
@@ -216,8 +983,82 @@ class LlamaEngine @Inject constructor() {
         nativeCleanup()
     }
     
+    data class WeightResidency(
+        val residentBytes: Long,
+        val totalBytes: Long
+    ) {
+        val fraction: Float
+            get() = if (totalBytes > 0) residentBytes.toFloat() / totalBytes else 0f
+    }
+    
+    /**
+     * [warmupMs] stays null until the warmup finishes, and if it was cancelled.
+     * [hotSwapped] models were warmed up before they replaced the previous one.
+     */
+    data class LoadStats(
+        val loadMs: Long,
+        val warmupMs: Long? = null,
+        val hotSwapped: Boolean = false
+    )
+    
+    data class ThreadBenchmark(
+        val threads: Int,
+        val pinned: Boolean,
+        val prefillTokensPerSec: Float,
+        val decodeTokensPerSec: Float
+    )
+    
+    /** Matches ggml_sched_priority. */
+    enum class ThreadPriority(val nativeValue: Int) {
+        LOW(-1),
+        NORMAL(0),
+        MEDIUM(1),
+        HIGH(2),
+        REALTIME(3)
+    }
+    
+    /** ggml_type of the KV cache; quantized types run with flash attention. */
+    enum class KvCacheType(val nativeValue: Int) {
+        F16(1),
+        Q8_0(8);
+        
+        companion object {
+            fun fromNative(value: Int): KvCacheType = entries.firstOrNull { it.nativeValue == value } ?: F16
+        }
+    }
+    
+    data class MemoryPlan(
+        val contextSize: Int,
+        val nBatch: Int,
+        val kvCacheType: KvCacheType,
+        val weightBytes: Long,
+        val kvCacheBytes: Long,
+        val computeBytes: Long,
+        val overheadBytes: Long
+    ) {
+        val totalBytes: Long
+            get() = weightBytes + kvCacheBytes + computeBytes + overheadBytes
+    }
+    
+    /** Matches llama_pooling_type; MODEL_DEFAULT defers to the GGUF metadata. */
+    enum class EmbeddingPooling(val nativeValue: Int) {
+        MODEL_DEFAULT(-1),
+        MEAN(1),
+        CLS(2),
+        LAST(3)
+    }
+    
+    interface LoadProgressCallback {
+        fun onProgress(stage: Int, progress: Float): Boolean
+    }
+    
+    interface QuantizeProgressCallback {
+        fun onProgress(done: Int, total: Int): Boolean
+    }
+    
     interface StreamCallback {
         fun onToken(token: String)
+        fun onTokenLogprobs(length: Int)
         fun onComplete()
     }
 }
@@ -1,5 +1,6 @@
 package com.androgpt.yaser.data.inference
 
+import android.app.ActivityManager
 import android.content.Context
 import android.util.Log
 import com.androgpt.yaser.domain.model.ModelInfo
@@ -12,12 +13,15 @@ import javax.inject.Singleton
 
 @Singleton
 class ModelManager @Inject constructor(
-    @ApplicationContext private val context: Context
+    @ApplicationContext private val context: Context,
+    private val ggufIndex: GgufIndex
 ) {
     
     companion object {
         private const val TAG = "ModelManager"
         private const val MODELS_DIR = "models"
+        private const val REPACK_CACHE_SUFFIX = ".repack" // Sidecars written by the native loader
+        private const val ATTENTION_PROFILE_SUFFIX = ".attn"
     }
     
     private val modelsDirectory: File by lazy {
@@ -28,18 +32,42 @@ class ModelManager @Inject constructor(
         }
     }
     
+    /**
+     * Memory the engine may hold across a serving and a staged model: what is free
+     * above the low-memory threshold now, plus what the serving model already takes.
+     */
+    fun modelMemoryBudget(servingModelBytes: Long): Long {
+        val activityManager = context.getSystemService(ActivityManager::class.java) ?: return 0
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        return (memoryInfo.availMem - memoryInfo.threshold).coerceAtLeast(0) + servingModelBytes
+    }
+    
+    /**
+     * Default cap for the serving model plus parked ones: half the device RAM,
+     * leaving the rest to the system and other apps.
+     */
+    fun modelCacheLimit(): Long {
+        val activityManager = context.getSystemService(ActivityManager::class.java) ?: return 0
+        val memoryInfo = ActivityManager.MemoryInfo()
+        activityManager.getMemoryInfo(memoryInfo)
+        return memoryInfo.totalMem / 2
+    }
+    
     suspend fun getAvailableModels(): List<ModelInfo> = withContext(Dispatchers.IO) {
         try {
             val modelFiles = modelsDirectory.listFiles { file ->
                 file.isFile && file.extension.equals("gguf", ignoreCase = true)
             } ?: emptyArray()
             
+            val metadata = ggufIndex.lookup(modelFiles.toList())
             modelFiles.map { file ->
                 ModelInfo(
                     name = file.nameWithoutExtension,
                     filePath = file.absolutePath,
                     size = file.length(),
-                    isLoaded = false
+                    isLoaded = false,
+                    gguf = metadata[file.absolutePath]
                 )
             }
         } catch (e: Exception) {
@@ -52,6 +80,9 @@ class ModelManager @Inject constructor(
         try {
             val file = File(filePath)
             if (file.exists() && file.delete()) {
+                ggufIndex.remove(file.absolutePath)
+                File("$filePath$REPACK_CACHE_SUFFIX").delete()
+                File("$filePath$ATTENTION_PROFILE_SUFFIX").delete()
                 Result.success(Unit)
             } else {
                 Result.failure(Exception("Failed to delete model file"))
@@ -69,7 +100,8 @@ class ModelManager @Inject constructor(
                 ModelInfo(
                     name = file.nameWithoutExtension,
                     filePath = file.absolutePath,
-                    size = file.length()
+                    size = file.length(),
+                    gguf = ggufIndex.lookup(file)
                 )
             } else {
                 null
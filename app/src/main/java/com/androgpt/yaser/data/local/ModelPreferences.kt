@@ -3,7 +3,9 @@ package com.androgpt.yaser.data.local
 import android.content.Context
 import androidx.datastore.core.DataStore
 import androidx.datastore.preferences.core.Preferences
+import androidx.datastore.preferences.core.booleanPreferencesKey
 import androidx.datastore.preferences.core.edit
+import androidx.datastore.preferences.core.intPreferencesKey
 import androidx.datastore.preferences.core.longPreferencesKey
 import androidx.datastore.preferences.core.stringPreferencesKey
 import androidx.datastore.preferences.preferencesDataStore
@@ -20,6 +22,13 @@ class ModelPreferences(private val context: Context) {
         private val MODEL_SIZE = longPreferencesKey("loaded_model_size")
     }
     
+    /** Thread counts picked by the autotune pass for one model file on this device. */
+    data class ThreadTuning(
+        val nThreads: Int,
+        val nThreadsBatch: Int,
+        val pinned: Boolean
+    )
+    
     data class LoadedModelInfo(
         val name: String,
         val filePath: String,
@@ -55,4 +64,26 @@ class ModelPreferences(private val context: Context) {
             preferences.remove(MODEL_SIZE)
         }
     }
+    
+    suspend fun saveThreadTuning(tuningKey: String, tuning: ThreadTuning) {
+        context.dataStore.edit { preferences ->
+            preferences[intPreferencesKey("threads_decode_$tuningKey")] = tuning.nThreads
+            preferences[intPreferencesKey("threads_batch_$tuningKey")] = tuning.nThreadsBatch
+            preferences[booleanPreferencesKey("threads_pinned_$tuningKey")] = tuning.pinned
+        }
+    }
+    
+    fun getThreadTuning(tuningKey: String): Flow<ThreadTuning?> {
+        return context.dataStore.data.map { preferences ->
+            val decode = preferences[intPreferencesKey("threads_decode_$tuningKey")]
+            val batch = preferences[intPreferencesKey("threads_batch_$tuningKey")]
+            val pinned = preferences[booleanPreferencesKey("threads_pinned_$tuningKey")]
+            
+            if (decode != null && batch != null && pinned != null) {
+                ThreadTuning(decode, batch, pinned)
+            } else {
+                null
+            }
+        }
+    }
 }
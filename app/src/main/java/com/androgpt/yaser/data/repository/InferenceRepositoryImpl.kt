@@ -1,7 +1,10 @@
 package com.androgpt.yaser.data.repository
 
 import com.androgpt.yaser.data.inference.LlamaEngine
+import com.androgpt.yaser.domain.model.CandidateScore
 import com.androgpt.yaser.domain.model.GenerationState
+import com.androgpt.yaser.domain.model.PromptSegment
+import com.androgpt.yaser.domain.model.TokenLogprobs
 import com.androgpt.yaser.domain.repository.InferenceRepository
 import kotlinx.coroutines.channels.awaitClose
 import kotlinx.coroutines.flow.Flow
@@ -31,27 +34,33 @@ class InferenceRepositoryImpl @Inject constructor(
     }
     
     override fun generateStream(
-        prompt: String,
+        promptSegments: List<PromptSegment>,
         temperature: Float,
         maxTokens: Int,
         topP: Float,
-        topK: Int
+        topK: Int,
+        topLogprobs: Int,
+        loraAdapters: Map<String, Float>
     ): Flow<GenerationState> = callbackFlow {
         
         trySend(GenerationState.Loading)
         
         val fullText = StringBuilder()
+        var lastToken: TokenLogprobs? = null
         
         try {
             llamaEngine.generateStream(
-                prompt = prompt,
+                promptSegments = promptSegments,
                 maxTokens = maxTokens,
                 temperature = temperature,
                 topP = topP,
                 topK = topK,
+                topLogprobs = topLogprobs,
+                onTokenLogprobs = if (topLogprobs > 0) { logprobs -> lastToken = logprobs } else null,
+                loraAdapters = loraAdapters,
                 onToken = { token ->
                     fullText.append(token)
-                    trySend(GenerationState.Generating(fullText.toString()))
+                    trySend(GenerationState.Generating(fullText.toString(), lastToken))
                 },
                 onComplete = {
                     trySend(GenerationState.Complete(fullText.toString()))
@@ -68,6 +77,34 @@ class InferenceRepositoryImpl @Inject constructor(
         }
     }
     
+    override suspend fun fitPrompt(
+        promptSegments: List<PromptSegment>,
+        maxTokens: Int,
+        reserveTokens: Int
+    ): Int {
+        return llamaEngine.fitPrompt(promptSegments, maxTokens, reserveTokens)
+    }
+    
+    override fun scheduleHistoryCompaction(instruction: String, memoryPrefix: String, memorySuffix: String) {
+        llamaEngine.scheduleCompaction(instruction, memoryPrefix, memorySuffix)
+    }
+    
+    override suspend fun forkAt(messageIndex: Int): Boolean {
+        return llamaEngine.forkAt(messageIndex) >= 0
+    }
+    
+    override suspend fun score(prompt: String, candidates: List<String>): Result<List<CandidateScore>> {
+        return llamaEngine.score(prompt, candidates)
+    }
+    
+    override suspend fun loadLoraAdapter(path: String): Boolean {
+        return llamaEngine.loadLoraAdapter(path)
+    }
+    
+    override suspend fun unloadLoraAdapter(path: String) {
+        llamaEngine.unloadLoraAdapter(path)
+    }
+    
     override suspend fun stopGeneration() {
         llamaEngine.stopGeneration()
     }
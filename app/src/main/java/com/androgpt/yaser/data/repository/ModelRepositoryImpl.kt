@@ -1,11 +1,14 @@
 package com.androgpt.yaser.data.repository
 
+import android.os.Build
 import android.util.Log
 import com.androgpt.yaser.data.inference.LlamaEngine
 import com.androgpt.yaser.data.inference.ModelManager
 import com.androgpt.yaser.data.local.ModelPreferences
 import com.androgpt.yaser.domain.model.ModelConfig
 import com.androgpt.yaser.domain.model.ModelInfo
+import com.androgpt.yaser.domain.model.ModelLoadProgress
+import com.androgpt.yaser.domain.model.QuantizationType
 import com.androgpt.yaser.domain.repository.ModelRepository
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
@@ -28,6 +31,8 @@ class ModelRepositoryImpl @Inject constructor(
     
     private val scope = CoroutineScope(SupervisorJob() + Dispatchers.Main)
     private val _loadedModel = MutableStateFlow<ModelInfo?>(null)
+    private val _loadProgress = MutableStateFlow<ModelLoadProgress?>(null)
+    private val _quantizeProgress = MutableStateFlow<Float?>(null)
     
     init {
         // Restore previously loaded model on startup
@@ -58,12 +63,56 @@ class ModelRepositoryImpl @Inject constructor(
     }
     
     override suspend fun loadModel(config: ModelConfig): Result<Unit> {
+        val tuningKey = threadTuningKey(config)
+        val tuned = if (config.autotuneThreads) {
+            modelPreferences.getThreadTuning(tuningKey).firstOrNull()
+        } else {
+            null
+        }
+        
+        llamaEngine.configureThreadpools(pinned = tuned?.pinned ?: config.pinThreads)
+        
+        val memoryBudget = if (config.memoryBudgetMb > 0) {
+            config.memoryBudgetMb.toLong() shl 20
+        } else {
+            modelManager.modelMemoryBudget(servingModelBytes = _loadedModel.value?.size ?: 0L)
+        }
+        
+        llamaEngine.setModelCacheLimit(
+            if (config.modelCacheMb > 0) config.modelCacheMb.toLong() shl 20 else modelManager.modelCacheLimit()
+        )
+        
         val result = llamaEngine.loadModel(
             modelPath = config.filePath,
-            nThreads = config.nThreads,
+            nThreads = tuned?.nThreads ?: config.nThreads,
+            nThreadsBatch = tuned?.nThreadsBatch ?: config.nThreadsBatch,
             nGpuLayers = config.nGpuLayers,
-            contextSize = config.contextLength
+            contextSize = config.contextLength,
+            flashAttention = config.flashAttention,
+            useMmap = config.useMmap,
+            useMlock = config.useMlock,
+            memoryBudgetBytes = memoryBudget,
+            onProgress = { progress ->
+                _loadProgress.value = progress
+                true
+            }
         )
+        _loadProgress.value = null
+        
+        if (result.isFailure && !llamaEngine.isLoaded()) {
+            // The previous model was unloaded to make room for this one
+            _loadedModel.value = null
+        }
+        
+        if (result.isSuccess && config.useMmap && config.prefetchWeights) {
+            llamaEngine.prefetchWeights()
+        }
+        
+        // The autotune benchmark already pages in every weight, warmup would be redundant
+        val autotuned = result.isSuccess && config.autotuneThreads && tuned == null
+        if (autotuned) {
+            autotuneThreads(tuningKey)
+        }
         
         if (result.isSuccess) {
             val modelInfo = ModelInfo(
@@ -75,6 +124,20 @@ class ModelRepositoryImpl @Inject constructor(
             )
             _loadedModel.value = modelInfo
             
+            // A hot-swapped model was warmed up before it took over
+            val hotSwapped = llamaEngine.loadStats.value?.hotSwapped == true
+            if (config.warmup && !autotuned && !hotSwapped) {
+                llamaEngine.startWarmup { warmupMs ->
+                    llamaEngine.getWeightResidency()?.let {
+                        Log.i("ModelRepository", "Weights resident: ${it.residentBytes shr 20}/${it.totalBytes shr 20} MiB")
+                    }
+                    // Refresh the metadata so it reports the warmup time
+                    if (warmupMs != null && _loadedModel.value?.filePath == config.filePath) {
+                        _loadedModel.value = _loadedModel.value?.copy(metadata = llamaEngine.getModelInfo())
+                    }
+                }
+            }
+            
             // Persist the loaded model info
             try {
                 modelPreferences.saveLoadedModel(
@@ -91,6 +154,59 @@ class ModelRepositoryImpl @Inject constructor(
         return result
     }
     
+    /**
+     * First load of a model on this device: time prefill and decode separately at a few
+     * thread counts, on default threads and on threadpools pinned to the fastest cores,
+     * then apply the fastest combination and remember it for later loads.
+     */
+    private suspend fun autotuneThreads(tuningKey: String) {
+        val cores = llamaEngine.availableCores()
+        val candidates = (listOf(1, 2, 4, 6, 8) + cores).filter { it <= cores }.distinct().sorted()
+        
+        val runs = listOf(false, true).flatMap { pinned ->
+            llamaEngine.benchmarkThreads(candidates, pinned)
+                .onFailure { Log.w("ModelRepository", "Thread benchmark (pinned=$pinned) failed", it) }
+                .getOrDefault(emptyList())
+        }
+        runs.forEach {
+            Log.i(
+                "ModelRepository",
+                "Threads ${it.threads} ${if (it.pinned) "pinned" else "unpinned"}: " +
+                    "prefill ${it.prefillTokensPerSec} tok/s, decode ${it.decodeTokensPerSec} tok/s"
+            )
+        }
+        
+        // Decode speed decides pinning since it dominates perceived latency
+        val bestDecode = runs.maxByOrNull { it.decodeTokensPerSec } ?: run {
+            Log.w("ModelRepository", "Thread autotune failed, keeping configured threads")
+            return
+        }
+        val bestPrefill = runs.filter { it.pinned == bestDecode.pinned }
+            .maxByOrNull { it.prefillTokensPerSec } ?: bestDecode
+        val tuning = ModelPreferences.ThreadTuning(bestDecode.threads, bestPrefill.threads, bestDecode.pinned)
+        
+        llamaEngine.configureThreadpools(pinned = tuning.pinned)
+        llamaEngine.setThreads(tuning.nThreads, tuning.nThreadsBatch)
+        modelPreferences.saveThreadTuning(tuningKey, tuning)
+        Log.i(
+            "ModelRepository",
+            "Thread autotune: decode ${tuning.nThreads} (${bestDecode.decodeTokensPerSec} tok/s), " +
+                "prefill ${tuning.nThreadsBatch} (${bestPrefill.prefillTokensPerSec} tok/s), pinned=${tuning.pinned}"
+        )
+    }
+    
+    /** Tuning depends on the model file and the SoC, so both are part of the key. */
+    private fun threadTuningKey(config: ModelConfig): String {
+        val file = File(config.filePath)
+        return "${file.name}_${file.length()}_${Build.MANUFACTURER}_${Build.MODEL}_${llamaEngine.availableCores()}"
+    }
+    
+    override fun getLoadProgress(): Flow<ModelLoadProgress?> = _loadProgress.asStateFlow()
+    
+    override fun cancelLoad() {
+        llamaEngine.cancelLoad()
+    }
+    
     override suspend fun unloadModel() {
         llamaEngine.unloadModel()
         _loadedModel.value = null
@@ -123,4 +239,37 @@ class ModelRepositoryImpl @Inject constructor(
     override suspend fun getModelInfo(filePath: String): ModelInfo? {
         return modelManager.getModelInfo(filePath)
     }
+    
+    override suspend fun quantizeModel(filePath: String, type: QuantizationType): Result<ModelInfo> {
+        val source = File(filePath)
+        val target = File(source.parentFile, "${source.nameWithoutExtension}-${type.name}.gguf")
+        if (target.exists()) {
+            return Result.failure(Exception("${target.name} already exists"))
+        }
+        
+        // Progress starts with the first tensor, so a call turned away because another
+        // quantization is running leaves that one's progress alone
+        val result = llamaEngine.quantizeModel(
+            srcPath = source.absolutePath,
+            dstPath = target.absolutePath,
+            type = type,
+            onProgress = { done, total ->
+                _quantizeProgress.value = done.toFloat() / total
+                true
+            }
+        )
+        if (result.exceptionOrNull() !is IllegalStateException) {
+            _quantizeProgress.value = null
+        }
+        
+        return result.mapCatching {
+            modelManager.getModelInfo(target.absolutePath) ?: throw Exception("Quantized model is missing")
+        }
+    }
+    
+    override fun getQuantizeProgress(): Flow<Float?> = _quantizeProgress.asStateFlow()
+    
+    override fun cancelQuantize() {
+        llamaEngine.cancelQuantize()
+    }
 }
@@ -0,0 +1,139 @@
+package com.androgpt.yaser.data.repository
+
+import android.content.Context
+import android.util.Log
+import com.androgpt.yaser.data.inference.LlamaEngine
+import com.androgpt.yaser.domain.model.Message
+import com.androgpt.yaser.domain.repository.ModelRepository
+import com.androgpt.yaser.domain.repository.RetrievalRepository
+import dagger.hilt.android.qualifiers.ApplicationContext
+import kotlinx.coroutines.flow.firstOrNull
+import kotlinx.coroutines.sync.Mutex
+import kotlinx.coroutines.sync.withLock
+import java.io.File
+import javax.inject.Inject
+import javax.inject.Singleton
+
+/**
+ * Retrieval over older conversation history, backed by the native vector index.
+ * Messages are embedded lazily the first time they fall outside the prompt window;
+ * each conversation is one index group and message ids only grow, so anything above
+ * the group's highest indexed id is new.
+ */
+@Singleton
+class RetrievalRepositoryImpl @Inject constructor(
+    private val llamaEngine: LlamaEngine,
+    private val modelRepository: ModelRepository,
+    @ApplicationContext private val context: Context
+) : RetrievalRepository {
+    
+    companion object {
+        private const val TAG = "RetrievalRepository"
+        private const val INDEX_DIR = "history_index"
+        private const val EMBED_BATCH = 32
+        private const val MAX_TEXT_CHARS = 2000
+    }
+    
+    private val mutex = Mutex()
+    private var indexHandle = 0L
+    private var indexPath: String? = null
+    
+    private val indexDir: File
+        get() = File(context.filesDir, INDEX_DIR)
+    
+    override suspend fun findRelevantMessages(
+        conversationId: Long,
+        candidates: List<Message>,
+        query: String,
+        limit: Int
+    ): List<Message> = mutex.withLock {
+        if (candidates.isEmpty() || limit <= 0) {
+            return@withLock emptyList()
+        }
+        
+        val handle = openIndex() ?: return@withLock emptyList()
+        
+        val lastIndexed = llamaEngine.indexMaxId(handle, conversationId)
+        val pending = candidates.filter { it.id > lastIndexed && it.content.isNotBlank() }
+        for (chunk in pending.chunked(EMBED_BATCH)) {
+            val added = llamaEngine.indexTexts(
+                handle = handle,
+                group = conversationId,
+                ids = chunk.map { it.id },
+                texts = chunk.map { it.content.take(MAX_TEXT_CHARS) }
+            )
+            if (!added) {
+                Log.w(TAG, "Failed to index ${chunk.size} messages for conversation $conversationId")
+                break
+            }
+        }
+        if (pending.isNotEmpty()) {
+            Log.d(TAG, "Indexed ${pending.size} messages for conversation $conversationId")
+        }
+        
+        val byId = candidates.associateBy { it.id }
+        llamaEngine.searchIndex(handle, conversationId, query, limit).fold(
+            onSuccess = { hits ->
+                hits.mapNotNull { (id, _) -> byId[id] }.sortedBy { it.id }
+            },
+            onFailure = { e ->
+                Log.w(TAG, "History search failed", e)
+                emptyList()
+            }
+        )
+    }
+    
+    override suspend fun removeConversation(conversationId: Long) {
+        mutex.withLock {
+            val handle = openIndex() ?: return
+            val removed = llamaEngine.removeIndexGroup(handle, conversationId)
+            Log.d(TAG, "Removed $removed indexed messages of conversation $conversationId")
+        }
+    }
+    
+    override suspend fun clearAll() {
+        mutex.withLock {
+            closeIndex()
+            indexDir.deleteRecursively()
+        }
+    }
+    
+    /**
+     * Returns the index for the loaded model, loading its embedding context on demand.
+     * Vectors from different models are not comparable, so each model gets its own file.
+     */
+    private suspend fun openIndex(): Long? {
+        val model = modelRepository.getLoadedModel().firstOrNull() ?: return null
+        
+        if (llamaEngine.getEmbeddingDim() == 0) {
+            llamaEngine.loadEmbeddingModel().onFailure {
+                Log.w(TAG, "Embedding context unavailable, skipping retrieval", it)
+                return null
+            }
+        }
+        
+        val path = File(indexDir, "${model.name}.vidx").absolutePath
+        if (indexHandle != 0L && indexPath == path) {
+            return indexHandle
+        }
+        
+        closeIndex()
+        indexDir.mkdirs()
+        val handle = llamaEngine.openIndex(path)
+        if (handle == 0L) {
+            Log.w(TAG, "Failed to open history index at $path")
+            return null
+        }
+        indexHandle = handle
+        indexPath = path
+        return handle
+    }
+    
+    private fun closeIndex() {
+        if (indexHandle != 0L) {
+            llamaEngine.closeIndex(indexHandle)
+            indexHandle = 0L
+            indexPath = null
+        }
+    }
+}
@@ -1,10 +1,12 @@
 package com.androgpt.yaser.di
 
+import android.content.Context
 import com.androgpt.yaser.data.inference.LlamaEngine
 import com.androgpt.yaser.data.inference.ModelManager
 import dagger.Module
 import dagger.Provides
 import dagger.hilt.InstallIn
+import dagger.hilt.android.qualifiers.ApplicationContext
 import dagger.hilt.components.SingletonComponent
 import javax.inject.Singleton
 
@@ -14,7 +16,7 @@ object InferenceModule {
     
     @Provides
     @Singleton
-    fun provideLlamaEngine(): LlamaEngine {
-        return LlamaEngine()
+    fun provideLlamaEngine(@ApplicationContext context: Context): LlamaEngine {
+        return LlamaEngine(context)
     }
 }
@@ -3,9 +3,11 @@ package com.androgpt.yaser.di
 import com.androgpt.yaser.data.repository.ChatRepositoryImpl
 import com.androgpt.yaser.data.repository.InferenceRepositoryImpl
 import com.androgpt.yaser.data.repository.ModelRepositoryImpl
+import com.androgpt.yaser.data.repository.RetrievalRepositoryImpl
 import com.androgpt.yaser.domain.repository.ChatRepository
 import com.androgpt.yaser.domain.repository.InferenceRepository
 import com.androgpt.yaser.domain.repository.ModelRepository
+import com.androgpt.yaser.domain.repository.RetrievalRepository
 import dagger.Binds
 import dagger.Module
 import dagger.hilt.InstallIn
@@ -33,4 +35,10 @@ abstract class RepositoryModule {
     abstract fun bindInferenceRepository(
         inferenceRepositoryImpl: InferenceRepositoryImpl
     ): InferenceRepository
+    
+    @Binds
+    @Singleton
+    abstract fun bindRetrievalRepository(
+        retrievalRepositoryImpl: RetrievalRepositoryImpl
+    ): RetrievalRepository
 }
@@ -0,0 +1,15 @@
+package com.androgpt.yaser.domain.model
+
+/**
+ * Likelihood of one candidate continuation: natural-log probabilities of each of
+ * its tokens and their sum.
+ */
+data class CandidateScore(
+    val candidate: String,
+    val logprob: Float,
+    val tokenLogprobs: List<Float>
+) {
+    /** Per-token average, comparable across candidates of different lengths. */
+    val meanLogprob: Float
+        get() = if (tokenLogprobs.isEmpty()) 0f else logprob / tokenLogprobs.size
+}
@@ -0,0 +1,12 @@
+package com.androgpt.yaser.domain.model
+
+/**
+ * Attention kernel for the chat context. AUTO benchmarks both on the first load of a
+ * model with a given context size and keeps the faster one; a quantized KV cache
+ * always runs with flash attention.
+ */
+enum class FlashAttentionMode(val nativeValue: Int) { // llama_flash_attn_type
+    AUTO(-1),
+    OFF(0),
+    ON(1)
+}
@@ -0,0 +1,34 @@
+package com.androgpt.yaser.domain.model
+
+import com.google.gson.annotations.SerializedName
+
+/**
+ * Model facts read from a GGUF header without loading the weights.
+ * Fields the file does not declare are empty or 0.
+ */
+data class GgufMetadata(
+    val name: String = "",
+    val architecture: String = "",
+    @SerializedName("size_label") val sizeLabel: String = "",
+    val quantization: String = "", // Tensor type holding most of the weights, e.g. "q4_K"
+    val version: Int = 0,
+    @SerializedName("n_params") val parameterCount: Long = 0,
+    @SerializedName("n_tensors") val tensorCount: Long = 0,
+    @SerializedName("weight_bytes") val weightBytes: Long = 0,
+    @SerializedName("metadata_bytes") val metadataBytes: Long = 0,
+    @SerializedName("file_type") val fileType: Int = 0,
+    @SerializedName("context_length") val contextLength: Int = 0,
+    @SerializedName("embedding_length") val embeddingLength: Int = 0,
+    @SerializedName("block_count") val blockCount: Int = 0,
+    @SerializedName("n_vocab") val vocabSize: Int = 0,
+    @SerializedName("chat_template") val chatTemplate: String = ""
+) {
+    /** "1.1B"-style parameter count, preferring the label the file declares. */
+    val parameterLabel: String
+        get() = when {
+            sizeLabel.isNotEmpty() -> sizeLabel
+            parameterCount >= 1_000_000_000L -> "%.1fB".format(parameterCount / 1e9)
+            parameterCount > 0 -> "%.0fM".format(parameterCount / 1e6)
+            else -> ""
+        }
+}
@@ -4,12 +4,22 @@ data class ModelConfig(
     val name: String,
     val filePath: String,
     val size: Long,
-    val contextLength: Int = 2048,
+    val contextLength: Int = 0, // 0 = largest context that fits in memory
     val temperature: Float = 0.7f,
     val maxTokens: Int = 512,
     val topP: Float = 0.9f,
     val topK: Int = 40,
     val nThreads: Int = 4,
+    val nThreadsBatch: Int = 0, // Prefill threads; 0 uses every core
+    val autotuneThreads: Boolean = true,
+    val pinThreads: Boolean = true, // Keep inference threads on the fastest cores
+    val warmup: Boolean = true, // Page in weights with a background dummy decode after load
+    val flashAttention: FlashAttentionMode = FlashAttentionMode.AUTO,
+    val useMmap: Boolean = true,
+    val useMlock: Boolean = false, // Subject to the device's memlock limit
+    val prefetchWeights: Boolean = true, // Read mmap'd weights ahead in layer order after load
+    val memoryBudgetMb: Int = 0, // Limit for hot-swapping models; 0 = derive from free memory
+    val modelCacheMb: Int = 0, // Cap for keeping replaced models parked; 0 = half the device RAM
     val nGpuLayers: Int = 0,
     val systemPrompt: String = ""
 )
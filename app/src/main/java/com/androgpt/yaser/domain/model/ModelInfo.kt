@@ -5,5 +5,6 @@ data class ModelInfo(
     val filePath: String,
     val size: Long,
     val isLoaded: Boolean = false,
-    val metadata: String = ""
+    val metadata: String = "",
+    val gguf: GgufMetadata? = null // Header metadata, null if the file could not be read
 )
@@ -0,0 +1,27 @@
+package com.androgpt.yaser.domain.model
+
+/**
+ * Progress of a model load. [progress] runs from 0 to 1 within each [stage].
+ */
+data class ModelLoadProgress(
+    val stage: Stage,
+    val progress: Float
+) {
+    enum class Stage(val nativeValue: Int) {
+        MAPPING(0),         // Opening the file, reading metadata, mapping weights
+        LOADING_TENSORS(1), // Reading tensor data, including CPU weight repacking
+        CONTEXT(2);         // Allocating the KV cache and compute buffers
+        
+        companion object {
+            fun fromNative(value: Int): Stage = entries.firstOrNull { it.nativeValue == value } ?: MAPPING
+        }
+    }
+    
+    /** Overall fraction, weighting tensor loading as the bulk of the work. */
+    val overall: Float
+        get() = when (stage) {
+            Stage.MAPPING -> 0.05f * progress
+            Stage.LOADING_TENSORS -> 0.05f + 0.85f * progress
+            Stage.CONTEXT -> 0.9f + 0.1f * progress
+        }
+}
@@ -0,0 +1,25 @@
+package com.androgpt.yaser.domain.model
+
+/**
+ * One message of a prompt, already in the chat template. Segments of stored messages
+ * carry the message id and role: the native layer keeps their token ids between turns,
+ * so only new or edited messages are tokenized. Unpinned segments are history the engine
+ * leaves out, oldest first, when the prompt does not fit the context.
+ */
+data class PromptSegment(
+    val text: String,
+    val messageId: Long = NO_MESSAGE,
+    val role: Role = Role.TEMPLATE,
+    val pinned: Boolean = true
+) {
+    enum class Role(val nativeValue: Int) {
+        TEMPLATE(-1), // template text or other content that is not a stored message
+        SYSTEM(0),
+        USER(1),
+        ASSISTANT(2)
+    }
+    
+    companion object {
+        const val NO_MESSAGE = -1L
+    }
+}
@@ -0,0 +1,24 @@
+package com.androgpt.yaser.domain.model
+
+/**
+ * Weight format a model can be requantized to on device. Q4_0 and IQ4_NL use the
+ * CPU repack kernels, which decode fastest; the K-quants keep more quality at a
+ * similar size.
+ */
+enum class QuantizationType(val nativeValue: Int) { // llama_ftype
+    Q4_0(2),
+    IQ4_NL(25),
+    Q4_K_M(15),
+    Q5_K_M(17),
+    Q6_K(18),
+    Q8_0(7);
+    
+    /** Lower-case ggml type name as reported in GGUF metadata, e.g. "q4_0". */
+    val tensorType: String
+        get() = when (this) {
+            Q4_K_M -> "q4_K"
+            Q5_K_M -> "q5_K"
+            Q6_K -> "q6_K"
+            else -> name.lowercase()
+        }
+}
@@ -0,0 +1,22 @@
+package com.androgpt.yaser.domain.model
+
+import kotlin.math.exp
+
+/**
+ * Natural-log probability of a generated token under the model's raw distribution,
+ * with the most likely alternatives at the same step (best first).
+ */
+data class TokenLogprobs(
+    val tokenId: Int,
+    val logprob: Float,
+    val alternatives: List<TokenAlternative>
+) {
+    val probability: Float
+        get() = exp(logprob)
+}
+
+data class TokenAlternative(
+    val tokenId: Int,
+    val text: String,
+    val logprob: Float
+)
@@ -1,6 +1,8 @@
 package com.androgpt.yaser.domain.repository
 
+import com.androgpt.yaser.domain.model.CandidateScore
 import com.androgpt.yaser.domain.model.GenerationState
+import com.androgpt.yaser.domain.model.PromptSegment
 import kotlinx.coroutines.flow.Flow
 
 interface InferenceRepository {
@@ -13,13 +15,43 @@ interface InferenceRepository {
         topK: Int
     ): Result<String>
     
+    /**
+     * With [topLogprobs] > 0 every [GenerationState.Generating] carries the log-probability
+     * of the latest token and up to that many alternatives. [loraAdapters] maps LoRA
+     * adapter files to scales for this request, e.g. a persona fine-tune.
+     */
     fun generateStream(
-        prompt: String,
+        promptSegments: List<PromptSegment>,
         temperature: Float,
         maxTokens: Int,
         topP: Float,
-        topK: Int
+        topK: Int,
+        topLogprobs: Int = 0,
+        loraAdapters: Map<String, Float> = emptyMap()
     ): Flow<GenerationState>
     
+    /**
+     * Number of unpinned history segments, oldest first, that would not be in the prompt
+     * verbatim beside [maxTokens] of reply and [reserveTokens] of prompt still to be added:
+     * summarized by an earlier compaction or left out.
+     */
+    suspend fun fitPrompt(promptSegments: List<PromptSegment>, maxTokens: Int, reserveTokens: Int): Int
+    
+    /**
+     * Summarizes the oldest history of the last conversation in the background once it
+     * fills most of the context. Arguments are chat template text, see LlamaEngine.
+     */
+    fun scheduleHistoryCompaction(instruction: String, memoryPrefix: String, memorySuffix: String)
+    
+    suspend fun forkAt(messageIndex: Int): Boolean
+    
+    /** Scores [candidates] as continuations of [prompt] without generating. */
+    suspend fun score(prompt: String, candidates: List<String>): Result<List<CandidateScore>>
+    
+    /** Loads a LoRA adapter on the current model ahead of use; false if it does not fit the model. */
+    suspend fun loadLoraAdapter(path: String): Boolean
+    
+    suspend fun unloadLoraAdapter(path: String)
+    
     suspend fun stopGeneration()
 }
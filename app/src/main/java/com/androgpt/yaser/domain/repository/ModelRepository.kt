@@ -2,12 +2,20 @@ package com.androgpt.yaser.domain.repository
 
 import com.androgpt.yaser.domain.model.ModelConfig
 import com.androgpt.yaser.domain.model.ModelInfo
+import com.androgpt.yaser.domain.model.ModelLoadProgress
+import com.androgpt.yaser.domain.model.QuantizationType
 import kotlinx.coroutines.flow.Flow
 
 interface ModelRepository {
     
     suspend fun loadModel(config: ModelConfig): Result<Unit>
     
+    /** Progress of the load in flight, null when no model is loading. */
+    fun getLoadProgress(): Flow<ModelLoadProgress?>
+    
+    /** Aborts the load in flight; its [loadModel] fails with a CancellationException. */
+    fun cancelLoad()
+    
     suspend fun unloadModel()
     
     fun getLoadedModel(): Flow<ModelInfo?>
@@ -17,4 +25,16 @@ interface ModelRepository {
     suspend fun deleteModel(filePath: String): Result<Unit>
     
     suspend fun getModelInfo(filePath: String): ModelInfo?
+    
+    /**
+     * Writes a copy of the model requantized to [type] beside it, named
+     * "<name>-<TYPE>.gguf", and returns it. Fails if that file already exists.
+     */
+    suspend fun quantizeModel(filePath: String, type: QuantizationType): Result<ModelInfo>
+    
+    /** Fraction of tensors converted by the quantization in flight, null when idle. */
+    fun getQuantizeProgress(): Flow<Float?>
+    
+    /** Stops the quantization in flight; its [quantizeModel] fails with a CancellationException. */
+    fun cancelQuantize()
 }
@@ -0,0 +1,21 @@
+package com.androgpt.yaser.domain.repository
+
+import com.androgpt.yaser.domain.model.Message
+
+interface RetrievalRepository {
+    
+    /**
+     * Returns up to [limit] of [candidates] most relevant to [query], in chronological
+     * order. Candidates not yet in the index are embedded on the way.
+     */
+    suspend fun findRelevantMessages(
+        conversationId: Long,
+        candidates: List<Message>,
+        query: String,
+        limit: Int
+    ): List<Message>
+    
+    suspend fun removeConversation(conversationId: Long)
+    
+    suspend fun clearAll()
+}
@@ -3,8 +3,10 @@ package com.androgpt.yaser.domain.usecase
 import android.util.Log
 import com.androgpt.yaser.domain.model.GenerationState
 import com.androgpt.yaser.domain.model.Message
+import com.androgpt.yaser.domain.model.PromptSegment
 import com.androgpt.yaser.domain.repository.ChatRepository
 import com.androgpt.yaser.domain.repository.InferenceRepository
+import com.androgpt.yaser.domain.repository.RetrievalRepository
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.firstOrNull
 import kotlinx.coroutines.flow.flow
@@ -12,11 +14,25 @@ import javax.inject.Inject
 
 class SendMessageUseCase @Inject constructor(
     private val chatRepository: ChatRepository,
-    private val inferenceRepository: InferenceRepository
+    private val inferenceRepository: InferenceRepository,
+    private val retrievalRepository: RetrievalRepository
 ) {
     
     companion object {
         private const val TAG = "SendMessageUseCase"
+        private const val RECALLED_MESSAGES = 3
+        // Prompt tokens set aside for recalled messages when fitting history to the context
+        private const val RECALL_RESERVE_TOKENS = 256
+        // The recalled block is pinned, so its excerpts are cut to fit that reserve before
+        // tokenizing: three characters per token, less the block's own markup
+        private const val RECALL_MAX_CHARS = (RECALL_RESERVE_TOKENS - 32) * 3
+        
+        // Summary of old turns that replaces them once the context fills up
+        private const val COMPACTION_INSTRUCTION =
+            "<|user|>Summarize our conversation so far in a few sentences. Keep names, facts, " +
+                "preferences and decisions that may matter later.<|end|>\n<|assistant|>"
+        private const val MEMORY_PREFIX = "<|system|>Summary of the earlier conversation:\n"
+        private const val MEMORY_SUFFIX = "<|end|>\n"
         
         // Phi-3 special tokens that should be removed from responses
         private val STOP_TOKENS = listOf(
@@ -73,47 +89,63 @@ class SendMessageUseCase @Inject constructor(
         return result
     }
     
-    private fun buildPrompt(messages: List<Message>, systemPrompt: String): String {
+    /**
+     * Builds the prompt as one segment per message. The engine checkpoints each segment
+     * boundary, so keeping earlier segments byte-identical between turns lets it reuse
+     * their KV cache instead of prefilling the whole conversation again. Message segments
+     * carry their id so their tokens are cached natively; history is unpinned, so the
+     * engine keeps as much of it as fits the context.
+     */
+    private fun buildPromptSegments(
+        history: List<Message>,
+        currentMessage: Message?,
+        systemPrompt: String,
+        recalled: List<Message> = emptyList()
+    ): List<PromptSegment> {
         // Microsoft Phi-3 uses ChatML format with specific tokens
         // Format: <|system|>system_message<|end|><|user|>user_message<|end|><|assistant|>
-        val promptBuilder = StringBuilder()
+        val segments = mutableListOf<PromptSegment>()
         
         // System prompt
-        promptBuilder.append("<|system|>")
-        promptBuilder.append(systemPrompt)
-        promptBuilder.append("<|end|>\n")
+        segments.add(PromptSegment("<|system|>$systemPrompt<|end|>\n", role = PromptSegment.Role.SYSTEM))
         
-        // Add conversation history - exclude the last message as it's the current query
-        val history = if (messages.size > 1) {
-            messages.dropLast(1).takeLast(10) // Keep last 10 messages for context
-        } else {
-            emptyList()
+        // Add conversation history
+        for (message in history) {
+            segments.add(messageSegment(message, pinned = false))
         }
         
-        for (message in history) {
-            if (message.isUser) {
-                promptBuilder.append("<|user|>")
-                promptBuilder.append(message.content)
-                promptBuilder.append("<|end|>\n")
-            } else {
-                promptBuilder.append("<|assistant|>")
-                promptBuilder.append(message.content)
-                promptBuilder.append("<|end|>\n")
+        // Earlier messages recalled from outside the kept history go after the stable history
+        // so they never invalidate its cached prefix
+        if (recalled.isNotEmpty()) {
+            val perMessage = RECALL_MAX_CHARS / recalled.size
+            val excerpts = recalled.joinToString("\n") { message ->
+                val speaker = if (message.isUser) "User" else "Assistant"
+                val content = message.content.trim()
+                val excerpt = if (content.length > perMessage) content.take(perMessage).trimEnd() + "…" else content
+                "$speaker: $excerpt"
             }
+            segments.add(PromptSegment("<|system|>Relevant earlier messages:\n$excerpts<|end|>\n"))
         }
         
         // Add current user message
-        val currentMessage = messages.lastOrNull()
         if (currentMessage != null && currentMessage.isUser) {
-            promptBuilder.append("<|user|>")
-            promptBuilder.append(currentMessage.content)
-            promptBuilder.append("<|end|>\n")
+            segments.add(messageSegment(currentMessage, pinned = true))
         }
         
         // Prompt for assistant response
-        promptBuilder.append("<|assistant|>")
+        segments.add(PromptSegment("<|assistant|>"))
         
-        return promptBuilder.toString()
+        return segments
+    }
+    
+    private fun messageSegment(message: Message, pinned: Boolean): PromptSegment {
+        // Unsaved messages (id 0) have no stable key to cache under
+        val messageId = if (message.id > 0) message.id else PromptSegment.NO_MESSAGE
+        return if (message.isUser) {
+            PromptSegment("<|user|>${message.content}<|end|>\n", messageId, PromptSegment.Role.USER, pinned)
+        } else {
+            PromptSegment("<|assistant|>${message.content}<|end|>\n", messageId, PromptSegment.Role.ASSISTANT, pinned)
+        }
     }
     
     operator fun invoke(
@@ -149,17 +181,43 @@ class SendMessageUseCase @Inject constructor(
         val messages = chatRepository.getMessagesForConversation(conversationId).firstOrNull() ?: emptyList()
         Log.d(TAG, "Retrieved ${messages.size} messages from history")
         
-        // Format prompt with TinyLlama chat template
-    val formattedPrompt = buildPrompt(messages, systemPrompt)
+        // Exclude the last message from history as it's the current query. The engine
+        // counts the tokens of the whole history and reports how many of the oldest
+        // messages are summarized or do not fit beside the reply and a recalled block.
+        val history = messages.dropLast(1)
+        val currentMessage = messages.lastOrNull()
+        val dropped = inferenceRepository.fitPrompt(
+            promptSegments = buildPromptSegments(history, currentMessage, systemPrompt),
+            maxTokens = maxTokens,
+            reserveTokens = RECALL_RESERVE_TOKENS
+        ).coerceAtLeast(0)
+        
+        // Recall relevant messages among those that did not fit
+        val olderMessages = history.take(dropped)
+        val recalled = if (olderMessages.isNotEmpty()) {
+            retrievalRepository.findRelevantMessages(
+                conversationId = conversationId,
+                candidates = olderMessages,
+                query = userMessage,
+                limit = RECALLED_MESSAGES
+            )
+        } else {
+            emptyList()
+        }
+        Log.d(TAG, "Recalled ${recalled.size} of ${olderMessages.size} older messages")
+        
+        // Format prompt with the Phi-3 chat template, one segment per message
+        // The full history again: the engine swaps summarized messages for their memory
+        val promptSegments = buildPromptSegments(history, currentMessage, systemPrompt, recalled)
         
         // Log the prompt for debugging
-        Log.d(TAG, "Formatted prompt (${formattedPrompt.length} chars):\n$formattedPrompt")
+        Log.d(TAG, "Formatted prompt (${promptSegments.size} segments):\n${promptSegments.joinToString("") { it.text }}")
         Log.d(TAG, "Message count: ${messages.size}")
         
         // Generate response
         Log.d(TAG, "Calling inferenceRepository.generateStream...")
         val responseFlow = inferenceRepository.generateStream(
-            prompt = formattedPrompt,
+            promptSegments = promptSegments,
             temperature = temperature,
             maxTokens = maxTokens,
             topP = topP,
@@ -182,7 +240,7 @@ class SendMessageUseCase @Inject constructor(
                         collapseWhitespace = false
                     )
                     Log.v(TAG, "Generating - cleaned text length: ${fullResponse.length}")
-                    emit(GenerationState.Generating(fullResponse))
+                    emit(GenerationState.Generating(fullResponse, state.lastToken))
                 }
                 is GenerationState.Complete -> {
                     // Clean the final response text
@@ -205,6 +263,9 @@ class SendMessageUseCase @Inject constructor(
                     
                     Log.d(TAG, "Emitting Complete state")
                     emit(GenerationState.Complete(fullResponse))
+                    
+                    // Summarize the oldest turns in the background once the context fills up
+                    inferenceRepository.scheduleHistoryCompaction(COMPACTION_INSTRUCTION, MEMORY_PREFIX, MEMORY_SUFFIX)
                 }
                 is GenerationState.Error -> {
                     Log.e(TAG, "Error state received: ${state.message}")
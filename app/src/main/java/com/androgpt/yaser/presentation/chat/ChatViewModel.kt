@@ -9,6 +9,7 @@ import com.androgpt.yaser.domain.model.ModelConfig
 import com.androgpt.yaser.domain.repository.ChatRepository
 import com.androgpt.yaser.domain.repository.InferenceRepository
 import com.androgpt.yaser.domain.repository.ModelRepository
+import com.androgpt.yaser.domain.repository.RetrievalRepository
 import com.androgpt.yaser.domain.usecase.SendMessageUseCase
 import com.androgpt.yaser.domain.util.ChatNameGenerator
 import dagger.hilt.android.lifecycle.HiltViewModel
@@ -22,6 +23,7 @@ class ChatViewModel @Inject constructor(
     private val chatRepository: ChatRepository,
     private val modelRepository: ModelRepository,
     private val inferenceRepository: InferenceRepository,
+    private val retrievalRepository: RetrievalRepository,
     private val sendMessageUseCase: SendMessageUseCase,
     private val generationPreferences: com.androgpt.yaser.data.local.GenerationPreferences
 ) : ViewModel() {
@@ -358,6 +360,7 @@ class ChatViewModel @Inject constructor(
     fun clearAllHistory() {
         viewModelScope.launch {
             chatRepository.clearAllHistory()
+            retrievalRepository.clearAll()
             // Start a new conversation after clearing
             startNewConversation()
         }
@@ -366,6 +369,7 @@ class ChatViewModel @Inject constructor(
     fun deleteConversation(conversationId: Long) {
         viewModelScope.launch {
             chatRepository.deleteConversation(conversationId)
+            retrievalRepository.removeConversation(conversationId)
             
             // If we deleted the current conversation, create a new one
             if (_currentConversationId.value == conversationId) {
@@ -20,6 +20,8 @@ import androidx.compose.ui.text.AnnotatedString
 import androidx.compose.ui.unit.dp
 import androidx.hilt.navigation.compose.hiltViewModel
 import com.androgpt.yaser.domain.model.ModelInfo
+import com.androgpt.yaser.domain.model.ModelLoadProgress
+import com.androgpt.yaser.domain.model.QuantizationType
 import java.io.File
 
 @OptIn(ExperimentalMaterial3Api::class)
@@ -31,6 +33,8 @@ fun ModelsScreen(
     val availableModels by viewModel.availableModels.collectAsState()
     val loadedModel by viewModel.loadedModel.collectAsState()
     val isLoading by viewModel.isLoading.collectAsState()
+    val loadProgress by viewModel.loadProgress.collectAsState()
+    val quantizeProgress by viewModel.quantizeProgress.collectAsState()
     val errorMessage by viewModel.errorMessage.collectAsState()
     
     var selectedTab by remember { mutableStateOf(0) }
@@ -65,8 +69,19 @@ fun ModelsScreen(
                 availableModels = availableModels,
                 loadedModel = loadedModel,
                 isLoading = isLoading,
+                loadProgress = loadProgress,
+                quantizeProgress = quantizeProgress,
                 errorMessage = errorMessage,
-                onLoadModel = onLoadModel,
+                onLoadModel = { model ->
+                    // Picking another model abandons the load in flight
+                    if (loadProgress != null) {
+                        viewModel.cancelLoad()
+                    }
+                    onLoadModel(model)
+                },
+                onCancelLoad = { viewModel.cancelLoad() },
+                onQuantizeModel = { model, type -> viewModel.quantizeModel(model.filePath, type) },
+                onCancelQuantize = { viewModel.cancelQuantize() },
                 onDeleteModel = { showDeleteDialog = it },
                 onClearError = { viewModel.clearError() },
                 modifier = Modifier.padding(paddingValues)
@@ -111,8 +126,13 @@ fun LocalModelsTab(
     availableModels: List<ModelInfo>,
     loadedModel: ModelInfo?,
     isLoading: Boolean,
+    loadProgress: ModelLoadProgress?,
+    quantizeProgress: Float?,
     errorMessage: String?,
     onLoadModel: (ModelInfo) -> Unit,
+    onCancelLoad: () -> Unit,
+    onQuantizeModel: (ModelInfo, QuantizationType) -> Unit,
+    onCancelQuantize: () -> Unit,
     onDeleteModel: (ModelInfo) -> Unit,
     onClearError: () -> Unit,
     modifier: Modifier = Modifier
@@ -136,6 +156,20 @@ fun LocalModelsTab(
             )
         }
         
+        if (loadProgress != null) {
+            LoadProgressRow(
+                progress = loadProgress,
+                onCancel = onCancelLoad
+            )
+        }
+        
+        if (quantizeProgress != null) {
+            QuantizeProgressRow(
+                progress = quantizeProgress,
+                onCancel = onCancelQuantize
+            )
+        }
+        
         if (errorMessage != null) {
             Snackbar(
                 modifier = Modifier.padding(16.dp),
@@ -265,6 +299,60 @@ fun LocalModelsTab(
                             )
                         }
                     }
+                    modelInfo.gguf?.let { gguf ->
+                        item("gguf_header") {
+                            Divider()
+                            Text("Model File:", style = MaterialTheme.typography.titleSmall)
+                        }
+                        item("gguf") {
+                            if (gguf.architecture.isNotEmpty()) {
+                                Text("Architecture: ${gguf.architecture}", style = MaterialTheme.typography.bodySmall)
+                            }
+                            if (gguf.parameterLabel.isNotEmpty()) {
+                                Text("Parameters: ${gguf.parameterLabel}", style = MaterialTheme.typography.bodySmall)
+                            }
+                            if (gguf.quantization.isNotEmpty()) {
+                                Text("Weights: ${gguf.quantization.uppercase()}", style = MaterialTheme.typography.bodySmall)
+                            }
+                            if (gguf.contextLength > 0) {
+                                Text("Training context: ${gguf.contextLength} tokens", style = MaterialTheme.typography.bodySmall)
+                            }
+                            if (gguf.blockCount > 0) {
+                                Text("Layers: ${gguf.blockCount}, embedding ${gguf.embeddingLength}", style = MaterialTheme.typography.bodySmall)
+                            }
+                            if (gguf.vocabSize > 0) {
+                                Text("Vocabulary: ${gguf.vocabSize} tokens", style = MaterialTheme.typography.bodySmall)
+                            }
+                            Text(
+                                text = if (gguf.chatTemplate.isNotEmpty()) "Chat template: included" else "Chat template: none",
+                                style = MaterialTheme.typography.bodySmall
+                            )
+                        }
+                        item("convert") {
+                            Divider()
+                            Text("Convert:", style = MaterialTheme.typography.titleSmall)
+                            Text(
+                                text = "Writes a requantized copy. Q4_0 decodes fastest on CPU; Q4_K_M keeps more quality.",
+                                style = MaterialTheme.typography.bodySmall,
+                                color = MaterialTheme.colorScheme.onSurfaceVariant
+                            )
+                            Row(horizontalArrangement = Arrangement.spacedBy(8.dp)) {
+                                listOf(QuantizationType.Q4_0, QuantizationType.Q4_K_M)
+                                    .filter { it.tensorType != gguf.quantization }
+                                    .forEach { type ->
+                                        OutlinedButton(
+                                            onClick = {
+                                                onQuantizeModel(modelInfo, type)
+                                                showInfoDialog = null
+                                            },
+                                            enabled = quantizeProgress == null
+                                        ) {
+                                            Text(type.name)
+                                        }
+                                    }
+                            }
+                        }
+                    }
                     item("file_size") {
                         Text("File Size: ${formatFileSize(modelInfo.size)}", style = MaterialTheme.typography.bodySmall)
                     }
@@ -451,6 +539,27 @@ fun EnhancedModelItem(
                         enabled = false
                     )
                 }
+                if (downloadableModel == null) {
+                    model.gguf?.let { gguf ->
+                        val shape = listOf(gguf.architecture, gguf.parameterLabel)
+                            .filter { it.isNotEmpty() }
+                            .joinToString(" · ")
+                        if (shape.isNotEmpty()) {
+                            AssistChip(
+                                onClick = { },
+                                label = { Text(shape, style = MaterialTheme.typography.labelSmall) },
+                                enabled = false
+                            )
+                        }
+                        if (gguf.quantization.isNotEmpty()) {
+                            AssistChip(
+                                onClick = { },
+                                label = { Text(gguf.quantization.uppercase(), style = MaterialTheme.typography.labelSmall) },
+                                enabled = false
+                            )
+                        }
+                    }
+                }
                 AssistChip(
                     onClick = { },
                     label = { Text(formatFileSize(model.size), style = MaterialTheme.typography.labelSmall) },
@@ -519,3 +628,65 @@ internal fun formatFileSize(bytes: Long): String {
         else -> "%.2f KB".format(kb)
     }
 }
+
+@Composable
+private fun QuantizeProgressRow(
+    progress: Float,
+    onCancel: () -> Unit
+) {
+    Row(
+        modifier = Modifier
+            .fillMaxWidth()
+            .padding(horizontal = 16.dp, vertical = 8.dp),
+        verticalAlignment = Alignment.CenterVertically
+    ) {
+        Column(modifier = Modifier.weight(1f)) {
+            Text(
+                text = "Converting model (${(progress * 100).toInt()}%)",
+                style = MaterialTheme.typography.bodyMedium
+            )
+            Spacer(modifier = Modifier.height(4.dp))
+            LinearProgressIndicator(
+                progress = progress,
+                modifier = Modifier.fillMaxWidth()
+            )
+        }
+        TextButton(onClick = onCancel) {
+            Text("Cancel")
+        }
+    }
+}
+
+@Composable
+private fun LoadProgressRow(
+    progress: ModelLoadProgress,
+    onCancel: () -> Unit
+) {
+    val stageLabel = when (progress.stage) {
+        ModelLoadProgress.Stage.MAPPING -> "Mapping model file"
+        ModelLoadProgress.Stage.LOADING_TENSORS -> "Loading tensors"
+        ModelLoadProgress.Stage.CONTEXT -> "Allocating context"
+    }
+    
+    Row(
+        modifier = Modifier
+            .fillMaxWidth()
+            .padding(horizontal = 16.dp, vertical = 8.dp),
+        verticalAlignment = Alignment.CenterVertically
+    ) {
+        Column(modifier = Modifier.weight(1f)) {
+            Text(
+                text = "$stageLabel (${(progress.overall * 100).toInt()}%)",
+                style = MaterialTheme.typography.bodyMedium
+            )
+            Spacer(modifier = Modifier.height(4.dp))
+            LinearProgressIndicator(
+                progress = progress.overall,
+                modifier = Modifier.fillMaxWidth()
+            )
+        }
+        TextButton(onClick = onCancel) {
+            Text("Cancel")
+        }
+    }
+}
@@ -3,8 +3,10 @@ package com.androgpt.yaser.presentation.models
 import androidx.lifecycle.ViewModel
 import androidx.lifecycle.viewModelScope
 import com.androgpt.yaser.domain.model.ModelInfo
+import com.androgpt.yaser.domain.model.QuantizationType
 import com.androgpt.yaser.domain.repository.ModelRepository
 import dagger.hilt.android.lifecycle.HiltViewModel
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.flow.MutableStateFlow
 import kotlinx.coroutines.flow.SharingStarted
 import kotlinx.coroutines.flow.asStateFlow
@@ -23,6 +25,12 @@ class ModelsViewModel @Inject constructor(
     val loadedModel = modelRepository.getLoadedModel()
         .stateIn(viewModelScope, SharingStarted.Lazily, null)
     
+    val loadProgress = modelRepository.getLoadProgress()
+        .stateIn(viewModelScope, SharingStarted.Lazily, null)
+    
+    val quantizeProgress = modelRepository.getQuantizeProgress()
+        .stateIn(viewModelScope, SharingStarted.Lazily, null)
+    
     private val _isLoading = MutableStateFlow(false)
     val isLoading = _isLoading.asStateFlow()
     
@@ -57,6 +65,26 @@ class ModelsViewModel @Inject constructor(
         }
     }
     
+    fun cancelLoad() {
+        modelRepository.cancelLoad()
+    }
+    
+    fun quantizeModel(filePath: String, type: QuantizationType) {
+        viewModelScope.launch {
+            modelRepository.quantizeModel(filePath, type).onSuccess {
+                refreshModels()
+            }.onFailure {
+                if (it !is CancellationException) {
+                    _errorMessage.value = "Conversion failed: ${it.message}"
+                }
+            }
+        }
+    }
+    
+    fun cancelQuantize() {
+        modelRepository.cancelQuantize()
+    }
+    
     fun clearError() {
         _errorMessage.value = null
     }
@@ -36,7 +36,10 @@ fun SettingsScreen(
     val mirostatTau by viewModel.mirostatTau.collectAsState()
     val mirostatEta by viewModel.mirostatEta.collectAsState()
     val contextLength by viewModel.contextLength.collectAsState()
+    val autoContextLength by viewModel.autoContextLength.collectAsState()
     val cpuThreads by viewModel.cpuThreads.collectAsState()
+    val batchThreads by viewModel.batchThreads.collectAsState()
+    val autotuneThreads by viewModel.autotuneThreads.collectAsState()
     val gpuLayers by viewModel.gpuLayers.collectAsState()
     val systemPrompt by viewModel.systemPrompt.collectAsState()
     val message by viewModel.message.collectAsState()
@@ -371,21 +374,42 @@ fun SettingsScreen(
                         style = MaterialTheme.typography.titleMedium
                     )
                     
-                    SettingSlider(
-                        label = "Context Length",
-                        value = contextLength.toFloat(),
-                        onValueChange = { viewModel.setContextLength(it.toInt()) },
-                        valueRange = 512f..8192f,
-                        steps = 7,
-                        valueFormatter = { it.toInt().toString() },
-                        info = "Maximum context window for the model.\n\n" +
-                                "• 512-2048: Lower memory usage, shorter conversations\n" +
-                                "• 2048-4096: Balanced (recommended for most models)\n" +
-                                "• 4096-8192: Long conversations (requires more RAM)\n\n" +
-                                "⚠️ Requires model reload to take effect.\n" +
-                                "Phi-3 4K models: use 2048-4096\n" +
-                                "Phi-3 128K models: can use up to 8192+"
-                    )
+                    Row(
+                        modifier = Modifier.fillMaxWidth(),
+                        horizontalArrangement = Arrangement.SpaceBetween,
+                        verticalAlignment = Alignment.CenterVertically
+                    ) {
+                        Column(modifier = Modifier.weight(1f)) {
+                            Text("Auto Context Length")
+                            Text(
+                                text = "Use the largest context, batch and KV cache type that fit in free memory",
+                                style = MaterialTheme.typography.bodySmall,
+                                color = MaterialTheme.colorScheme.onSurfaceVariant
+                            )
+                        }
+                        Switch(
+                            checked = autoContextLength,
+                            onCheckedChange = { viewModel.setAutoContextLength(it) }
+                        )
+                    }
+                    
+                    if (!autoContextLength) {
+                        SettingSlider(
+                            label = "Context Length",
+                            value = contextLength.toFloat(),
+                            onValueChange = { viewModel.setContextLength(it.toInt()) },
+                            valueRange = 512f..8192f,
+                            steps = 7,
+                            valueFormatter = { it.toInt().toString() },
+                            info = "Maximum context window for the model.\n\n" +
+                                    "• 512-2048: Lower memory usage, shorter conversations\n" +
+                                    "• 2048-4096: Balanced (recommended for most models)\n" +
+                                    "• 4096-8192: Long conversations (requires more RAM)\n\n" +
+                                    "⚠️ Requires model reload to take effect.\n" +
+                                    "Phi-3 4K models: use 2048-4096\n" +
+                                    "Phi-3 128K models: can use up to 8192+"
+                        )
+                    }
                     
                     Divider()
                     
@@ -396,16 +420,51 @@ fun SettingsScreen(
                         valueRange = 1f..8f,
                         steps = 6,
                         valueFormatter = { it.toInt().toString() },
-                        info = "Number of CPU threads for inference.\n\n" +
+                        info = "Number of CPU threads for generating tokens.\n\n" +
                                 "• 1-2: Low CPU usage, slower\n" +
                                 "• 4: Balanced (recommended)\n" +
                                 "• 6-8: Faster inference, higher CPU usage\n\n" +
                                 "⚠️ Requires model reload to take effect.\n" +
-                                "Match to your device's CPU cores for best performance."
+                                "Generation is memory-bound and is often fastest on fewer threads than cores."
                     )
                     
                     Divider()
                     
+                    SettingSlider(
+                        label = "Prompt Threads",
+                        value = batchThreads.toFloat(),
+                        onValueChange = { viewModel.setBatchThreads(it.toInt()) },
+                        valueRange = 1f..8f,
+                        steps = 6,
+                        valueFormatter = { it.toInt().toString() },
+                        info = "Number of CPU threads for processing the prompt.\n\n" +
+                                "Prompt processing is compute-bound and usually benefits from every core.\n\n" +
+                                "⚠️ Requires model reload to take effect."
+                    )
+                    
+                    Divider()
+                    
+                    Row(
+                        modifier = Modifier.fillMaxWidth(),
+                        horizontalArrangement = Arrangement.SpaceBetween,
+                        verticalAlignment = Alignment.CenterVertically
+                    ) {
+                        Column(modifier = Modifier.weight(1f)) {
+                            Text("Auto-tune Threads")
+                            Text(
+                                text = "Benchmark thread counts on first load of each model and reuse the fastest",
+                                style = MaterialTheme.typography.bodySmall,
+                                color = MaterialTheme.colorScheme.onSurfaceVariant
+                            )
+                        }
+                        Switch(
+                            checked = autotuneThreads,
+                            onCheckedChange = { viewModel.setAutotuneThreads(it) }
+                        )
+                    }
+                    
+                    Divider()
+                    
                     SettingSlider(
                         label = "GPU Layers",
                         value = gpuLayers.toFloat(),
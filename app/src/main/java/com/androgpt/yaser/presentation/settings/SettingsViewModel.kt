@@ -8,6 +8,7 @@ import com.androgpt.yaser.domain.repository.ChatRepository
 import com.androgpt.yaser.domain.repository.ModelRepository
 import com.androgpt.yaser.domain.usecase.LoadModelUseCase
 import dagger.hilt.android.lifecycle.HiltViewModel
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.flow.*
 import kotlinx.coroutines.launch
 import kotlin.math.roundToInt
@@ -80,9 +81,18 @@ class SettingsViewModel @Inject constructor(
     private val _contextLength = MutableStateFlow(2048)
     val contextLength = _contextLength.asStateFlow()
     
+    private val _autoContextLength = MutableStateFlow(true)
+    val autoContextLength = _autoContextLength.asStateFlow()
+    
     private val _cpuThreads = MutableStateFlow(detectCpuThreads())
     val cpuThreads = _cpuThreads.asStateFlow()
     
+    private val _batchThreads = MutableStateFlow(Runtime.getRuntime().availableProcessors().coerceIn(1, 8))
+    val batchThreads = _batchThreads.asStateFlow()
+    
+    private val _autotuneThreads = MutableStateFlow(true)
+    val autotuneThreads = _autotuneThreads.asStateFlow()
+    
     private val _gpuLayers = MutableStateFlow(0)
     val gpuLayers = _gpuLayers.asStateFlow()
     
@@ -180,10 +190,22 @@ class SettingsViewModel @Inject constructor(
         _contextLength.value = value.coerceIn(128, 8192)
     }
     
+    fun setAutoContextLength(enabled: Boolean) {
+        _autoContextLength.value = enabled
+    }
+    
     fun setCpuThreads(value: Int) {
         _cpuThreads.value = value.coerceIn(1, 16)
     }
     
+    fun setBatchThreads(value: Int) {
+        _batchThreads.value = value.coerceIn(1, 16)
+    }
+    
+    fun setAutotuneThreads(enabled: Boolean) {
+        _autotuneThreads.value = enabled
+    }
+    
     fun setGpuLayers(value: Int) {
         _gpuLayers.value = value.coerceIn(0, 100)
     }
@@ -224,10 +246,12 @@ class SettingsViewModel @Inject constructor(
                 name = modelName,
                 filePath = modelPath,
                 size = modelSize,
-                contextLength = _contextLength.value,
+                contextLength = if (_autoContextLength.value) 0 else _contextLength.value,
                 temperature = currentSettings.temperature,
                 maxTokens = currentSettings.maxTokens,
                 nThreads = _cpuThreads.value,
+                nThreadsBatch = _batchThreads.value,
+                autotuneThreads = _autotuneThreads.value,
                 nGpuLayers = _gpuLayers.value,
                 systemPrompt = _systemPrompt.value
             )
@@ -237,7 +261,11 @@ class SettingsViewModel @Inject constructor(
                     _message.value = "Model loaded successfully"
                 }
                 .onFailure {
-                    _message.value = "Failed to load model: ${it.message}"
+                    _message.value = if (it is CancellationException) {
+                        "Model load cancelled"
+                    } else {
+                        "Failed to load model: ${it.message}"
+                    }
                 }
             
             _isLoading.value = false